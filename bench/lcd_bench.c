@@ -0,0 +1,709 @@
+/*============================================================================
+
+    lcd_bench.c
+
+    A benchmark for the LCD "class". It runs a set of standard workloads
+    against the mock transport, with a model of the HD44780 attached to
+    every display, and reports what each one costs: bytes on the wire,
+    system calls (writes, reads and sleeps), time on the simulated bus,
+    the latency of the library calls, and the CPU time they used. It
+    also reports timing violations seen by the model, which should always
+    be zero.
+
+    Nothing here touches real hardware, so the numbers are repeatable,
+    and suitable for comparing one version of the library with another.
+    With -o, each workload's byte stream is also recorded, with a mark
+    at the start of every frame, in a trace file named after the prefix,
+    the workload and, if there are several, the bus -- for lcd_trace to
+    decode, or to compare with another version's.
+
+    Usage: lcd_bench [-n frames] [-w workload] [-t datasheet|conservative]
+                     [-b bus_hz] [-f fosc_hz] [-p] [-o trace_prefix]
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/hd44780_emu.h"
+#include "../lib/lcd_layout.h"
+#include "../lib/lcd_manager.h"
+#include "../lib/lcd_widget.h"
+#include "../lib/liblcd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_ADDR 0x27
+#define BENCH_MAX_DISPLAYS 8
+#define BENCH_MAX_MODELS (2 * BENCH_MAX_DISPLAYS)
+#define BENCH_BUSES 2
+#define BENCH_BARS 4
+#define BENCH_FIELDS 6
+
+typedef struct BENCH_OPTS {
+    int frames;
+    int preset;
+    long bus_hz;
+    long fosc_hz;
+    _Bool busy_poll;
+    const char *trace; // The prefix of the trace files, or NULL
+} BENCH_OPTS;
+
+/** Everything a workload works on. A workload uses either one display
+    (lcd) or the manager, not both. */
+typedef struct BENCH {
+    const BENCH_OPTS *opts;
+    LCD_TRANSPORT *bus[BENCH_BUSES];
+    LCD_TRANSPORT *trace[BENCH_BUSES]; // In front of bus, when recording
+    int nbuses;
+    HD44780_EMU *emu[BENCH_MAX_MODELS];
+    int nemu;
+    LCD *lcd;
+    LCD_MANAGER *manager;
+    LCD_BAR *bar[BENCH_BARS]; // Widgets, for the workloads that use them
+    LCD_BIGNUM *bignum;
+    LCD_LAYOUT *layout;
+    int field[BENCH_FIELDS];
+    char *error;
+} BENCH;
+
+/** The totals for one workload. */
+typedef struct BENCH_RESULT {
+    long bytes;
+    long writes;
+    long calls;
+    long long bus_ns;
+    long long *latency_ns;
+    double cpu_s;
+    long violations;
+} BENCH_RESULT;
+
+typedef struct BENCH_WORKLOAD {
+    const char *name;
+    const char *description;
+    int rows;
+    int cols;
+    int displays; // 0 means one display, not using the manager
+    void (*frame)(BENCH *bench, int frame);
+} BENCH_WORKLOAD;
+
+/*============================================================================
+  bench_now_ns
+============================================================================*/
+static long long bench_now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*============================================================================
+  bench_fill
+
+  Write a row of text that's different on every frame, padded out to
+  the whole width of the display.
+
+============================================================================*/
+static void bench_fill(LCD *lcd, int row, int cols, int seed) {
+    unsigned char s[41];
+    for (int i = 0; i < cols && i < 40; i++)
+        s[i] = 'A' + (seed + i * 7) % 26;
+    s[cols < 40 ? cols : 40] = 0;
+    lcd_write_string_at(lcd, row, 0, s, 0);
+}
+
+/*============================================================================
+  bench_full
+
+  Every cell of a 20x4 display (or a 40x4, for "wide") changes on every
+  frame.
+
+============================================================================*/
+static void bench_full(BENCH *bench, int frame) {
+    for (int row = 0; row < bench->lcd->rows; row++)
+        bench_fill(bench->lcd, row, bench->lcd->cols, frame + row);
+    lcd_flush(bench->lcd);
+}
+
+/*============================================================================
+
+  bench_tick
+
+  A clock: the time and date on a 16x2 display, advancing by one
+  second per frame. Usually only one or two cells change.
+
+============================================================================*/
+static void bench_tick(BENCH *bench, int frame) {
+    char s[20];
+    int t = 12 * 3600 + frame;
+    snprintf(s,
+             sizeof(s),
+             "%02d:%02d:%02d",
+             (t / 3600) % 24,
+             (t / 60) % 60,
+             t % 60);
+    lcd_write_string_at(bench->lcd, 0, 4, (unsigned char *)s, 0);
+    snprintf(s, sizeof(s), "2020/06/%02d", 1 + (t / 86400) % 28);
+    lcd_write_string_at(bench->lcd, 1, 3, (unsigned char *)s, 0);
+    lcd_flush(bench->lcd);
+}
+
+/*============================================================================
+
+  bench_marquee
+
+  A message that scrolls one character to the left on every frame,
+  across the top line of a 16x2 display.
+
+============================================================================*/
+static void bench_marquee(BENCH *bench, int frame) {
+    static const char msg[] =
+        "*** The quick brown fox jumps over the lazy dog ***   ";
+    int len = sizeof(msg) - 1;
+    unsigned char s[17];
+    for (int i = 0; i < 16; i++)
+        s[i] = msg[(frame + i) % len];
+    s[16] = 0;
+    lcd_write_string_at(bench->lcd, 0, 0, s, 0);
+    lcd_flush(bench->lcd);
+}
+
+/*============================================================================
+
+  bench_ticker
+
+  The same message as the marquee, scrolled with lcd_set_marquee(), so
+  that the display shift does the work.
+
+============================================================================*/
+static void bench_ticker(BENCH *bench, int frame) {
+    static const unsigned char msg[] =
+        "*** The quick brown fox jumps over the lazy dog ***   ";
+    if (frame == 0)
+        lcd_set_marquee(bench->lcd, 0, msg);
+    else
+        lcd_marquee_step(bench->lcd);
+    lcd_flush(bench->lcd);
+}
+
+/*============================================================================
+
+  bench_glyphs
+
+  Custom characters on a 16x2 display: a bar graph across the top row,
+  drawn with partly-filled cells, and on the bottom row a spinner that
+  cycles through four glyphs and a battery whose bitmap is redefined
+  on every frame. That's nine glyphs for eight slots.
+
+============================================================================*/
+static void bench_glyphs(BENCH *bench, int frame) {
+    LCD *lcd = bench->lcd;
+    unsigned char bitmap[8];
+    if (frame == 0) {
+        for (int n = 1; n < 5; n++) {
+            memset(bitmap, (0x1F << (5 - n)) & 0x1F, sizeof(bitmap));
+            lcd_define_glyph(lcd, n, bitmap, '|');
+        }
+        static const unsigned char spin[4][8] = {
+            {0, 0x04, 0x04, 0x04, 0x04, 0x04, 0, 0},
+            {0, 0x01, 0x02, 0x04, 0x08, 0x10, 0, 0},
+            {0, 0, 0, 0x1F, 0, 0, 0, 0},
+            {0, 0x10, 0x08, 0x04, 0x02, 0x01, 0, 0},
+        };
+        for (int n = 0; n < 4; n++)
+            lcd_define_glyph(lcd, 10 + n, spin[n], '*');
+        lcd_write_string_at(lcd, 1, 2, (unsigned char *)"Level", 0);
+    }
+
+    // The bar grows and shrinks across 16 cells of 5 columns each
+    int level = frame % 160;
+    if (level >= 80)
+        level = 160 - level;
+    for (int col = 0; col < 16; col++) {
+        int n = level - 5 * col;
+        if (n >= 5)
+            lcd_write_char_at(lcd, 0, col, 0xFF);
+        else if (n <= 0)
+            lcd_write_char_at(lcd, 0, col, ' ');
+        else
+            lcd_write_glyph_at(lcd, 0, col, n);
+    }
+
+    lcd_write_glyph_at(lcd, 1, 0, 10 + frame % 4);
+    bitmap[0] = 0x0E;
+    for (int r = 1; r < 7; r++)
+        bitmap[r] = 7 - r < frame % 7 ? 0x1F : 0x11;
+    bitmap[7] = 0x1F;
+    lcd_define_glyph(lcd, 20, bitmap, 'B');
+    lcd_write_glyph_at(lcd, 1, 15, 20);
+    lcd_flush(lcd);
+}
+
+/*============================================================================
+
+  bench_dash
+
+  A sensor dashboard on a 20x4 display, updated as if at 20Hz: a reading
+  in big digits, two vertical bars beside it, and two horizontal bars
+  underneath. The bars drift by a pixel or two per frame, and the
+  reading changes every ten frames.
+
+============================================================================*/
+static void bench_dash(BENCH *bench, int frame) {
+    LCD *lcd = bench->lcd;
+    if (frame == 0) {
+        bench->bignum = lcd_bignum_create(lcd, 0, 0, 2, 3);
+        bench->bar[0] = lcd_bar_create(lcd, 1, 14, 2, 1, 100);
+        bench->bar[1] = lcd_bar_create(lcd, 1, 16, 2, 1, 100);
+        bench->bar[2] = lcd_bar_create(lcd, 2, 0, 20, 0, 100);
+        bench->bar[3] = lcd_bar_create(lcd, 3, 0, 20, 0, 100);
+    }
+    char s[10];
+    snprintf(s, sizeof(s), "%3d", frame / 10 % 1000);
+    lcd_bignum_set(bench->bignum, s);
+    for (int i = 0; i < BENCH_BARS; i++) {
+        // A triangle wave, with a different period for each bar
+        int period = 2 * (100 + 37 * i);
+        int t = (frame * (i + 1) + 50 * i) % period;
+        lcd_bar_set(bench->bar[i], t < period / 2 ? t : period - t);
+    }
+    lcd_flush(lcd);
+}
+
+/*============================================================================
+
+  bench_telemetry
+
+  A telemetry screen on a 20x4 display, described with a layout, and
+  updated once a (simulated) second: a clock, an uptime counter, a
+  temperature and a load average that drift slowly, a fan speed, and
+  a status that changes now and then.
+
+============================================================================*/
+static void bench_telemetry(BENCH *bench, int frame) {
+    LCD_LAYOUT *layout = bench->layout;
+    int *field = bench->field;
+    if (frame == 0) {
+        layout = bench->layout = lcd_layout_create(bench->lcd);
+        field[0] = lcd_layout_time(layout, 0, 0, LCD_LAYOUT_HMS);
+        lcd_layout_label(layout, 0, 10, "up");
+        field[1] = lcd_layout_int(layout, 0, 13, 7, 0);
+        lcd_layout_label(layout, 1, 0, "Temp");
+        field[2] = lcd_layout_fixed(layout, 1, 5, 5, 1, 0);
+        lcd_layout_label(layout, 1, 10, "C  Fan");
+        field[3] = lcd_layout_int(layout, 1, 16, 4, 0);
+        lcd_layout_label(layout, 2, 0, "Load");
+        field[4] = lcd_layout_fixed(layout, 2, 5, 5, 2, 0);
+        field[5] = lcd_layout_string(layout, 3, 0, 20, LCD_LAYOUT_CENTRE);
+    }
+    static const char *const status[] = {"All systems normal", "Backup running",
+                                          "Fan check", "Link degraded"};
+    lcd_layout_set_int(layout, field[0], (12 * 3600 + frame) % 86400);
+    lcd_layout_set_int(layout, field[1], frame);
+    lcd_layout_set_int(layout, field[2], 400 + (frame / 7) % 150);
+    lcd_layout_set_int(layout, field[3], 1200 + 10 * ((frame / 13) % 40));
+    lcd_layout_set_int(layout, field[4], 50 + (frame * 3) % 200);
+    lcd_layout_set_string(layout, field[5], status[(frame / 100) % 4]);
+    lcd_flush(bench->lcd);
+}
+
+/*============================================================================
+
+  bench_multi
+
+  Eight 16x2 displays, four on each of two buses, driven by the manager.
+  Every cell of every display changes on every frame.
+
+============================================================================*/
+static void bench_multi(BENCH *bench, int frame) {
+    for (int i = 0; i < lcd_manager_count(bench->manager); i++) {
+        LCD *lcd = lcd_manager_get(bench->manager, i);
+        for (int row = 0; row < lcd->rows; row++)
+            bench_fill(lcd, row, lcd->cols, frame + row + i);
+    }
+    lcd_manager_flush(bench->manager);
+}
+
+static const BENCH_WORKLOAD bench_workloads[] = {
+    {"full", "full-screen refresh, 20x4", 4, 20, 0, bench_full},
+    {"wide", "full-screen refresh, 40x4", 4, 40, 0, bench_full},
+    {"tick", "clock tick, 16x2", 2, 16, 0, bench_tick},
+    {"marquee", "scrolling marquee, 16x2", 2, 16, 0, bench_marquee},
+    {"ticker", "marquee by display shift, 16x2", 2, 16, 0, bench_ticker},
+    {"glyphs", "bar graph and icons, 16x2", 2, 16, 0, bench_glyphs},
+    {"dash", "widget dashboard, 20x4", 4, 20, 0, bench_dash},
+    {"fields", "telemetry layout, 20x4", 4, 20, 0, bench_telemetry},
+    {"multi", "8 x 16x2 on 2 buses", 2, 16, 8, bench_multi},
+};
+
+#define BENCH_NWORKLOADS \
+    (int)(sizeof(bench_workloads) / sizeof(bench_workloads[0]))
+
+/*============================================================================
+  bench_emu
+============================================================================*/
+static HD44780_EMU *bench_emu(BENCH *bench, LCD_TRANSPORT *bus, int addr) {
+    HD44780_EMU *emu = hd44780_emu_create();
+    hd44780_emu_set_fosc(emu, bench->opts->fosc_hz);
+    lcd_transport_mock_attach(bus, addr, emu);
+    bench->emu[bench->nemu++] = emu;
+    return emu;
+}
+
+/*============================================================================
+
+  bench_dual
+
+  Wire a 40x4 display's second controller in place of R/W, which is
+  how the two-controller backpacks do it, and attach a model for it.
+
+============================================================================*/
+static void
+bench_dual(BENCH *bench, LCD *lcd, LCD_TRANSPORT *bus, int addr) {
+    static const int d[4] = {4, 5, 6, 7};
+    LCD_PCF8574_PINS pins;
+    lcd_get_pins(lcd, &pins);
+    pins.e2 = pins.rw;
+    pins.rw = -1;
+    lcd_set_pins(lcd, &pins);
+    // R/W of both models is wired to an output that doesn't exist, so
+    //  it's always low
+    hd44780_emu_set_pins(bench->emu[bench->nemu - 1], pins.rs, 8, pins.e, d);
+    HD44780_EMU *emu = hd44780_emu_create();
+    hd44780_emu_set_fosc(emu, bench->opts->fosc_hz);
+    hd44780_emu_set_pins(emu, pins.rs, 8, pins.e2, d);
+    lcd_transport_mock_attach_second(bus, addr, emu);
+    bench->emu[bench->nemu++] = emu;
+}
+
+/*============================================================================
+
+  bench_record
+
+  Put a trace transport in front of each bus, if traces were asked for.
+  The displays are given whatever bench_bus() returns.
+
+============================================================================*/
+static _Bool bench_record(BENCH *bench, const BENCH_WORKLOAD *w) {
+    if (!bench->opts->trace)
+        return 1;
+    for (int i = 0; i < bench->nbuses; i++) {
+        char path[4096];
+        if (bench->nbuses > 1)
+            snprintf(path,
+                     sizeof(path),
+                     "%s-%s-%d.trace",
+                     bench->opts->trace,
+                     w->name,
+                     i);
+        else
+            snprintf(path,
+                     sizeof(path),
+                     "%s-%s.trace",
+                     bench->opts->trace,
+                     w->name);
+        bench->trace[i] =
+            lcd_transport_trace_create(bench->bus[i], path, &bench->error);
+        if (!bench->trace[i])
+            return 0;
+    }
+    return 1;
+}
+
+/*============================================================================
+  bench_bus
+============================================================================*/
+static LCD_TRANSPORT *bench_bus(BENCH *bench, int i) {
+    return bench->trace[i] ? bench->trace[i] : bench->bus[i];
+}
+
+/*============================================================================
+
+  bench_setup
+
+  Create the buses, models and displays for a workload, and initialize
+  the displays. Returns 0, having written bench->error, if that fails.
+
+============================================================================*/
+static _Bool bench_setup(BENCH *bench, const BENCH_WORKLOAD *w) {
+    const BENCH_OPTS *opts = bench->opts;
+    LCD_TIMING timing;
+    lcd_get_timing_preset(opts->preset, &timing);
+    timing.bus_hz = opts->bus_hz;
+    bench->nbuses = w->displays ? BENCH_BUSES : 1;
+    for (int i = 0; i < bench->nbuses; i++) {
+        bench->bus[i] = lcd_transport_mock_create();
+        lcd_transport_mock_set_bus_hz(bench->bus[i], opts->bus_hz);
+    }
+    if (!bench_record(bench, w))
+        return 0;
+    if (!w->displays) {
+        bench_emu(bench, bench->bus[0], BENCH_ADDR);
+        bench->lcd = lcd_create(BENCH_ADDR, w->rows, w->cols);
+        if (bench->lcd->controllers > 1)
+            bench_dual(bench, bench->lcd, bench->bus[0], BENCH_ADDR);
+        lcd_set_timing(bench->lcd, &timing);
+        lcd_set_busy_poll(bench->lcd, opts->busy_poll);
+        if (!lcd_init_transport(
+                bench->lcd, bench_bus(bench, 0), &bench->error))
+            return 0;
+        lcd_set_deferred(bench->lcd, 1);
+        return 1;
+    }
+    bench->manager = lcd_manager_create();
+    lcd_manager_set_timing(bench->manager, &timing);
+    for (int i = 0; i < w->displays; i++) {
+        int bus = i % bench->nbuses;
+        int addr = 0x20 + i / bench->nbuses;
+        bench_emu(bench, bench->bus[bus], addr);
+        LCD *lcd = lcd_manager_add(bench->manager,
+                                   bench_bus(bench, bus),
+                                   addr,
+                                   w->rows,
+                                   w->cols,
+                                   &bench->error);
+        if (!lcd)
+            return 0;
+    }
+    return 1;
+}
+
+/*============================================================================
+  bench_teardown
+============================================================================*/
+static void bench_teardown(BENCH *bench) {
+    for (int i = 0; i < BENCH_BARS; i++)
+        lcd_bar_destroy(bench->bar[i]);
+    lcd_bignum_destroy(bench->bignum);
+    lcd_layout_destroy(bench->layout);
+    lcd_destroy(bench->lcd);
+    lcd_manager_destroy(bench->manager);
+    for (int i = 0; i < bench->nemu; i++)
+        hd44780_emu_destroy(bench->emu[i]);
+    for (int i = 0; i < bench->nbuses; i++) {
+        lcd_transport_destroy(bench->trace[i]);
+        lcd_transport_destroy(bench->bus[i]);
+    }
+    free(bench->error);
+}
+
+/*============================================================================
+
+  bench_collect
+
+  Add what the buses have recorded since the last call to the totals,
+  and discard the records, so that long runs don't use a lot of memory.
+
+============================================================================*/
+static void bench_collect(BENCH *bench, BENCH_RESULT *r) {
+    for (int i = 0; i < bench->nbuses; i++) {
+        int count;
+        lcd_transport_mock_records(bench->bus[i], &count);
+        r->bytes += count;
+        r->writes += lcd_transport_mock_writes(bench->bus[i]);
+        r->calls += lcd_transport_mock_calls(bench->bus[i]);
+        lcd_transport_mock_reset(bench->bus[i]);
+    }
+}
+
+/*============================================================================
+
+  bench_bus_now
+
+  The time on the simulated buses. When there are several, they run in
+  parallel, so the slowest one is the one that matters.
+
+============================================================================*/
+static long long bench_bus_now(BENCH *bench) {
+    long long t = 0;
+    for (int i = 0; i < bench->nbuses; i++) {
+        long long now = lcd_transport_mock_now(bench->bus[i]);
+        if (now > t)
+            t = now;
+    }
+    return t;
+}
+
+/*============================================================================
+  bench_cmp
+============================================================================*/
+static int bench_cmp(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*============================================================================
+  bench_percentile
+============================================================================*/
+static long long bench_percentile(const long long *sorted, int n, int pc) {
+    int i = (int)((long long)n * pc / 100);
+    return sorted[i < n ? i : n - 1];
+}
+
+/*============================================================================
+
+  bench_run
+
+  Run one workload, and print a line of results. Returns 0 if the
+  workload couldn't be set up, or if the model saw timing violations.
+
+============================================================================*/
+static _Bool bench_run(const BENCH_OPTS *opts, const BENCH_WORKLOAD *w) {
+    BENCH bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.opts = opts;
+    if (!bench_setup(&bench, w)) {
+        fprintf(stderr, "%s: %s\n", w->name, bench.error);
+        bench_teardown(&bench);
+        return 0;
+    }
+
+    // Initialization is not part of the workload
+    BENCH_RESULT r;
+    memset(&r, 0, sizeof(r));
+    bench_collect(&bench, &r);
+    memset(&r, 0, sizeof(r));
+    r.latency_ns = malloc(opts->frames * sizeof(long long));
+    long long bus_start = bench_bus_now(&bench);
+    long long cpu_start = bench_now_ns(CLOCK_PROCESS_CPUTIME_ID);
+    for (int f = 0; f < opts->frames; f++) {
+        for (int i = 0; i < bench.nbuses; i++)
+            if (bench.trace[i])
+                lcd_transport_trace_mark(bench.trace[i]);
+        long long start = bench_now_ns(CLOCK_MONOTONIC);
+        w->frame(&bench, f);
+        r.latency_ns[f] = bench_now_ns(CLOCK_MONOTONIC) - start;
+        bench_collect(&bench, &r);
+    }
+    r.cpu_s = (bench_now_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start) / 1e9;
+    r.bus_ns = bench_bus_now(&bench) - bus_start;
+    for (int i = 0; i < bench.nemu; i++)
+        r.violations += hd44780_emu_violations(bench.emu[i]);
+
+    qsort(r.latency_ns, opts->frames, sizeof(long long), bench_cmp);
+    double n = opts->frames;
+    printf("%-8s %9.1f %8.1f %7.2f %7.2f %9.1f %8lld %8lld %8.2f %5ld\n",
+           w->name,
+           r.bus_ns > 0 ? n * 1e9 / r.bus_ns : 0.0,
+           r.bytes / n,
+           r.writes / n,
+           r.calls / n,
+           r.bus_ns / n / 1000,
+           bench_percentile(r.latency_ns, opts->frames, 50),
+           bench_percentile(r.latency_ns, opts->frames, 99),
+           r.cpu_s * 1e6 / n,
+           r.violations);
+
+    free(r.latency_ns);
+    bench_teardown(&bench);
+    return r.violations == 0;
+}
+
+/*============================================================================
+  bench_usage
+============================================================================*/
+static void bench_usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-n frames] [-w workload] "
+            "[-t datasheet|conservative]\n"
+            "       [-b bus_hz] [-f fosc_hz] [-p] [-o trace_prefix]\n\n",
+            argv0);
+    fprintf(stderr, "Workloads:\n");
+    for (int i = 0; i < BENCH_NWORKLOADS; i++)
+        fprintf(stderr,
+                "  %-8s %s\n",
+                bench_workloads[i].name,
+                bench_workloads[i].description);
+}
+
+/*============================================================================
+  main
+============================================================================*/
+int main(int argc, char **argv) {
+    BENCH_OPTS opts = {1000, LCD_TIMING_DATASHEET, 100000, 270000, 0, NULL};
+    const char *only = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:t:b:f:po:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            opts.frames = atoi(optarg);
+            break;
+        case 'w':
+            only = optarg;
+            break;
+        case 't':
+            if (strcmp(optarg, "datasheet") == 0)
+                opts.preset = LCD_TIMING_DATASHEET;
+            else if (strcmp(optarg, "conservative") == 0)
+                opts.preset = LCD_TIMING_CONSERVATIVE;
+            else {
+                bench_usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'b':
+            opts.bus_hz = atol(optarg);
+            break;
+        case 'f':
+            opts.fosc_hz = atol(optarg);
+            break;
+        case 'p':
+            opts.busy_poll = 1;
+            break;
+        case 'o':
+            opts.trace = optarg;
+            break;
+        default:
+            bench_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (opts.frames <= 0 || opts.bus_hz <= 0 || opts.fosc_hz <= 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    printf("%d frames, %s timing, bus %ldHz, fosc %ldHz%s\n\n",
+           opts.frames,
+           opts.preset == LCD_TIMING_DATASHEET ? "datasheet" : "conservative",
+           opts.bus_hz,
+           opts.fosc_hz,
+           opts.busy_poll ? ", busy polling" : "");
+    printf("%-8s %9s %8s %7s %7s %9s %8s %8s %8s %5s\n",
+           "workload",
+           "frames/s",
+           "bytes",
+           "writes",
+           "calls",
+           "bus_us",
+           "p50_ns",
+           "p99_ns",
+           "cpu_us",
+           "viol");
+    printf("%-8s %9s %8s %7s %7s %9s %8s %8s %8s %5s\n",
+           "",
+           "(bus)",
+           "/frame",
+           "/frame",
+           "/frame",
+           "/frame",
+           "",
+           "",
+           "/frame",
+           "");
+
+    int ran = 0, failed = 0;
+    for (int i = 0; i < BENCH_NWORKLOADS; i++) {
+        if (only && strcmp(only, bench_workloads[i].name) != 0)
+            continue;
+        ran++;
+        if (!bench_run(&opts, &bench_workloads[i]))
+            failed++;
+    }
+    if (!ran) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,652 @@
+/*============================================================================
+
+    lcd_trace.c
+
+    A tool for the binary traces written by the trace transport (see
+    lcd_transport_trace_create() in transport.h) -- for instance, by
+    lcd_bench -o. For each trace it reports what the frames cost: bytes
+    and I2C operations per frame, the time from one frame to the next,
+    how much of that time the bus was idle, and the instructions and
+    characters that reached the controller. Given two traces of the
+    same workload, it shows the change from the first to the second, so
+    a regression shows up as a number rather than a feeling.
+
+    The byte stream is fed to a model of the HD44780 at each address,
+    which checks the timing, and with -d every instruction and data byte
+    is printed as it's decoded. A trace records when each write started
+    and how long it took, not when each byte was latched; the bytes are
+    taken to be spread over the write as they would be on the bus. The
+    model assumes the default wiring, with one controller per address.
+
+    With -r, the trace is replayed to a device -- a /dev/i2c-x bus, or
+    "mock" for the mock transport, with models attached -- keeping the
+    recorded time between the start of one operation and the next.
+
+    Frames are counted from the marks in the trace. What comes before
+    the first mark, such as initializing the display, is reported as
+    setup; a trace with no marks is taken to be a single frame.
+
+    Usage: lcd_trace [-d] [-f fosc_hz] [-r device] [-b bus_hz]
+                     trace [trace]
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/hd44780_emu.h"
+#include "../lib/transport.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The PCF8574 has 7-bit addresses
+#define TRACE_MAX_ADDR 128
+
+typedef struct TRACE_OPTS {
+    _Bool decode;
+    long fosc_hz;
+    const char *replay; // The device to replay to, or NULL
+    long bus_hz;
+} TRACE_OPTS;
+
+/** One record of a trace, with its time made absolute. */
+typedef struct TRACE_RECORD {
+    int type;
+    long long t_ns; // Since the trace was created
+    long long dur_ns;
+    int addr;
+    int len;
+    const unsigned char *data;
+} TRACE_RECORD;
+
+typedef struct TRACE {
+    const char *path;
+    unsigned char *buf; // The whole file
+    TRACE_RECORD *records;
+    int count;
+} TRACE;
+
+/** What a trace costs, per frame where that makes sense. */
+typedef struct TRACE_STATS {
+    long setup_bytes;
+    int frames;
+    long bytes;
+    long max_bytes; // In a single frame
+    long writes;
+    long reads;
+    long long span_ns;
+    long long busy_ns;
+    long instructions;
+    long data_writes;
+    long violations;
+} TRACE_STATS;
+
+/** The state of the decoder, passed to the models' watch function. */
+typedef struct TRACE_DECODE {
+    const TRACE_OPTS *opts;
+    TRACE_STATS *stats;
+    _Bool in_frames; // Past the first mark
+    int addr;        // Of the write being fed to the models
+} TRACE_DECODE;
+
+/*============================================================================
+
+  trace_number
+
+  Read an unsigned LEB128 number from *p, and move *p past it. Returns 0
+  if the number runs past end.
+
+============================================================================*/
+static _Bool trace_number(const unsigned char **p,
+                          const unsigned char *end,
+                          unsigned long long *v) {
+    *v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7) {
+        unsigned char b = *(*p)++;
+        *v |= (unsigned long long)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+/*============================================================================
+
+  trace_load
+
+  Read a trace file into memory, and split it into records. Returns 0,
+  having printed a message, if it can't be read or isn't a valid trace.
+
+============================================================================*/
+static _Bool trace_load(TRACE *trace, const char *path) {
+    memset(trace, 0, sizeof(TRACE));
+    trace->path = path;
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+    size_t size = 0, len = 0;
+    for (;;) {
+        if (len == size) {
+            size = size ? 2 * size : 65536;
+            trace->buf = realloc(trace->buf, size);
+        }
+        size_t n = fread(trace->buf + len, 1, size - len, f);
+        if (n == 0)
+            break;
+        len += n;
+    }
+    fclose(f);
+
+    const unsigned char *p = trace->buf;
+    const unsigned char *end = trace->buf + len;
+    if (len < sizeof(LCD_TRACE_MAGIC) ||
+        memcmp(p, LCD_TRACE_MAGIC, sizeof(LCD_TRACE_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        return 0;
+    }
+    p += sizeof(LCD_TRACE_MAGIC);
+    int records_size = 0;
+    long long t = 0;
+    _Bool truncated = 0;
+    while (p < end) {
+        if (trace->count == records_size) {
+            records_size = records_size ? 2 * records_size : 1024;
+            trace->records = realloc(trace->records,
+                                     records_size * sizeof(TRACE_RECORD));
+        }
+        TRACE_RECORD *r = &trace->records[trace->count];
+        memset(r, 0, sizeof(TRACE_RECORD));
+        r->type = *p++;
+        unsigned long long dt, dur, n;
+        if (!trace_number(&p, end, &dt)) {
+            truncated = 1;
+            break;
+        }
+        t += dt;
+        r->t_ns = t;
+        if (r->type == LCD_TRACE_WRITE || r->type == LCD_TRACE_READ) {
+            if (!trace_number(&p, end, &dur) || p == end) {
+                truncated = 1;
+                break;
+            }
+            r->dur_ns = dur;
+            r->addr = *p++;
+            if (!trace_number(&p, end, &n) || n > (size_t)(end - p)) {
+                truncated = 1;
+                break;
+            }
+            r->len = n;
+            r->data = p;
+            p += n;
+        } else if (r->type != LCD_TRACE_MARK) {
+            fprintf(stderr,
+                    "%s: unknown record type 0x%02x\n",
+                    path,
+                    r->type);
+            return 0;
+        }
+        trace->count++;
+    }
+    if (truncated) {
+        fprintf(stderr, "%s: truncated\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+/*============================================================================
+  trace_free
+============================================================================*/
+static void trace_free(TRACE *trace) {
+    free(trace->records);
+    free(trace->buf);
+}
+
+/*============================================================================
+
+  trace_latch_time
+
+  Estimate when byte i of a write was latched, by placing it where it
+  would be among the clocks of the write on the bus: each byte is nine
+  clocks, after a start condition and an address byte.
+
+============================================================================*/
+static long long trace_latch_time(const TRACE_RECORD *r, int i) {
+    return r->t_ns +
+           r->dur_ns * (1 + 9LL * (i + 2)) / (9LL * (r->len + 1) + 2);
+}
+
+/*============================================================================
+
+  trace_describe
+
+  Write a description of an instruction.
+
+============================================================================*/
+static void trace_describe(unsigned char v, char *s, size_t size) {
+    if (v & 0x80)
+        snprintf(s, size, "set DDRAM address 0x%02x", v & 0x7F);
+    else if (v & 0x40)
+        snprintf(s,
+                 size,
+                 "set CGRAM address 0x%02x (glyph %d, row %d)",
+                 v & 0x3F,
+                 (v >> 3) & 7,
+                 v & 7);
+    else if (v & 0x20)
+        snprintf(s,
+                 size,
+                 "function set: %d-bit, %d line%s%s",
+                 v & 0x10 ? 8 : 4,
+                 v & 0x08 ? 2 : 1,
+                 v & 0x08 ? "s" : "",
+                 v & 0x04 ? ", 5x10 dots" : "");
+    else if (v & 0x10)
+        snprintf(s,
+                 size,
+                 "%s %s",
+                 v & 0x08 ? "shift display" : "move cursor",
+                 v & 0x04 ? "right" : "left");
+    else if (v & 0x08)
+        snprintf(s,
+                 size,
+                 "display %s, cursor %s, blink %s",
+                 v & 0x04 ? "on" : "off",
+                 v & 0x02 ? "on" : "off",
+                 v & 0x01 ? "on" : "off");
+    else if (v & 0x04)
+        snprintf(s,
+                 size,
+                 "entry mode: %s%s",
+                 v & 0x02 ? "increment" : "decrement",
+                 v & 0x01 ? ", shift" : "");
+    else if (v & 0x02)
+        snprintf(s, size, "return home");
+    else if (v & 0x01)
+        snprintf(s, size, "clear display");
+    else
+        snprintf(s, size, "no operation");
+}
+
+/*============================================================================
+
+  trace_watch
+
+  Count, and perhaps print, an instruction or data byte as the model
+  receives it.
+
+============================================================================*/
+static void
+trace_watch(void *arg, long long t_ns, _Bool rs, unsigned char v) {
+    TRACE_DECODE *dec = arg;
+    if (dec->in_frames) {
+        if (rs)
+            dec->stats->data_writes++;
+        else
+            dec->stats->instructions++;
+    }
+    if (!dec->opts->decode)
+        return;
+    char s[64];
+    if (rs)
+        snprintf(s, sizeof(s), "'%c'", v >= 0x20 && v < 0x7F ? v : '.');
+    else
+        trace_describe(v, s, sizeof(s));
+    printf("%14.6f  0x%02x  %-5s 0x%02x  %s\n",
+           t_ns / 1e6,
+           dec->addr,
+           rs ? "data" : "instr",
+           v,
+           s);
+}
+
+/*============================================================================
+
+  trace_analyse
+
+  Work out what a trace costs, feeding it to a model of the controller
+  at each address as we go.
+
+============================================================================*/
+static void trace_analyse(const TRACE_OPTS *opts,
+                          const TRACE *trace,
+                          TRACE_STATS *stats) {
+    memset(stats, 0, sizeof(TRACE_STATS));
+    HD44780_EMU *emu[TRACE_MAX_ADDR];
+    memset(emu, 0, sizeof(emu));
+    TRACE_DECODE dec = {opts, stats, 0, 0};
+
+    _Bool marked = 0;
+    for (int i = 0; i < trace->count; i++)
+        marked = marked || trace->records[i].type == LCD_TRACE_MARK;
+    dec.in_frames = !marked;
+    stats->frames = marked ? 0 : 1;
+
+    long long start_ns = trace->count ? trace->records[0].t_ns : 0;
+    long long end_ns = start_ns;
+    long frame_bytes = 0;
+    for (int i = 0; i < trace->count; i++) {
+        const TRACE_RECORD *r = &trace->records[i];
+        if (r->type == LCD_TRACE_MARK) {
+            if (!dec.in_frames)
+                start_ns = end_ns = r->t_ns;
+            dec.in_frames = 1;
+            if (frame_bytes > stats->max_bytes)
+                stats->max_bytes = frame_bytes;
+            frame_bytes = 0;
+            stats->frames++;
+            if (opts->decode)
+                printf("%14.6f  frame %d\n", r->t_ns / 1e6, stats->frames);
+            continue;
+        }
+        if (r->type == LCD_TRACE_WRITE) {
+            HD44780_EMU **e = &emu[r->addr & (TRACE_MAX_ADDR - 1)];
+            if (!*e) {
+                *e = hd44780_emu_create();
+                hd44780_emu_set_fosc(*e, opts->fosc_hz);
+                hd44780_emu_watch(*e, trace_watch, &dec);
+            }
+            dec.addr = r->addr;
+            for (int j = 0; j < r->len; j++)
+                hd44780_emu_latch(*e, trace_latch_time(r, j), r->data[j]);
+        }
+        if (!dec.in_frames) {
+            if (r->type == LCD_TRACE_WRITE)
+                stats->setup_bytes += r->len;
+            continue;
+        }
+        if (r->type == LCD_TRACE_WRITE) {
+            stats->writes++;
+            stats->bytes += r->len;
+            frame_bytes += r->len;
+        } else {
+            stats->reads++;
+        }
+        stats->busy_ns += r->dur_ns;
+        if (r->t_ns + r->dur_ns > end_ns)
+            end_ns = r->t_ns + r->dur_ns;
+    }
+    if (frame_bytes > stats->max_bytes)
+        stats->max_bytes = frame_bytes;
+    stats->span_ns = end_ns - start_ns;
+
+    for (int i = 0; i < TRACE_MAX_ADDR; i++) {
+        if (emu[i]) {
+            stats->violations += hd44780_emu_violations(emu[i]);
+            if (hd44780_emu_violations(emu[i]))
+                fprintf(stderr,
+                        "%s: 0x%02x: %s\n",
+                        trace->path,
+                        i,
+                        emu[i]->last_violation);
+            hd44780_emu_destroy(emu[i]);
+        }
+    }
+}
+
+/*============================================================================
+  trace_idle
+============================================================================*/
+static double trace_idle(const TRACE_STATS *s) {
+    return s->span_ns > 0 ? 100.0 * (s->span_ns - s->busy_ns) / s->span_ns
+                          : 0.0;
+}
+
+/*============================================================================
+  trace_print
+============================================================================*/
+static void trace_print(const char *name, const TRACE_STATS *s) {
+    double n = s->frames ? s->frames : 1;
+    printf("%-16s %7ld %6d %8.1f %6ld %7.2f %7.2f %9.1f %6.1f %7.2f %7.2f "
+           "%5ld\n",
+           name,
+           s->setup_bytes,
+           s->frames,
+           s->bytes / n,
+           s->max_bytes,
+           s->writes / n,
+           s->reads / n,
+           s->span_ns / n / 1000,
+           trace_idle(s),
+           s->instructions / n,
+           s->data_writes / n,
+           s->violations);
+}
+
+/*============================================================================
+  trace_change
+============================================================================*/
+static double trace_change(double from, double to) {
+    return from ? 100.0 * (to - from) / from : 0.0;
+}
+
+/*============================================================================
+
+  trace_print_change
+
+  Print the change from one trace to another, as percentages, except
+  for the idle time, which is already one.
+
+============================================================================*/
+static void trace_print_change(const TRACE_STATS *a, const TRACE_STATS *b) {
+    double na = a->frames ? a->frames : 1;
+    double nb = b->frames ? b->frames : 1;
+    printf("%-16s %+6.0f%% %6s %+7.1f%% %+5.0f%% %+6.1f%% %+6.1f%% "
+           "%+8.1f%% %+6.1f %+6.1f%% %+6.1f%% %+5ld\n",
+           "change",
+           trace_change(a->setup_bytes, b->setup_bytes),
+           "",
+           trace_change(a->bytes / na, b->bytes / nb),
+           trace_change(a->max_bytes, b->max_bytes),
+           trace_change(a->writes / na, b->writes / nb),
+           trace_change(a->reads / na, b->reads / nb),
+           trace_change(a->span_ns / na, b->span_ns / nb),
+           trace_idle(b) - trace_idle(a),
+           trace_change(a->instructions / na, b->instructions / nb),
+           trace_change(a->data_writes / na, b->data_writes / nb),
+           b->violations - a->violations);
+}
+
+/*============================================================================
+
+  trace_replay
+
+  Send a trace to a device, starting each operation at the same time
+  after the start as it was recorded -- or as soon after as the device
+  allows, without the lateness building up. Returns 0 if the device
+  can't be opened, an operation fails, or the models on the mock see
+  timing violations.
+
+============================================================================*/
+static _Bool trace_replay(const TRACE_OPTS *opts, const TRACE *trace) {
+    HD44780_EMU *emu[TRACE_MAX_ADDR];
+    memset(emu, 0, sizeof(emu));
+    _Bool mock = strcmp(opts->replay, "mock") == 0;
+    LCD_TRANSPORT *t;
+    char *error = NULL;
+    if (mock) {
+        t = lcd_transport_mock_create();
+        lcd_transport_mock_set_bus_hz(t, opts->bus_hz);
+    } else if (!(t = lcd_transport_i2c_auto_create(opts->replay, &error))) {
+        fprintf(stderr, "%s\n", error);
+        free(error);
+        return 0;
+    }
+
+    long failed = 0, writes = 0, reads = 0;
+    long long recorded_ns = 0;
+    unsigned char scratch[256];
+    long long start = lcd_transport_now(t);
+    long long t0 = trace->count ? trace->records[0].t_ns : 0;
+    for (int i = 0; i < trace->count; i++) {
+        const TRACE_RECORD *r = &trace->records[i];
+        if (r->type == LCD_TRACE_MARK)
+            continue;
+        long long wait = start + r->t_ns - t0 - lcd_transport_now(t);
+        if (wait > 0)
+            lcd_transport_delay(t, wait);
+        if (r->t_ns + r->dur_ns - t0 > recorded_ns)
+            recorded_ns = r->t_ns + r->dur_ns - t0;
+        int a = r->addr & (TRACE_MAX_ADDR - 1);
+        if (mock && !emu[a]) {
+            emu[a] = hd44780_emu_create();
+            hd44780_emu_set_fosc(emu[a], opts->fosc_hz);
+            lcd_transport_mock_attach(t, r->addr, emu[a]);
+        }
+        _Bool ok;
+        if (r->type == LCD_TRACE_WRITE) {
+            ok = lcd_transport_write(t, r->addr, r->data, r->len);
+            writes++;
+        } else {
+            int len = r->len < (int)sizeof(scratch) ? r->len
+                                                    : (int)sizeof(scratch);
+            ok = lcd_transport_read(t, r->addr, scratch, len);
+            reads++;
+        }
+        if (!ok)
+            failed++;
+    }
+    long long took_ns = lcd_transport_now(t) - start;
+
+    printf("%s: replayed %ld writes and %ld reads to %s in %.3f ms "
+           "(recorded %.3f ms)",
+           trace->path,
+           writes,
+           reads,
+           opts->replay,
+           took_ns / 1e6,
+           recorded_ns / 1e6);
+    if (failed)
+        printf(", %ld failed", failed);
+    printf("\n");
+    long violations = 0;
+    for (int i = 0; i < TRACE_MAX_ADDR; i++) {
+        if (!emu[i])
+            continue;
+        violations += hd44780_emu_violations(emu[i]);
+        for (int line = 0; line < 2; line++) {
+            unsigned char text[HD44780_LINE_LEN];
+            hd44780_emu_text(emu[i], line, 0, HD44780_LINE_LEN, text);
+            printf("  0x%02x line %d: \"%.*s\"\n",
+                   i,
+                   line,
+                   HD44780_LINE_LEN,
+                   (const char *)text);
+        }
+        hd44780_emu_destroy(emu[i]);
+    }
+    if (mock)
+        printf("  %ld timing violations\n", violations);
+    lcd_transport_destroy(t);
+    return !failed && !violations;
+}
+
+/*============================================================================
+  trace_usage
+============================================================================*/
+static void trace_usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-d] [-f fosc_hz] [-r device] [-b bus_hz] "
+            "trace [trace]\n"
+            "  -d  Print the instructions and data that the trace sends\n"
+            "  -f  The controller's oscillator frequency (270000)\n"
+            "  -r  Replay the trace to a /dev/i2c-x device, or to mock\n"
+            "  -b  The bus rate the mock assumes, for -r mock (100000)\n",
+            argv0);
+}
+
+/*============================================================================
+  main
+============================================================================*/
+int main(int argc, char **argv) {
+    TRACE_OPTS opts = {0, 270000, NULL, 100000};
+    int opt;
+    while ((opt = getopt(argc, argv, "df:r:b:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            opts.decode = 1;
+            break;
+        case 'f':
+            opts.fosc_hz = atol(optarg);
+            break;
+        case 'r':
+            opts.replay = optarg;
+            break;
+        case 'b':
+            opts.bus_hz = atol(optarg);
+            break;
+        default:
+            trace_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    int ntraces = argc - optind;
+    if (ntraces < 1 || ntraces > 2 || opts.fosc_hz <= 0 ||
+        opts.bus_hz <= 0) {
+        trace_usage(argv[0]);
+        return 1;
+    }
+
+    TRACE trace[2];
+    TRACE_STATS stats[2];
+    int loaded = 0;
+    _Bool ok = 1;
+    for (; loaded < ntraces; loaded++) {
+        if (!trace_load(&trace[loaded], argv[optind + loaded])) {
+            trace_free(&trace[loaded]);
+            ok = 0;
+            break;
+        }
+    }
+    if (ok) {
+        for (int i = 0; i < ntraces; i++)
+            trace_analyse(&opts, &trace[i], &stats[i]);
+        if (opts.decode)
+            printf("\n");
+        printf("%-16s %7s %6s %8s %6s %7s %7s %9s %6s %7s %7s %5s\n",
+               "trace",
+               "setup",
+               "frames",
+               "bytes",
+               "max",
+               "writes",
+               "reads",
+               "bus_us",
+               "idle",
+               "instr",
+               "data",
+               "viol");
+        printf("%-16s %7s %6s %8s %6s %7s %7s %9s %6s %7s %7s %5s\n",
+               "",
+               "bytes",
+               "",
+               "/frame",
+               "bytes",
+               "/frame",
+               "/frame",
+               "/frame",
+               "%",
+               "/frame",
+               "/frame",
+               "");
+        for (int i = 0; i < ntraces; i++) {
+            const char *name = strrchr(trace[i].path, '/');
+            trace_print(name ? name + 1 : trace[i].path, &stats[i]);
+            if (stats[i].violations)
+                ok = 0;
+        }
+        if (ntraces == 2)
+            trace_print_change(&stats[0], &stats[1]);
+        if (opts.replay) {
+            printf("\n");
+            for (int i = 0; i < ntraces; i++)
+                if (!trace_replay(&opts, &trace[i]))
+                    ok = 0;
+        }
+    }
+    for (int i = 0; i < loaded; i++)
+        trace_free(&trace[i]);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,586 @@
+/*============================================================================
+
+    lcdd.c
+
+    A daemon that owns one or more displays, and shares them between any
+    number of client processes (see lib/lcd_client.h). Each display is
+    initialized once, when the daemon starts, and only the daemon talks
+    to the bus, so clients don't pay for initialization and can't
+    interleave each other's nibbles.
+
+    Clients write into layers in shared memory and signal an eventfd.
+    The daemon wakes up, takes a consistent copy of each layer that has
+    changed, stacks the visible layers up, and hands the cells that
+    differ from the last frame to the displays, which are flushed
+    together by an LCD_MANAGER. Commits that arrive while a frame is
+    being sent, or less than a frame time after the last one, are
+    merged into the next frame.
+
+    Usage: lcdd [-s socket] [-r frames_per_sec] [-m] [-v]
+                [-d device:address:ROWSxCOLS]...
+
+    With -m, the displays are simulated, on the mock transport, rather
+    than opened; with -v, each frame is printed.
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#define _GNU_SOURCE
+#include "../lib/hd44780_emu.h"
+#include "../lib/lcd_client.h"
+#include "../lib/lcd_manager.h"
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LCDD_MAX_DISPLAYS 8
+#define LCDD_MAX_CLIENTS (LCDD_MAX_DISPLAYS * LCD_CLIENT_LAYERS)
+#define LCDD_DEFAULT_DISPLAY "/dev/i2c-1:0x27:2x16"
+
+typedef struct LCDD_DISPLAY {
+    LCD *lcd;
+    int shm_fd;
+    LCD_CLIENT_SHM *shm;
+    // The last consistent copy of each layer, and its generation
+    LCD_CLIENT_LAYER snap[LCD_CLIENT_LAYERS];
+    unsigned gen[LCD_CLIENT_LAYERS];
+    unsigned long serial[LCD_CLIENT_LAYERS]; // When it was handed out
+    unsigned char screen[LCD_CLIENT_CELLS];  // The last frame
+} LCDD_DISPLAY;
+
+typedef struct LCDD_CLIENT {
+    int sock;
+    int display; // -1 until the client has asked for one
+    int layer;
+} LCDD_CLIENT;
+
+typedef struct LCDD {
+    const char *path;
+    long long frame_ns;
+    _Bool verbose;
+    LCD_MANAGER *manager;
+    LCD_TRANSPORT *mock; // For -m
+    HD44780_EMU *emu[LCDD_MAX_DISPLAYS];
+    LCDD_DISPLAY display[LCDD_MAX_DISPLAYS];
+    int ndisplays;
+    int listen_fd;
+    int event_fd;
+    LCDD_CLIENT client[LCDD_MAX_CLIENTS];
+    int nclients;
+    unsigned long serial;
+} LCDD;
+
+static volatile sig_atomic_t lcdd_stop;
+
+/*============================================================================
+  lcdd_on_signal
+============================================================================*/
+static void lcdd_on_signal(int sig) {
+    (void)sig;
+    lcdd_stop = 1;
+}
+
+/*============================================================================
+  lcdd_now_ns
+============================================================================*/
+static long long lcdd_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*============================================================================
+
+  lcdd_wake
+
+  Make the main loop send a frame, as if a client had committed.
+
+============================================================================*/
+static void lcdd_wake(LCDD *d) {
+    uint64_t one = 1;
+    if (write(d->event_fd, &one, sizeof(one)) < 0) {
+        // Only possible if the counter is about to overflow, in which
+        //  case a frame is on its way anyway
+    }
+}
+
+/*============================================================================
+
+  lcdd_add_display
+
+  Open and initialize a display, described as device:address:ROWSxCOLS,
+  and create its shared memory.
+
+============================================================================*/
+static _Bool lcdd_add_display(LCDD *d, const char *spec, char **error) {
+    char dev[256];
+    int addr, rows, cols;
+    const char *colon = strchr(spec, ':');
+    if (d->ndisplays == LCDD_MAX_DISPLAYS || !colon ||
+        colon - spec >= (int)sizeof(dev) ||
+        sscanf(colon + 1, "%i:%dx%d", &addr, &rows, &cols) != 3 ||
+        rows < 1 || rows > LCD_MAX_ROWS || cols < 1 ||
+        rows * cols > LCD_CLIENT_CELLS || cols > 40) {
+        if (error)
+            *error = strdup("Bad display (should be dev:addr:ROWSxCOLS)");
+        return 0;
+    }
+    memcpy(dev, spec, colon - spec);
+    dev[colon - spec] = 0;
+
+    LCDD_DISPLAY *disp = &d->display[d->ndisplays];
+    if (d->mock) {
+        HD44780_EMU *emu = hd44780_emu_create();
+        d->emu[d->ndisplays] = emu;
+        lcd_transport_mock_attach(d->mock, addr, emu);
+        disp->lcd = lcd_manager_add(d->manager, d->mock, addr, rows, cols,
+                                    error);
+    } else {
+        disp->lcd = lcd_manager_add_dev(d->manager, dev, addr, rows, cols,
+                                        error);
+    }
+    if (!disp->lcd)
+        return 0;
+
+    // The display isn't counted until all of this has worked, so main()
+    //  won't clean up after it -- anything that fails here must
+    disp->shm_fd = memfd_create("lcdd", MFD_CLOEXEC);
+    disp->shm = MAP_FAILED;
+    if (disp->shm_fd >= 0 &&
+        ftruncate(disp->shm_fd, sizeof(LCD_CLIENT_SHM)) == 0)
+        disp->shm = mmap(NULL,
+                         sizeof(LCD_CLIENT_SHM),
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED,
+                         disp->shm_fd,
+                         0);
+    if (disp->shm == MAP_FAILED) {
+        if (error)
+            *error = strdup(strerror(errno));
+        if (disp->shm_fd >= 0)
+            close(disp->shm_fd);
+        disp->shm_fd = -1;
+        disp->shm = NULL;
+        return 0;
+    }
+    memcpy(disp->shm->magic, LCD_CLIENT_MAGIC, sizeof(LCD_CLIENT_MAGIC));
+    disp->shm->rows = rows;
+    disp->shm->cols = cols;
+    memset(disp->screen, ' ', sizeof(disp->screen));
+    d->ndisplays++;
+    return 1;
+}
+
+/*============================================================================
+
+  lcdd_listen
+
+  Create the socket that clients connect to, replacing any that was
+  left behind by an earlier run.
+
+============================================================================*/
+static _Bool lcdd_listen(LCDD *d, char **error) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(d->path) >= sizeof(addr.sun_path)) {
+        if (error)
+            *error = strdup("Socket path is too long");
+        return 0;
+    }
+    strcpy(addr.sun_path, d->path);
+    unlink(d->path);
+    d->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (d->listen_fd < 0 ||
+        bind(d->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(d->listen_fd, 16) < 0) {
+        if (error) {
+            size_t size = strlen(d->path) + 100;
+            *error = malloc(size);
+            snprintf(*error, size, "%s: %s", d->path, strerror(errno));
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/*============================================================================
+
+  lcdd_hello
+
+  Answer a client's request for a display: give it a free layer, reset
+  to a blank screen, and send it the shared memory and the eventfd. The
+  layer isn't shown until the client first commits.
+
+============================================================================*/
+static void lcdd_hello(LCDD *d, LCDD_CLIENT *c) {
+    int display;
+    LCD_CLIENT_HELLO hello = {0, -1};
+    if (recv(c->sock, &display, sizeof(display), 0) != sizeof(display) ||
+        display < 0 || display >= d->ndisplays) {
+        hello.status = EINVAL;
+    } else {
+        LCDD_DISPLAY *disp = &d->display[display];
+        for (int l = 0; l < LCD_CLIENT_LAYERS && hello.layer < 0; l++)
+            if (!disp->shm->layer[l].owned)
+                hello.layer = l;
+        if (hello.layer < 0)
+            hello.status = EBUSY;
+    }
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = {&hello, sizeof(hello)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (!hello.status) {
+        LCDD_DISPLAY *disp = &d->display[display];
+        LCD_CLIENT_LAYER *layer = &disp->shm->layer[hello.layer];
+        memset(layer, 0, sizeof(LCD_CLIENT_LAYER));
+        layer->visible = 1;
+        layer->rows = disp->shm->rows;
+        layer->cols = disp->shm->cols;
+        memset(layer->cells, ' ', sizeof(layer->cells));
+        disp->snap[hello.layer] = *layer;
+        disp->snap[hello.layer].visible = 0;
+        disp->gen[hello.layer] = 0;
+        disp->serial[hello.layer] = ++d->serial;
+        __atomic_store_n(&layer->owned, 1, __ATOMIC_RELEASE);
+        c->display = display;
+        c->layer = hello.layer;
+
+        int fds[2] = {disp->shm_fd, d->event_fd};
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+    if (sendmsg(c->sock, &msg, MSG_NOSIGNAL) < 0 && d->verbose)
+        perror("lcdd: sendmsg");
+}
+
+/*============================================================================
+
+  lcdd_drop
+
+  Forget a client that has gone away, and take its layer off the
+  screen.
+
+============================================================================*/
+static void lcdd_drop(LCDD *d, int i) {
+    LCDD_CLIENT *c = &d->client[i];
+    if (c->display >= 0) {
+        LCDD_DISPLAY *disp = &d->display[c->display];
+        __atomic_store_n(&disp->shm->layer[c->layer].owned, 0,
+                         __ATOMIC_RELEASE);
+        disp->snap[c->layer].visible = 0;
+        lcdd_wake(d);
+    }
+    close(c->sock);
+    d->client[i] = d->client[--d->nclients];
+}
+
+/*============================================================================
+
+  lcdd_snapshot
+
+  Copy a layer that has been committed since the last copy. A layer
+  that is being written, or that changes while it's copied, is left
+  until the next frame -- its commit will wake us again.
+
+============================================================================*/
+static void lcdd_snapshot(LCDD_DISPLAY *disp, int l) {
+    LCD_CLIENT_LAYER *layer = &disp->shm->layer[l];
+    unsigned gen = __atomic_load_n(&layer->gen, __ATOMIC_ACQUIRE);
+    if (gen & 1 || gen == disp->gen[l])
+        return;
+    LCD_CLIENT_LAYER copy;
+    memcpy(&copy, layer, sizeof(copy));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&layer->gen, __ATOMIC_RELAXED) != gen)
+        return;
+    disp->snap[l] = copy;
+    disp->gen[l] = gen;
+}
+
+/*============================================================================
+
+  lcdd_compose
+
+  Stack up the visible layers of a display, lowest z first, and write
+  the cells that differ from the last frame into the display's
+  framebuffer.
+
+============================================================================*/
+static void lcdd_compose(LCDD_DISPLAY *disp) {
+    int rows = disp->shm->rows;
+    int cols = disp->shm->cols;
+    int order[LCD_CLIENT_LAYERS];
+    int n = 0;
+    for (int l = 0; l < LCD_CLIENT_LAYERS; l++) {
+        if (!__atomic_load_n(&disp->shm->layer[l].owned, __ATOMIC_ACQUIRE))
+            continue;
+        lcdd_snapshot(disp, l);
+        if (!disp->snap[l].visible)
+            continue;
+        // Insertion sort, by z and then by age
+        int i = n++;
+        for (; i > 0; i--) {
+            const LCD_CLIENT_LAYER *prev = &disp->snap[order[i - 1]];
+            if (prev->z < disp->snap[l].z ||
+                (prev->z == disp->snap[l].z &&
+                 disp->serial[order[i - 1]] < disp->serial[l]))
+                break;
+            order[i] = order[i - 1];
+        }
+        order[i] = l;
+    }
+
+    unsigned char screen[LCD_CLIENT_CELLS];
+    memset(screen, ' ', rows * cols);
+    for (int i = 0; i < n; i++) {
+        const LCD_CLIENT_LAYER *layer = &disp->snap[order[i]];
+        int row0 = layer->row < 0 ? 0 : layer->row;
+        int col0 = layer->col < 0 ? 0 : layer->col;
+        int row1 = layer->row + layer->rows;
+        int col1 = layer->col + layer->cols;
+        if (row1 > rows)
+            row1 = rows;
+        if (col1 > cols)
+            col1 = cols;
+        for (int row = row0; row < row1; row++)
+            if (col1 > col0)
+                memcpy(screen + row * cols + col0,
+                       layer->cells + row * cols + col0,
+                       col1 - col0);
+    }
+
+    for (int i = 0; i < rows * cols; i++)
+        if (screen[i] != disp->screen[i])
+            lcd_write_char_at(disp->lcd, i / cols, i % cols, screen[i]);
+    memcpy(disp->screen, screen, rows * cols);
+}
+
+/*============================================================================
+
+  lcdd_frame
+
+  Send one frame to every display.
+
+============================================================================*/
+static void lcdd_frame(LCDD *d) {
+    for (int i = 0; i < d->ndisplays; i++)
+        lcdd_compose(&d->display[i]);
+    lcd_manager_flush(d->manager);
+    if (d->mock)
+        lcd_transport_mock_reset(d->mock);
+    if (d->verbose) {
+        for (int i = 0; i < d->ndisplays; i++) {
+            LCDD_DISPLAY *disp = &d->display[i];
+            int cols = disp->shm->cols;
+            for (int row = 0; row < disp->shm->rows; row++)
+                printf("%d|%.*s|\n", i, cols, disp->screen + row * cols);
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+}
+
+/*============================================================================
+
+  lcdd_run
+
+  The main loop. The eventfd is only watched when a frame is due, so
+  that commits that arrive sooner than that are merged.
+
+============================================================================*/
+static void lcdd_run(LCDD *d) {
+    struct pollfd pfd[2 + LCDD_MAX_CLIENTS];
+    long long next_frame = 0;
+    while (!lcdd_stop) {
+        long long now = lcdd_now_ns();
+        int timeout = -1;
+        int n = 0;
+        pfd[n].fd = d->listen_fd;
+        pfd[n++].events = POLLIN;
+        pfd[n].fd = d->event_fd;
+        pfd[n++].events = POLLIN;
+        if (now < next_frame) {
+            pfd[1].fd = -1;
+            timeout = (int)((next_frame - now + 999999) / 1000000);
+        }
+        for (int i = 0; i < d->nclients; i++) {
+            pfd[n].fd = d->client[i].sock;
+            pfd[n++].events = POLLIN;
+        }
+        if (poll(pfd, n, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("lcdd: poll");
+            break;
+        }
+
+        // Clients, from the last, since dropping one moves the last
+        //  into its place
+        for (int i = d->nclients - 1; i >= 0; i--) {
+            short revents = pfd[2 + i].revents;
+            if (!revents)
+                continue;
+            if (d->client[i].display < 0 && revents & POLLIN) {
+                lcdd_hello(d, &d->client[i]);
+                if (d->client[i].display < 0)
+                    lcdd_drop(d, i);
+            } else {
+                // A client only sends the one message, so anything else
+                //  is the end of the connection
+                lcdd_drop(d, i);
+            }
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            int sock = accept4(d->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (sock >= 0 && d->nclients == LCDD_MAX_CLIENTS) {
+                close(sock);
+            } else if (sock >= 0) {
+                LCDD_CLIENT *c = &d->client[d->nclients++];
+                c->sock = sock;
+                c->display = -1;
+                c->layer = -1;
+            }
+        }
+
+        if (pfd[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(d->event_fd, &count, sizeof(count)) == sizeof(count)) {
+                lcdd_frame(d);
+                next_frame = lcdd_now_ns() + d->frame_ns;
+            }
+        }
+    }
+}
+
+/*============================================================================
+  lcdd_usage
+============================================================================*/
+static void lcdd_usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-s socket] [-r frames_per_sec] [-m] [-v]\n"
+            "          [-d device:address:ROWSxCOLS]...\n"
+            "Default socket %s, 50 frames per second, display %s\n",
+            argv0,
+            LCD_CLIENT_SOCKET,
+            LCDD_DEFAULT_DISPLAY);
+}
+
+/*============================================================================
+
+  main
+
+============================================================================*/
+int main(int argc, char **argv) {
+    static LCDD d;
+    const char *specs[LCDD_MAX_DISPLAYS];
+    int nspecs = 0;
+    long rate = 50;
+    _Bool simulate = 0;
+    d.path = LCD_CLIENT_SOCKET;
+    d.listen_fd = -1;
+    d.event_fd = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:r:mvd:h")) != -1) {
+        switch (opt) {
+        case 's':
+            d.path = optarg;
+            break;
+        case 'r':
+            rate = atol(optarg);
+            break;
+        case 'm':
+            simulate = 1;
+            break;
+        case 'v':
+            d.verbose = 1;
+            break;
+        case 'd':
+            if (nspecs < LCDD_MAX_DISPLAYS)
+                specs[nspecs++] = optarg;
+            break;
+        default:
+            lcdd_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (rate <= 0) {
+        lcdd_usage(argv[0]);
+        return 1;
+    }
+    if (!nspecs)
+        specs[nspecs++] = LCDD_DEFAULT_DISPLAY;
+    d.frame_ns = 1000000000LL / rate;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = lcdd_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    char *error = NULL;
+    d.manager = lcd_manager_create();
+    if (simulate)
+        d.mock = lcd_transport_mock_create();
+    _Bool ok = 1;
+    for (int i = 0; i < nspecs && ok; i++)
+        ok = lcdd_add_display(&d, specs[i], &error);
+    if (ok) {
+        d.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (d.event_fd < 0) {
+            error = strdup(strerror(errno));
+            ok = 0;
+        }
+    }
+    if (ok)
+        ok = lcdd_listen(&d, &error);
+    if (ok) {
+        lcdd_run(&d);
+        unlink(d.path);
+    } else {
+        fprintf(stderr, "%s: %s\n", argv[0], error);
+        free(error);
+    }
+
+    while (d.nclients)
+        lcdd_drop(&d, d.nclients - 1);
+    if (d.listen_fd >= 0)
+        close(d.listen_fd);
+    if (d.event_fd >= 0)
+        close(d.event_fd);
+    lcd_manager_destroy(d.manager);
+    for (int i = 0; i < d.ndisplays; i++) {
+        munmap(d.display[i].shm, sizeof(LCD_CLIENT_SHM));
+        close(d.display[i].shm_fd);
+    }
+    if (d.mock)
+        lcd_transport_destroy(d.mock);
+    for (int i = 0; i < LCDD_MAX_DISPLAYS; i++)
+        if (d.emu[i])
+            hd44780_emu_destroy(d.emu[i]);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,20 @@
+/*============================================================================
+
+  err_msg.h
+
+  The error messages that the methods that can fail hand back to the
+  caller: what failed, and the text of the errno value that says why,
+  in a string that the caller should free.
+
+  Distributed under the terms of the GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#ifndef __ERR_MSG_H__
+#define __ERR_MSG_H__
+
+/** If error is not NULL, write "what name: reason" to it, where reason
+    is the text for the errno value err. If name is NULL, the message is
+    just "what: reason". */
+void err_msg(const char *what, const char *name, int err, char **error);
+
+#endif
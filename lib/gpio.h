@@ -2,7 +2,19 @@
 
   gpio.h
 
-  Functions to control a specific GPIO pin.
+  Functions to control GPIO pins. There are two "classes" here.
+
+  GPIO controls a single pin through the sysfs interface
+  (/sys/class/gpio), which is deprecated, and slow -- each change of
+  value is a write() of a text '0' or '1' to a separate file.
+
+  GPIO_LINES controls a set of lines on one gpiochip through the
+  character device (/dev/gpiochipN) and the GPIO v2 uAPI. The lines are
+  requested once, and any number of them can be changed together, in
+  a single ioctl(). Like the I2C transports in transport.h, a
+  GPIO_LINES is an ops table with more than one implementation -- the
+  real device, and a mock that records every change, with a timestamp
+  on a virtual clock, for use on machines without GPIO hardware.
 
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
@@ -42,4 +54,115 @@ void gpio_terminate(GPIO *self);
 /** Set this pin HIGH or LOW. */
 void gpio_set(GPIO *self, _Bool val);
 
+// The most lines that can be requested together (GPIO_V2_LINES_MAX)
+#define GPIO_LINES_MAX 64
+
+typedef struct GPIO_LINES GPIO_LINES;
+
+/** The operations that a set of lines implements. Values are bit masks,
+    in which bit i is the i'th line in the set, as requested -- not the
+    line's offset on the chip. */
+typedef struct GPIO_LINES_OPS {
+    /** A short name for the implementation, for diagnostic messages. */
+    const char *name;
+    /** Set the lines in mask to the corresponding bits of values, all at
+        once. Returns 0 on failure. */
+    _Bool (*set)(GPIO_LINES *self,
+                 unsigned long long mask,
+                 unsigned long long values);
+    /** Read the lines in mask. Returns 0 on failure. */
+    _Bool (*get)(GPIO_LINES *self,
+                 unsigned long long mask,
+                 unsigned long long *values);
+    /** Wait for (at least) the specified number of nanoseconds. */
+    void (*delay)(GPIO_LINES *self, long ns);
+    /** The current time in nanoseconds, on the clock that delay() uses. */
+    long long (*now)(GPIO_LINES *self);
+    /** Release the lines. The object itself is freed by
+        gpio_lines_destroy(). */
+    void (*close)(GPIO_LINES *self);
+} GPIO_LINES_OPS;
+
+struct GPIO_LINES {
+    const GPIO_LINES_OPS *ops;
+    int count;                // The number of lines in the set
+    unsigned long long values; // The values last set
+};
+
+/** One change recorded by the mock: the values of all the lines after
+    it, and the time it happened on the mock's virtual clock. */
+typedef struct GPIO_MOCK_RECORD {
+    long long t_ns;
+    unsigned long long values;
+} GPIO_MOCK_RECORD;
+
+/** Request count lines, at the given offsets, from a gpiochip character
+    device such as /dev/gpiochip0, as outputs, initially low. consumer is
+    the label that the kernel shows for the lines (for example, in
+    gpioinfo). Returns NULL if the lines can't be requested and, if error
+    is not NULL, writes an error message that the caller should free. */
+GPIO_LINES *gpio_lines_open(const char *chip,
+                            const unsigned int *offsets,
+                            int count,
+                            const char *consumer,
+                            char **error);
+
+/** Create a mock set of count lines. Each change is recorded, and
+    advances a virtual clock by the time a real ioctl() would take (see
+    gpio_lines_mock_set_op_ns()); delays just advance the clock. This
+    method always succeeds. */
+GPIO_LINES *gpio_lines_mock_create(int count);
+
+/** Release the lines and free the object. */
+void gpio_lines_destroy(GPIO_LINES *self);
+
+/** Set the lines in mask to the corresponding bits of values, in one
+    operation. Nothing is done if those lines already have those values;
+    if written is not NULL, it's set to whether the operation was
+    actually carried out. Returns 0 if the operation failed. */
+_Bool gpio_lines_set(GPIO_LINES *self,
+                     unsigned long long mask,
+                     unsigned long long values,
+                     _Bool *written);
+
+/** Read the lines in mask into *values. Returns 0 on failure. */
+_Bool gpio_lines_get(GPIO_LINES *self,
+                     unsigned long long mask,
+                     unsigned long long *values);
+
+/** Helpers that invoke the delay and now operations. */
+void gpio_lines_delay(GPIO_LINES *self, long ns);
+long long gpio_lines_now(GPIO_LINES *self);
+
+/** Set how long the mock's virtual clock advances for each set or get
+    operation. The default is 1000ns, which is typical of an ioctl() on
+    a Raspberry Pi. */
+void gpio_lines_mock_set_op_ns(GPIO_LINES *self, long ns);
+
+/** Get the array of changes recorded by the mock, and its size. */
+const GPIO_MOCK_RECORD *gpio_lines_mock_records(GPIO_LINES *self,
+                                                int *count);
+
+/** Get the number of set and get operations the mock has handled -- each
+    would be a system call on a real chip. */
+long gpio_lines_mock_calls(GPIO_LINES *self);
+
+/** Call watch(arg, t_ns, values) on every change of the mock's lines,
+    with the time and the new values. Pass NULL to stop. */
+void gpio_lines_mock_watch(GPIO_LINES *self,
+                           void (*watch)(void *arg,
+                                         long long t_ns,
+                                         unsigned long long values),
+                           void *arg);
+
+/** Set the values that the mock returns for lines that are read. By
+    default, a line reads back the value it was last set to. */
+void gpio_lines_mock_set_inputs(GPIO_LINES *self,
+                                unsigned long long mask,
+                                unsigned long long values);
+
+/** Discard the mock's records and reset its counters. The virtual clock
+    is not reset. */
+void gpio_lines_mock_reset(GPIO_LINES *self);
+
 #endif
@@ -0,0 +1,144 @@
+/*============================================================================
+
+  hd44780_emu.h
+
+  A software model of an HD44780 LCD controller, wired in 4-bit mode to
+  the outputs of a PCF8574, as described at the top of lcd.c. The model
+  is fed with the successive output states of the PCF8574, each with
+  the time at which it was latched, and it behaves as the controller
+  would: it assembles nibbles on the falling edge of E, executes
+  instructions, and maintains the display data RAM (DDRAM) and character
+  generator RAM (CGRAM).
+
+  The point of this is to check the byte stream that the LCD "class"
+  produces, on a machine that doesn't have a real display. As well as
+  showing what would end up on the screen, the model checks the
+  timing constraints from the datasheet, and counts violations -- E
+  pulses that are too short, and instructions issued while the controller
+  is still busy with the previous one.
+
+  The easiest way to use the model is to attach it to an address on the
+  mock transport (see lcd_transport_mock_attach() in transport.h). For
+  a controller wired directly to GPIO lines, map its pins to the line
+  numbers with hd44780_emu_set_pins8() or _set_pins(), and feed it from
+  gpio_lines_mock_watch().
+
+  Distributed under the terms of the GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#ifndef __HD44780_EMU_H__
+#define __HD44780_EMU_H__
+
+// The size of the DDRAM address space. Not all of it is populated --
+//  in two-line mode, only 0x00-0x27 and 0x40-0x67 exist.
+#define HD44780_DDRAM_SIZE 128
+// Eight characters of eight rows each
+#define HD44780_CGRAM_SIZE 64
+
+// The number of characters in each line of DDRAM in two-line mode
+#define HD44780_LINE_LEN 40
+
+typedef struct HD44780_EMU {
+    // PCF8574 output bits that are wired to the controller's pins
+    int pin_rs;
+    int pin_rw;
+    int pin_e;
+    int pin_d[4];     // D4-D7
+    int pin_d_low[4]; // D0-D3, -1 if not connected
+
+    // The oscillator frequency. Execution times in the datasheet are for
+    //  270kHz; slower clones take proportionally longer
+    long fosc_hz;
+
+    // Controller state
+    unsigned char ddram[HD44780_DDRAM_SIZE];
+    unsigned char cgram[HD44780_CGRAM_SIZE];
+    int ac;             // Address counter
+    _Bool ac_cgram;     // Address counter points into CGRAM
+    _Bool eight_bit;    // Interface data length (DL)
+    _Bool two_line;     // N
+    _Bool entry_inc;    // Entry mode I/D
+    _Bool entry_shift;  // Entry mode S
+    _Bool display_on;   // D
+    _Bool cursor_on;    // C
+    _Bool blink_on;     // B
+    int shift;          // Display shift, in characters to the left
+    int resets;         // Function sets received since power-on in 8-bit mode
+    _Bool have_nibble;  // Holding the high nibble of a 4-bit transfer
+    unsigned char high; // ...and this is it
+    long long busy_until_ns;
+
+    // Interface state
+    unsigned int latch; // The last output state
+    long long e_rise_ns; // When E last went high
+    long long last_rise_ns;
+    _Bool read_low; // The next 4-bit read returns the low nibble
+
+    // Counters
+    long instructions;
+    long data_writes;
+    long e_pulse_violations; // E high for less than PW_EH
+    long e_cycle_violations; // E cycle shorter than t_cycE
+    long busy_violations;    // Written while executing an instruction
+    char last_violation[100];
+
+    // Told about every instruction and data write, if it's not NULL
+    void (*watch)(void *arg, long long t_ns, _Bool rs, unsigned char v);
+    void *watch_arg;
+} HD44780_EMU;
+
+/** Create a model of a controller in its power-on state: 8-bit mode,
+    one line, display off, DDRAM filled with spaces. The pin wiring is
+    the default from lcd.c; it can be changed with _set_pins. */
+HD44780_EMU *hd44780_emu_create(void);
+
+/** Free the model. */
+void hd44780_emu_destroy(HD44780_EMU *self);
+
+/** Change the PCF8574 output bits to which the controller's RS, RW, E
+    and D4-D7 pins are connected. */
+void hd44780_emu_set_pins(
+    HD44780_EMU *self, int rs, int rw, int e, const int d[4]);
+
+/** As _set_pins, for a controller with all eight data lines connected
+    (for example, directly to GPIO lines) -- d gives D0-D7. Bit numbers
+    may be up to 31. */
+void hd44780_emu_set_pins8(
+    HD44780_EMU *self, int rs, int rw, int e, const int d[8]);
+
+/** Set the controller's oscillator frequency, which determines how long
+    each instruction takes to execute. The default is 270kHz. */
+void hd44780_emu_set_fosc(HD44780_EMU *self, long hz);
+
+/** Tell the model that the PCF8574 outputs (or, more generally, the
+    lines wired to the controller) changed to b at time t_ns. Times must
+    not go backwards. */
+void hd44780_emu_latch(HD44780_EMU *self, long long t_ns, unsigned int b);
+
+/** Have watch called with each instruction (rs 0) or data byte (rs 1)
+    that the controller receives, and the time it was latched, before
+    the controller acts on it. This turns the model into a decoder of
+    the byte stream. Pass NULL to stop. */
+void hd44780_emu_watch(HD44780_EMU *self,
+                       void (*watch)(void *arg,
+                                     long long t_ns,
+                                     _Bool rs,
+                                     unsigned char v),
+                       void *arg);
+
+/** Get the state of the PCF8574 pins at time t_ns, as a read operation
+    on the PCF8574 would return it. The pins are quasi-bidirectional: any
+    output latched high reads whatever the controller drives onto it,
+    when the controller is driving the data lines. */
+unsigned char hd44780_emu_pins(HD44780_EMU *self, long long t_ns);
+
+/** Copy n characters, as shown on the screen, starting at position pos
+    of DDRAM line 0 or 1, taking the display shift into account. out
+    is not null-terminated. */
+void hd44780_emu_text(
+    const HD44780_EMU *self, int line, int pos, int n, unsigned char *out);
+
+/** Get the total number of timing violations seen so far. */
+long hd44780_emu_violations(const HD44780_EMU *self);
+
+#endif
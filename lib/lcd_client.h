@@ -0,0 +1,119 @@
+/*============================================================================
+
+  lcd_client.h
+
+  The client side of lcdd, the daemon that shares displays between
+  processes (see daemon/lcdd.c).
+
+  The daemon owns the displays: it initializes each one once, and is the
+  only process that talks to the I2C bus. Each display's framebuffer is
+  a block of shared memory, divided into layers. A client connects to
+  the daemon's socket and is given a layer of its own, which it writes
+  to directly -- an update is a memcpy() into shared memory, followed by
+  lcd_client_commit(), which wakes the daemon with an eventfd. The
+  daemon stacks up the visible layers, and sends whatever has changed
+  on the screen, at most once a frame.
+
+  A layer covers a rectangular region of the screen: the whole screen,
+  until the client sets another. Where regions overlap, the layer with
+  the higher z is on top; on a tie, the one that was connected later.
+  Every cell of a region is opaque, including spaces.
+
+  Distributed under the terms of the GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#ifndef __LCD_CLIENT_H__
+#define __LCD_CLIENT_H__
+
+#include "liblcd.h"
+
+// Where the daemon listens, unless it's told otherwise
+#define LCD_CLIENT_SOCKET "/run/lcdd.sock"
+
+// The number of clients that can share one display
+#define LCD_CLIENT_LAYERS 8
+
+// Enough cells for the biggest display
+#define LCD_CLIENT_CELLS (LCD_MAX_ROWS * 40)
+
+#define LCD_CLIENT_MAGIC "lcdd-1"
+
+/** One client's layer, in shared memory. The client changes it only
+    between lcd_client_begin() and lcd_client_commit(), which make gen
+    odd and then even again, so that the daemon can tell when it has
+    read a layer that was half-written. */
+typedef struct LCD_CLIENT_LAYER {
+    unsigned gen;
+    int owned;   // Set by the daemon while a client holds the layer
+    int visible;
+    int z;
+    int row;     // The region of the screen that the layer covers
+    int col;
+    int rows;
+    int cols;
+    unsigned char cells[LCD_CLIENT_CELLS]; // Row by row, cols wide
+} LCD_CLIENT_LAYER;
+
+/** The shared memory of one display. */
+typedef struct LCD_CLIENT_SHM {
+    char magic[8];
+    int rows;
+    int cols;
+    LCD_CLIENT_LAYER layer[LCD_CLIENT_LAYERS];
+} LCD_CLIENT_SHM;
+
+/** What the daemon sends back to a client that asks for a display,
+    along with the shared memory and eventfd descriptors. status is 0,
+    or an errno value. */
+typedef struct LCD_CLIENT_HELLO {
+    int status;
+    int layer;
+} LCD_CLIENT_HELLO;
+
+typedef struct LCD_CLIENT LCD_CLIENT;
+
+/** Connect to the daemon listening on path (LCD_CLIENT_SOCKET if it's
+    NULL) and get a layer on display number display, counting from zero
+    in the order the daemon was given them. The layer is filled with
+    spaces, and is visible, but nothing is drawn until the first
+    commit. Returns NULL if that can't be done -- in which case, if
+    error is not NULL, an error message is written that the caller
+    should free. */
+LCD_CLIENT *lcd_client_open(const char *path, int display, char **error);
+
+/** Give the layer back, and disconnect. What the layer showed is removed
+    from the screen. */
+void lcd_client_close(LCD_CLIENT *self);
+
+/** Get the size of the display. */
+int lcd_client_rows(const LCD_CLIENT *self);
+int lcd_client_cols(const LCD_CLIENT *self);
+
+/** Start changing the layer. Calls to the methods below must come between
+    this and lcd_client_commit(). */
+void lcd_client_begin(LCD_CLIENT *self);
+
+/** Set the region of the screen that the layer covers, and its place in
+    the stack. */
+void lcd_client_set_region(
+    LCD_CLIENT *self, int row, int col, int rows, int cols, int z);
+
+/** Show or hide the layer. */
+void lcd_client_set_visible(LCD_CLIENT *self, _Bool visible);
+
+/** Write a string into the layer, starting at row, col, and cut off at
+    the edge of the screen. Positions are on the screen, not relative to
+    the region; cells outside the region aren't shown. */
+void lcd_client_write_string_at(
+    LCD_CLIENT *self, int row, int col, const char *s);
+
+/** Get the layer's cells, rows x cols of them, row by row, to write to
+    directly. */
+unsigned char *lcd_client_cells(LCD_CLIENT *self);
+
+/** Finish changing the layer, and tell the daemon. This costs one
+    write() to an eventfd; the daemon merges commits that arrive in
+    the same frame. */
+void lcd_client_commit(LCD_CLIENT *self);
+
+#endif
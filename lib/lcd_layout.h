@@ -0,0 +1,79 @@
+/*============================================================================
+
+  lcd_layout.h
+
+  A description of a screen, as fixed labels and fields whose values the
+  application sets. The layout formats each value into its place in the
+  framebuffer, and writes only the characters that differ from what the
+  field showed before -- so a clock that ticks over by one second
+  changes one cell, not a line. Fields and labels are added once, when
+  the screen is set up; after that, setting a value allocates no memory
+  and doesn't use the printf family.
+
+  Like the widgets, a layout writes with the ordinary lcd_ functions, so
+  with output deferred, the changes to several fields go out together at
+  the next lcd_flush().
+
+  Distributed under the terms of the GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#ifndef __LCD_LAYOUT_H__
+#define __LCD_LAYOUT_H__
+
+#include "liblcd.h"
+
+// Flags for the fields. The alignment applies when the value is
+//  narrower than the field; the default is to the right
+#define LCD_LAYOUT_RIGHT 0x00
+#define LCD_LAYOUT_LEFT 0x01
+#define LCD_LAYOUT_CENTRE 0x02
+// Pad a number on the left with zeros instead of spaces
+#define LCD_LAYOUT_ZERO 0x04
+
+// Formats for time fields
+#define LCD_LAYOUT_HMS 0 // HH:MM:SS
+#define LCD_LAYOUT_HM 1  // HH:MM
+#define LCD_LAYOUT_MS 2  // MM:SS
+
+typedef struct LCD_LAYOUT LCD_LAYOUT;
+
+/** Create an empty layout for lcd. This method always succeeds. */
+LCD_LAYOUT *lcd_layout_create(LCD *lcd);
+
+/** Free the layout. What it drew is left on the screen. */
+void lcd_layout_destroy(LCD_LAYOUT *self);
+
+/** Add fixed text at row, col. It's drawn at once. */
+void lcd_layout_label(LCD_LAYOUT *self, int row, int col, const char *text);
+
+/** Add a field for an integer, width characters wide. A value that
+    doesn't fit is shown as '#' characters. Returns the field's number,
+    for lcd_layout_set_int(). Fields are blank until they are set. */
+int lcd_layout_int(LCD_LAYOUT *self, int row, int col, int width, int flags);
+
+/** Add a field for a fixed-point number with the given number of
+    decimal places: the value 1234, with two decimals, shows as 12.34. */
+int lcd_layout_fixed(
+    LCD_LAYOUT *self, int row, int col, int width, int decimals, int flags);
+
+/** Add a field for a time, in one of the LCD_LAYOUT_HMS/HM/MS formats.
+    The value is a number of seconds -- since midnight for a time of
+    day. Hours aren't wrapped round, so the field can show a duration
+    of up to 99 hours; longer is shown as '#' characters. */
+int lcd_layout_time(LCD_LAYOUT *self, int row, int col, int format);
+
+/** Add a field for text. Longer text is cut off at the width. */
+int lcd_layout_string(
+    LCD_LAYOUT *self, int row, int col, int width, int flags);
+
+/** Set the value of an integer, fixed-point or time field. */
+void lcd_layout_set_int(LCD_LAYOUT *self, int field, long value);
+
+/** Set the value of a text field. */
+void lcd_layout_set_string(LCD_LAYOUT *self, int field, const char *s);
+
+/** Draw every label and field again -- for example, after the screen
+    has been cleared. */
+void lcd_layout_draw(LCD_LAYOUT *self);
+
+#endif
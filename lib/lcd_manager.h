@@ -0,0 +1,78 @@
+/*============================================================================
+
+  lcd_manager.h
+
+  A "class" that owns a number of LCD objects, possibly spread over
+  several I2C buses, and refreshes them all together.
+
+  Driving displays one after another makes the total refresh time the
+  sum of their individual times -- and much of each display's time is
+  spent waiting for its controller to execute an instruction, with the
+  bus idle. The manager runs one worker per bus, and each worker
+  interleaves the traffic for the displays on its bus: while one
+  controller is busy, the bus is used to feed another. Different buses
+  are driven at the same time, by different threads.
+
+  Displays added to the manager are put into deferred mode (see
+  lcd_set_deferred()). Write to them with the usual lcd_ functions, from
+  one thread, and then call lcd_manager_flush() to send the changes to
+  every display. Mode and cursor changes are still sent immediately,
+  display by display.
+
+  Distributed under the terms of the GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#ifndef __LCD_MANAGER_H__
+#define __LCD_MANAGER_H__
+
+#include "liblcd.h"
+
+typedef struct LCD_MANAGER LCD_MANAGER;
+
+/** Create a manager with no displays. This method always succeeds. */
+LCD_MANAGER *lcd_manager_create(void);
+
+/** Stop the workers, terminate and free every display, and close the
+    buses that the manager opened. */
+void lcd_manager_destroy(LCD_MANAGER *self);
+
+/** Set the timing profile (see lcd_set_timing()) for the displays that
+    are added from now on, including the initialization sequence. The
+    default is the datasheet profile. */
+void lcd_manager_set_timing(LCD_MANAGER *self, const LCD_TIMING *timing);
+
+/** Create and initialize a display at address addr on bus, which remains
+    owned by the caller. Every display on the same physical bus must be
+    added with the same transport, or the manager will drive the bus
+    from two threads at once. Returns the display, which remains owned
+    by the manager, or NULL if it could not be initialized -- in which
+    case, if error is not NULL, an error message is written that the
+    caller should free. */
+LCD *lcd_manager_add(LCD_MANAGER *self,
+                     LCD_TRANSPORT *bus,
+                     int addr,
+                     int rows,
+                     int cols,
+                     char **error);
+
+/** As lcd_manager_add(), but the bus is an I2C device, such as
+    /dev/i2c-1, that the manager opens the first time it is named. */
+LCD *lcd_manager_add_dev(LCD_MANAGER *self,
+                         const char *dev,
+                         int addr,
+                         int rows,
+                         int cols,
+                         char **error);
+
+/** Get the number of displays, and the display at index i, in the order
+    they were added. */
+int lcd_manager_count(const LCD_MANAGER *self);
+LCD *lcd_manager_get(const LCD_MANAGER *self, int i);
+
+/** Send whatever has changed on every display, and wait until it is
+    all on the bus. The last instruction that each display was sent may
+    still be executing; the next write to the display waits for it, so
+    the next update can be prepared in the meantime. */
+void lcd_manager_flush(LCD_MANAGER *self);
+
+#endif
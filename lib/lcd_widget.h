@@ -0,0 +1,75 @@
+/*============================================================================
+
+  lcd_widget.h
+
+  Bar graphs and big digits, drawn with custom characters (see
+  lcd_define_glyph()). Each widget remembers what it last drew, and
+  redraws only the cells that change, so it can be updated many times a
+  second. The glyphs are shared by every widget on a display: the bar
+  graphs need one glyph for each partly-filled step, and the big digits
+  are built from three (two rows high) or five (three rows high) bar
+  shapes, plus the full block.
+
+  The module has only eight CGRAM slots, and the glyph cache gives one
+  to each glyph that is on the screen. Horizontal bars use four glyphs
+  between them, each vertical bar one of its own, and big digits three
+  or five. Beyond eight, the glyphs take turns: a glyph that comes back
+  on screen has its bitmap sent again, and one that can't get a slot
+  at all shows as '#'. So horizontal bars and three-row big digits
+  (nine glyphs) shouldn't be used on the same display; two-row digits
+  (seven) or vertical bars leave room for both.
+
+  Each update of a widget goes out in one flush (a vertical bar whose
+  glyph changes takes two). If the display's output is deferred, the
+  changes to several widgets wait, and go out together at the next
+  lcd_flush(). Custom characters with negative ids are reserved for the
+  widgets.
+
+  The full block is character 0xFF, which is a solid block in the
+  standard (A00) character set of the HD44780.
+
+  Distributed under the terms of the GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#ifndef __LCD_WIDGET_H__
+#define __LCD_WIDGET_H__
+
+#include "liblcd.h"
+
+typedef struct LCD_BAR LCD_BAR;
+typedef struct LCD_BIGNUM LCD_BIGNUM;
+
+/** Create a bar graph of len cells, for values from 0 to max. A
+    horizontal bar starts at row, col and grows to the right, in steps
+    of one pixel column -- five to a cell. A vertical bar starts at row,
+    col and grows upwards, in steps of one pixel row -- eight to a cell.
+    Nothing is drawn until the first call to lcd_bar_set(). This method
+    always succeeds. */
+LCD_BAR *lcd_bar_create(
+    LCD *lcd, int row, int col, int len, _Bool vertical, int max);
+
+/** Free the bar graph. The cells it drew are left as they are. */
+void lcd_bar_destroy(LCD_BAR *self);
+
+/** Show value, which is clamped to the range 0 to max. A horizontal bar
+    that moves by one step changes one cell; a vertical bar that moves
+    within a cell changes a row of its glyph, which is one byte. */
+void lcd_bar_set(LCD_BAR *self, int value);
+
+/** Create a big-digit display of width characters, each three cells
+    wide with a blank column between them, and height 2 or 3 rows. The
+    first character's top left cell is at row, col. This method always
+    succeeds. */
+LCD_BIGNUM *lcd_bignum_create(
+    LCD *lcd, int row, int col, int height, int width);
+
+/** Free the big-digit display. The cells it drew are left as they are. */
+void lcd_bignum_destroy(LCD_BIGNUM *self);
+
+/** Show text, which may contain digits, spaces and '-'; anything else
+    shows as a space. Text shorter than the width is padded with spaces,
+    and longer text is cut off. Only the characters that differ from
+    the last call are redrawn. */
+void lcd_bignum_set(LCD_BIGNUM *self, const char *text);
+
+#endif
@@ -8,8 +8,8 @@
   eight digitial outputs.
 
   There are many ways to connect the PCF8574 to the HD8840. Please see
-  the definitions at the top of lcd.c, to see typical connections
-  (or edit this file if your connections are different).
+  the definitions at the top of lcd.c, to see typical connections. If
+  your connections are different, describe them with lcd_set_pins().
 
   This "class" provides the most basic functions available for the
   HD88470 LCD module -- initialization, writing text at specific
@@ -21,8 +21,18 @@
   because the module is essentially useless with it switched off. If a
   pin is wired to the backlight, the code will turn it permanently on.
   In addition, although both the PCF8574 and the HD44780 have data-read
-  operations, this code makes on use of them. In the modules R/W pin
-  in connected, it is set permanently low, for write mode.
+  operations, this code makes no use of them unless busy-flag polling
+  is enabled with lcd_set_busy_poll(). Otherwise, if the module's R/W pin
+  is connected, it is set permanently low, for write mode.
+
+  The methods that change what is on the screen -- writing text and
+  glyphs, clearing, flushing, the cursor, the mode and the marquee --
+  may be called from any number of threads at once. Each call is
+  carried out as a whole, and the calls of threads that arrive while
+  the bus is busy are combined: one of the threads applies them all to
+  the framebuffer and sends the result with a single flush, while the
+  others wait for it. The settings (timing, pins, deferred output,
+  busy polling) should be made before the threads start.
 
   Copyright (c)1990-2020 Kevin Boone. Distributed under the terms of the
   GNU Public Licence, v3.0
@@ -31,37 +41,226 @@
 #ifndef __LIBLCD_H__
 #define __LIBLCD_H__
 
+#include "gpio.h"
+#include "transport.h"
+
 // Flags for use with lcd_set_mode().
 #define LCD_MODE_CURSOR_BLINK 0x01
 #define LCD_MODE_CURSOR_ON 0x02
 #define LCD_MODE_DISPLAY_ON 0x04
 
+// Size of the buffer in which PCF8574 output states are collected before
+//  they are written to the I2C device. The PCF8574 latches each byte of
+//  a multi-byte write as a separate output state, so a whole string or
+//  command sequence can go out in a single write() call.
+#define LCD_TX_MAX 2048
+
+// The size of the HD44780's display data RAM address space
+#define LCD_DDRAM_SIZE 128
+
+// The most rows a display can have. A 40x4 display has two controllers,
+//  each of which drives two of the rows
+#define LCD_MAX_ROWS 4
+#define LCD_MAX_CONTROLLERS 2
+
+// Presets for lcd_set_timing_preset().
+// The timings used by earlier versions of this library: a millisecond
+//  after every edge of E, and 35 msec for each step of initialization.
+//  Very slow, but tolerant of the slowest clones of the HD44780.
+#define LCD_TIMING_CONSERVATIVE 0
+// The timings from the HD44780 datasheet. This is the default.
+#define LCD_TIMING_DATASHEET 1
+
+/** The timing profile. All times are in nanoseconds, and all are minimum
+    times that must elapse after the relevant event before the next
+    byte can be sent to the PCF8574. The library doesn't sleep unless
+    it has to: if the time taken to clock a byte onto the I2C bus already
+    covers the wait, nothing else is done, and if the wait is only a little
+    longer than that, the last output state is repeated on the bus to make
+    up the time, rather than splitting the write. */
+typedef struct LCD_TIMING {
+    long bus_hz;      // I2C clock rate that the bus is assumed to run at
+    long e_pulse_ns;  // Width of the E pulse, high and low
+    long edge_ns;     // Extra wait after every edge of E
+    long exec_ns;     // Execution time of most instructions
+    long data_ns;     // Execution time of a data write
+    long clear_ns;    // Execution time of clear display and return home
+    long power_on_ns; // Wait after power-on, before initialization
+    long reset1_ns;   // Wait after the first 8-bit function set
+    long reset2_ns;   // Wait after the second 8-bit function set
+} LCD_TIMING;
+
+/** Counters that show where the time goes when the LCD is updated. Times
+    are measured on the transport's clock (see lcd_transport_now()), so
+    on the mock they are simulated bus time. */
+typedef struct LCD_STATS {
+    long long writes;     // Transport write operations
+    long long reads;      // Transport read operations
+    long long bytes;      // PCF8574 output states written, with padding
+    long long commands;   // HD44780 instructions sent
+    long long data;       // HD44780 data bytes (characters) sent
+    long long addr_jumps; // Set DDRAM address instructions
+    long long glyph_rows; // Custom character bitmap rows sent
+    long long flushes;    // Framebuffer updates encoded
+    long long polls;      // Busy-flag reads
+    long long sleeps;     // Waits for the module that needed a sleep
+    long long sleep_ns;   // Time spent in those waits
+    long long io_ns;      // Time spent in transport reads and writes
+    long long errors;     // Transport operations that failed
+    int last_errno;       // errno from the last failure
+} LCD_STATS;
+
+/** How the LCD module's pins are connected to the PCF8574 outputs, 0-7.
+    d gives D4-D7. rw and led may be -1 if those pins aren't connected
+    to the PCF8574 -- R/W tied low, or the backlight wired permanently
+    on. e2 is the E pin of the second controller of a 40x4 display,
+    which is usually wired in place of R/W; it's ignored for other
+    sizes. */
+typedef struct LCD_PCF8574_PINS {
+    int rs;
+    int rw;
+    int e;
+    int led;
+    int d[4];
+    int e2;
+} LCD_PCF8574_PINS;
+
+// The state of the render thread, private to lcd.c
+struct LCD_ASYNC;
+// The text of the rows that scroll, private to lcd.c
+struct LCD_MARQUEE;
+// The custom characters, private to lcd.c
+struct LCD_GLYPHS;
+// What lets several threads share the LCD, private to lcd.c
+struct LCD_COMBINER;
+
 typedef struct LCD {
     int i2c_addr;
-    int fd; // For the /dev/i2c-x device
+    LCD_TRANSPORT *transport; // Usually the /dev/i2c-x device
+    _Bool owns_transport;     // Destroy the transport on _terminate()
     int rows;
     int cols;
     _Bool ready;
+    _Bool synced;    // The module is known to be in 4-bit mode
+    _Bool busy_poll; // Poll the busy flag instead of sleeping
+    GPIO_LINES *gpio;  // If the module is wired straight to GPIO lines
+    _Bool owns_gpio;   // Destroy the lines on _terminate()
+    _Bool eight_bit;   // All eight data lines are wired (GPIO only)
+    LCD_PCF8574_PINS pins; // The wiring, when driven through a PCF8574
+    // The output states that send each byte, with RS low and high: two
+    //  strobes of E in 4-bit mode, or one in 8-bit mode
+    unsigned short enc[2][256][4];
+    unsigned short tx[LCD_TX_MAX]; // Pending output states
+    unsigned char tx_out[LCD_TX_MAX]; // The segment being written
+    long tx_hold[LCD_TX_MAX];     // Wait required after each state
+    int tx_len;
+    int tx_pos;                   // The next state to be sent
+    long long ready_at; // When the module can take more, on the bus clock
+    _Bool sending;      // Encoding for a flush, which may start early
+    _Bool nonblocking;  // Output is sent by lcd_step()
+    _Bool stale;        // Changes that lcd_step() hasn't encoded yet
+    int timer_fd;       // For lcd_poll_fd(), -1 until it's asked for
+    long long armed_at; // What timer_fd is set to, -1 if it isn't
+    _Bool warm;        // Attach to a module that's already initialized
+    char *state_path;  // Where to keep the screen contents between runs
+    LCD_TIMING timing;
+    int controllers; // 2 for a 40x4 display, otherwise 1
+    unsigned char row_addr[LCD_MAX_ROWS]; // DDRAM address of each row
+    unsigned char row_ctrl[LCD_MAX_ROWS]; // The controller of each row
+    int ctrl;        // The controller being addressed, -1 for all of them
+    int cursor_ctrl; // The controller that shows the cursor
+    unsigned char mode; // The last lcd_set_mode() flags
+    unsigned char *fb;  // What should be on the screen, rows x cols
+    // What we think is in each controller's DDRAM, -1 if unknown
+    short ddram[LCD_MAX_CONTROLLERS * LCD_DDRAM_SIZE];
+    int ac[LCD_MAX_CONTROLLERS]; // The address counters, -1 if unknown
+    int shift[LCD_MAX_CONTROLLERS];      // The display shift we want
+    int shift_sent[LCD_MAX_CONTROLLERS]; // What it is, -1 if unknown
+    struct LCD_MARQUEE *marquee; // Scrolling text, if there is any
+    struct LCD_GLYPHS *glyphs;   // Custom characters, if there are any
+    _Bool deferred;             // Writes wait for lcd_flush()
+    struct LCD_ASYNC *async;    // The render thread, if it's running
+    struct LCD_COMBINER *combiner; // Serializes the callers
+    LCD_STATS stats;
 } LCD;
 
 /** Initialize the LCD object with the numbers of the three GPIO
     pins that will be used. Note that this method only stores values,
     and will always succeed. The caller should specify the size of
     the LCD, because this cannot be worked out by interrogating
-    the device. The sizes are only used to prevent writing off the
-    ends or bottom of the LCD.  */
+    the device. The size determines the DDRAM address of each row --
+    the rows of a 20x4 display, for example, start at 0x00, 0x40, 0x14
+    and 0x54 -- and a 40x4 display is driven as two controllers, with
+    separate E pins (see lcd_set_pins()). rows must be at most
+    LCD_MAX_ROWS, and cols at most 40, the length of a line of
+    DDRAM. */
 LCD *lcd_create(int i2c_addr, int rows, int cols);
 
 /** Clean up this object. This method implicitly calls _terminate(). */
 void lcd_destroy(LCD *self);
 
+/** Set how the LCD module is wired to the PCF8574. The default is the
+    wiring described at the top of lcd.c, which is the most common one
+    on the ready-made "backpacks". This should be called before _init(),
+    since the initialization sequence is the first thing that uses the
+    wiring. */
+void lcd_set_pins(LCD *self, const LCD_PCF8574_PINS *pins);
+
+/** Get the wiring set by lcd_set_pins(), or the default. */
+void lcd_get_pins(LCD *self, LCD_PCF8574_PINS *pins);
+
 /** Initialize this object. This opens a file handle for the
-    I2C device and keeps it open until _unint() is called. This method
+    I2C device and keeps it open until _unint() is called. The device
+    is driven with I2C_RDWR transactions if the adapter supports them
+    (see lcd_transport_i2c_auto_create()). This method
     can fail. If it does, and *error is not NULL, then it is written with
     and error message that the caller should free. If this method
     succeeds, _terminate() should be called in due course to clean up. */
 _Bool lcd_init(char *dev, LCD *self, char **error);
 
+/** The gpiochip line offsets to which the module's pins are wired, when
+    it's connected directly to GPIO rather than through a PCF8574. In
+    4-bit mode, only D4-D7 (d[4] to d[7]) are used. The R/W pin must be
+    tied low. e2 is the E pin of the second controller of a 40x4
+    display, and is ignored for other sizes. */
+typedef struct LCD_GPIO_PINS {
+    unsigned int rs;
+    unsigned int e;
+    unsigned int d[8];
+    unsigned int e2;
+} LCD_GPIO_PINS;
+
+/** Initialize this object to drive a module that is wired directly to
+    GPIO lines on chip (for example, /dev/gpiochip0), with four or eight
+    data lines. In 8-bit mode, each character or instruction is a single
+    strobe of E, rather than two. The lines are requested from the
+    kernel, and kept until _terminate() is called. Error handling is as
+    for lcd_init(). Busy-flag polling isn't available, because R/W is
+    not connected. */
+_Bool lcd_init_gpio(LCD *self,
+                    const char *chip,
+                    const LCD_GPIO_PINS *pins,
+                    _Bool eight_bit,
+                    char **error);
+
+/** As lcd_init_gpio(), but using lines that the caller has created --
+    for example, a mock (see gpio.h). The lines must be in the order RS,
+    E, and then the data lines from the lowest: D4-D7, or D0-D7 if
+    eight_bit is set, and then, for a 40x4 display, E of the second
+    controller. The lines are not destroyed by _terminate(). */
+_Bool lcd_init_gpio_lines(LCD *self,
+                          GPIO_LINES *lines,
+                          _Bool eight_bit,
+                          char **error);
+
+/** Initialize this object to use a transport that the caller has
+    created. This is how an LCD is driven through something other than
+    the default i2c-dev transport, or how several LCDs share one bus.
+    The transport is not destroyed by _terminate(); the caller must
+    destroy it after all the LCDs that use it have been terminated.
+    Error handling is as for lcd_init(). */
+_Bool lcd_init_transport(LCD *self, LCD_TRANSPORT *transport, char **error);
+
 
 /** Clean up. In principle, this operation can fail, as it involves device
     operations. But what can we do if this happens? Probably nothing, so no
@@ -71,7 +270,13 @@ void lcd_terminate(LCD *self);
 /** Write a character at the specified position. Note that the LCD device
     has, by default, a character set that is a kind of modified ASCII.
     The method will do nothing if the specific row and column are out of
-    range. */
+    range.
+
+    Like all the methods that change the text on the screen, this one
+    writes to a framebuffer, and then sends only the characters that
+    differ from what the LCD module is already showing -- or, if output
+    is deferred (see lcd_set_deferred()), sends nothing until
+    lcd_flush() is called. */
 void lcd_write_char_at(LCD *self, int row, int col, unsigned char c);
 
 /** Write a string of ASCII(-ish) characters, starting at the specified
@@ -84,8 +289,31 @@ void lcd_write_string_at(LCD *self,
                              const unsigned char *s,
                              _Bool wrap);
 
+/** Blank the screen. */
 void lcd_clear(LCD *self);
 
+/** Send whatever parts of the framebuffer differ from the screen. Runs of
+    changed characters are sent with a single address instruction, and
+    short runs of unchanged characters between them are rewritten if
+    that's cheaper than setting a new address.
+
+    This returns as soon as the last byte has been written. The module
+    may still be executing the last instruction -- 1.52msec, if it was
+    a clear -- but nothing waits for that until the next byte is due to
+    be sent, so the caller can get on with preparing the next update in
+    the meantime. */
+void lcd_flush(LCD *self);
+
+/** If deferred is set, the methods that change the text only change the
+    framebuffer, and nothing is sent until lcd_flush() is called. This is
+    the efficient way to update several parts of the screen at once. */
+void lcd_set_deferred(LCD *self, _Bool deferred);
+
+/** Forget what is on the screen, so the next flush rewrites every
+    character. This is only needed if something other than this object
+    has written to the LCD module. */
+void lcd_invalidate(LCD *self);
+
 /** Sets the display mode control register. This allows the display to
     be turned on and off, and the cursor mode to be set. These functions
     don't naturally go together -- they just happen to be sent to the
@@ -94,10 +322,235 @@ void lcd_clear(LCD *self);
     hugely convenient. */
 void lcd_set_mode(LCD *self, unsigned char mode);
 
+/** Select one of the predefined timing profiles, LCD_TIMING_CONSERVATIVE
+    or LCD_TIMING_DATASHEET. This can be done before or after _init(). */
+void lcd_set_timing_preset(LCD *self, int preset);
+
+/** Set a custom timing profile. This is useful for clones of the HD44780
+    whose speed is known to differ from the datasheet, or for buses that
+    run faster or slower than 100kHz. */
+void lcd_set_timing(LCD *self, const LCD_TIMING *timing);
+
+/** Get the timing profile currently in use, for example to modify it and
+    pass it to lcd_set_timing(). */
+void lcd_get_timing(LCD *self, LCD_TIMING *timing);
+
+/** Get one of the predefined timing profiles, without reference to any
+    particular LCD. */
+void lcd_get_timing_preset(int preset, LCD_TIMING *timing);
+
+/** Enable or disable busy-flag polling. When it is enabled, instead of
+    sleeping for the worst-case execution time of an instruction, the
+    library raises R/W and reads the busy flag back through the PCF8574,
+    and carries on as soon as the module is ready. This only replaces
+    waits that would otherwise need a sleep; short waits are still
+    covered by the time bytes take on the bus, which is quicker than a
+    read. It is useful for clones of the HD44780 whose speed is unknown --
+    set generous execution times in the timing profile, and the library
+    will wait only as long as each instruction really takes.
+
+    Polling needs the R/W pin to be wired to the PCF8574, and a transport
+    that can read. This method returns 0 if the transport can't read, if
+    lcd_set_pins() has said that R/W isn't wired, or if the display has
+    two controllers (whose E pins take the place of R/W). It
+    can be called before _init(), so that the initialization sequence
+    benefits too; in that case, polling is quietly left off if the
+    transport turns out not to be able to read. If
+    the busy flag never clears, which is what happens when R/W is not
+    wired, polling is switched off again and the library goes back to
+    sleeping. */
+_Bool lcd_set_busy_poll(LCD *self, _Bool enable);
+
+/** Make _init() attach to a module that is already running, rather
+    than putting it through the power-on initialization sequence. That
+    sequence takes about 45msec with the datasheet timing, and 150msec
+    with the conservative timing, mostly in waits that are only needed
+    just after power-on; a warm attach takes a few milliseconds, which
+    matters for short-lived programs. The module is assumed to
+    have been initialized since it was powered on, and to be in 4-bit
+    mode -- though not necessarily at a byte boundary.
+
+    If state_path is not NULL, _terminate() writes a record of what is
+    on the screen there, and the next warm attach reads (and removes)
+    it. The text is then left on the screen, and in the framebuffer,
+    so that only what the program changes needs to be sent. If the file
+    doesn't exist, the full initialization sequence is used, so keep it
+    on a file system that doesn't survive a reboot, like /run. If busy
+    polling is enabled, the attach also checks that the busy flag can be
+    read, and falls back to the full sequence if not. Call this before
+    _init(). */
+void lcd_set_warm_attach(LCD *self, _Bool enable, const char *state_path);
+
+/** Start a render thread that takes over all communication with the LCD
+    module. From then on, lcd_write_char_at(), lcd_write_string_at(),
+    lcd_clear(), lcd_flush(), lcd_set_mode(), lcd_set_cursor(),
+    lcd_set_marquee() and lcd_marquee_step() just add an operation to a
+    lock-free queue and return at once; the render thread applies them
+    to the framebuffer and sends the changes. If several updates to the
+    same cell are queued while the bus is busy, only the last is sent.
+
+    The other settings (timing, deferred output, busy polling) should
+    be made before starting the render thread. Returns 0, and writes
+    *error if it is not NULL, if the thread can't be started. */
+_Bool lcd_start_async(LCD *self, char **error);
+
+/** Wait until the render thread has sent everything queued before the
+    call. Does nothing if the render thread isn't running. */
+void lcd_sync(LCD *self);
+
+/** Send everything queued, and stop the render thread. This method is
+    called by _terminate(), so it doesn't usually need to be called
+    explicitly. */
+void lcd_stop_async(LCD *self);
+
+/** A low-level interface to the transmit queue, for code that schedules
+    the output of several displays itself (see lcd_manager.h).
+    lcd_encode() works out what lcd_flush() would send, and queues it
+    without sending anything. lcd_pending() says whether anything is
+    queued. lcd_send_next() sends as much of the queue as can go
+    without a long wait, and returns the time before which nothing more
+    may be sent -- on the transport's clock (see lcd_transport_now()).
+    lcd_ready_at() returns that time again. lcd_send_next_all() does the
+    same as lcd_send_next() for n displays that share a transport, with
+    every segment sent as a message of one transaction, if the
+    transport supports that. None of these may be used while the render
+    thread is running, and they should all be called from one thread;
+    other threads may go on writing to the display, if output is
+    deferred. */
+void lcd_encode(LCD *self);
+_Bool lcd_pending(LCD *self);
+long long lcd_send_next(LCD *self);
+void lcd_send_next_all(LCD *const *lcds, int n);
+long long lcd_ready_at(LCD *self);
+
+/** Switch non-blocking mode on or off, for programs built around an
+    event loop. In non-blocking mode, the methods that change the screen
+    never wait for the bus or the module: they change the framebuffer,
+    and the output is sent, a piece at a time, by calls to lcd_step().
+    Changes made while earlier output is still going out are merged, so
+    only the latest text is sent. Switching the mode off sends whatever
+    is left, and waits. This can't be combined with the render thread
+    or with lcd_manager.h. */
+void lcd_set_nonblocking(LCD *self, _Bool nonblocking);
+
+/** Get a file descriptor that becomes readable when lcd_step() should
+    be called -- a timerfd on CLOCK_MONOTONIC, which is the clock of the
+    I2C and GPIO transports. Add it to poll() or epoll for reading; it
+    belongs to the LCD, and is closed by lcd_destroy(). Returns -1, and
+    sets errno, if the timerfd can't be created. */
+int lcd_poll_fd(LCD *self);
+
+/** Send whatever output is due, without waiting, and return the time
+    at which this should be called again, on the transport's clock (see
+    lcd_transport_now()) -- or -1 if there's nothing left to send. This
+    is the alternative to lcd_poll_fd() for a loop that keeps its own
+    timers, or for transports, like the mock, that run on a clock of
+    their own. Each call writes to the bus at most until the module
+    needs time to execute an instruction, so it takes no longer than
+    one transport write, usually much less. */
+long long lcd_step(LCD *self);
+
+/** Get the time at which lcd_step() should next be called, as it
+    would return it, taking account of anything written since. */
+long long lcd_next_deadline(LCD *self);
+
+/** Copy the statistics counters. If the render thread is running, this
+    waits for it to send everything that has been queued, as lcd_sync()
+    does, so that the counters are consistent. */
+void lcd_get_stats(LCD *self, LCD_STATS *stats);
+
+/** Set all the statistics counters to zero. */
+void lcd_reset_stats(LCD *self);
+
+/** Write the statistics of count displays to path, in the text format
+    that the Prometheus node exporter's textfile collector reads. Each
+    display is labelled with the corresponding entry of names, and its
+    I2C address. The file is written under a temporary name and renamed,
+    so the collector never sees a partial file. Returns 0 if the file
+    can't be written, and writes *error if it is not NULL. */
+_Bool lcd_write_stats_textfile(const char *path,
+                               LCD *const *lcds,
+                               const char *const *names,
+                               int count,
+                               char **error);
+
+/** Scroll text across a row, like a news ticker. The row shows the
+    first characters of the text at once, and the text moves one place
+    to the left on each call to lcd_marquee_step(), wrapping round at
+    the end -- so it should end with some spaces. The text can be of any
+    length. Pass NULL to stop scrolling, leaving the row as it is. While
+    a row scrolls, writing to it has no lasting effect. */
+void lcd_set_marquee(LCD *self, int row, const unsigned char *text);
+
+/** Move the text of every marquee one place along, and send the change
+    unless output is deferred.
+
+    Where it can, this uses the HD44780's display shift, which moves
+    the whole screen along its lines of DDRAM with a single instruction.
+    The text that is about to come into view is written off the screen,
+    in the part of each line that isn't shown, many characters at a time,
+    so that most steps cost one instruction instead of a rewrite of the
+    row. The display shift moves every row of a controller, so it's
+    only used when each row of the controller is a marquee or blank,
+    and has a line of DDRAM to itself -- which is the case on one- and
+    two-row displays, and on each half of a 40x4. Otherwise, the rows
+    are rewritten. */
+void lcd_marquee_step(LCD *self);
+
+/** Define a custom character, for lcd_write_glyph_at(). id is any
+    number the application likes, other than the negative ones, which
+    are used by the widgets in lcd_widget.h. bitmap gives the eight rows
+    of the character, top first, with the leftmost of the five pixels in
+    bit 4. fallback is an ordinary character to show instead when the
+    glyph can't be given a place in the controller (see below). Defining
+    an id again changes its bitmap, and any cells that show it change at
+    the next update, for the cost of the rows of the bitmap that
+    differ. */
+void lcd_define_glyph(LCD *self,
+                      int id,
+                      const unsigned char bitmap[8],
+                      unsigned char fallback);
+
+/** Write a custom character at the specified position, and send it
+    unless output is deferred.
+
+    The HD44780 has room for only eight custom characters, character
+    codes 0-7, so glyphs are given slots as they are written. When a
+    glyph needs a slot and none is free, it takes over the one least
+    recently written whose character is no longer on the screen. A
+    bitmap is only uploaded to a slot when it is shown, and only the
+    rows that differ from what the slot holds are sent, so glyphs that
+    come and go cost nothing if they get their old slot back. If all
+    eight slots are on the screen, the cell shows the fallback
+    character. An application that uses glyphs should not write
+    character codes 0-15 itself. */
+void lcd_write_glyph_at(LCD *self, int row, int col, int id);
+
+/** A cell for lcd_write_cells(): the character c, or if glyph is set,
+    the custom character id. If a glyph's bitmap is not NULL, the glyph
+    is defined first, as by lcd_define_glyph(), with c as its
+    fallback. */
+typedef struct LCD_CELL {
+    int row;
+    int col;
+    unsigned char c;
+    _Bool glyph;
+    int id;
+    const unsigned char *bitmap;
+} LCD_CELL;
+
+/** Write n cells, anywhere on the screen, as one update. Like the
+    rows of lcd_write_string_at(), they go as a single request, so
+    another thread's writes can't come between them, and they're sent
+    with one flush unless output is deferred. Cells that are out of
+    range are skipped; a glyph's bitmap is still defined. */
+void lcd_write_cells(LCD *self, const LCD_CELL *cells, int n);
+
 /** Set the cursor position. The cursor must have been set visible for
     this method to show any effect. Note that the HD44780 LCD module does
     not have a specific method to set the cursor position -- it just follows
-    the text. The method I use is a hack. */
+    the text. So any pending output is flushed first, and the cursor moves
+    again the next time text is sent. */
 void lcd_set_cursor(LCD *self, int row, int col);
 
 #endif
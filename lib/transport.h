@@ -0,0 +1,215 @@
+/*============================================================================
+
+  transport.h
+
+  The "transport" is the thing that carries PCF8574 output states from
+  the LCD "class" to the device. In normal use that's the Linux
+  /dev/i2c-x device, but it's useful to be able to substitute something
+  else -- an in-memory mock that records everything, or a file -- so the
+  LCD code can be exercised and measured on machines that have no
+  I2C bus at all.
+
+  A transport represents a whole bus, not a single device, so every
+  operation takes the I2C address of the device it is aimed at. Several
+  LCD objects can share one transport if they are on the same bus.
+
+  Each implementation is a struct whose first member is an LCD_TRANSPORT,
+  so a pointer to the implementation can be used as a pointer to the
+  generic transport.
+
+  Distributed under the terms of the GNU Public Licence, v3.0
+
+  ==========================================================================*/
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+typedef struct LCD_TRANSPORT LCD_TRANSPORT;
+
+// Defined in hd44780_emu.h
+struct HD44780_EMU;
+
+/** One message of a combined transaction -- see the transfer operation,
+    below. */
+typedef struct LCD_TRANSPORT_MSG {
+    int addr;
+    _Bool read; // Read into buf, rather than writing it
+    unsigned char *buf;
+    int len;
+} LCD_TRANSPORT_MSG;
+
+/** The operations that a transport implements. Only write and delay are
+    mandatory; read may be NULL if the transport can't read from the
+    device, and close may be NULL if there is nothing to clean up. */
+typedef struct LCD_TRANSPORT_OPS {
+    /** A short name for the transport, for diagnostic messages. */
+    const char *name;
+    /** Write len bytes to the device at addr, as one operation.
+        Returns 0 if the write failed. */
+    _Bool (*write)(LCD_TRANSPORT *self,
+                   int addr,
+                   const unsigned char *buf,
+                   int len);
+    /** Read len bytes from the device at addr. Returns 0 if the read
+        failed. */
+    _Bool (*read)(LCD_TRANSPORT *self, int addr, unsigned char *buf, int len);
+    /** Wait for (at least) the specified number of nanoseconds. Transports
+        that don't drive real hardware can just advance a virtual clock. */
+    void (*delay)(LCD_TRANSPORT *self, long ns);
+    /** Release whatever the transport holds open. The transport object
+        itself is freed by lcd_transport_destroy(). */
+    void (*close)(LCD_TRANSPORT *self);
+    /** The current time in nanoseconds, on the clock that delay() runs
+        on. May be NULL, in which case CLOCK_MONOTONIC is used. */
+    long long (*now)(LCD_TRANSPORT *self);
+    /** Carry out n messages, to any mixture of addresses, as one
+        transaction -- with repeated starts between the messages, and a
+        single system call. May be NULL, in which case the messages are
+        sent one at a time with write and read. Returns 0 if any message
+        failed; later messages may not have been attempted. */
+    _Bool (*transfer)(LCD_TRANSPORT *self, LCD_TRANSPORT_MSG *msgs, int n);
+} LCD_TRANSPORT_OPS;
+
+struct LCD_TRANSPORT {
+    const LCD_TRANSPORT_OPS *ops;
+};
+
+// The file written by lcd_transport_trace_create() starts with this
+//  string, including its terminating zero, and goes on with one record
+//  after another. Each record is a type byte, and the time since the
+//  start of the previous record (or, for the first, since the trace
+//  was created) in nanoseconds, as an unsigned LEB128 number. That's
+//  all there is to a mark; writes and reads go on with the time the
+//  operation took, as LEB128, the address, as a byte, the number of
+//  bytes, as LEB128, and the bytes themselves
+#define LCD_TRACE_MAGIC "lcdtrace-1"
+#define LCD_TRACE_WRITE 'W'
+#define LCD_TRACE_READ 'R'
+#define LCD_TRACE_MARK 'M'
+
+/** One byte recorded by the mock transport. The timestamp is the time on
+    the mock's virtual clock at which the PCF8574 would have latched the
+    byte onto its outputs. */
+typedef struct LCD_MOCK_RECORD {
+    long long t_ns;
+    int addr;
+    unsigned char byte;
+} LCD_MOCK_RECORD;
+
+/** Create a transport that writes to a /dev/i2c-x device using plain
+    write() calls, after selecting the slave address with ioctl(I2C_SLAVE).
+    Returns NULL if the device can't be opened and, if error is not NULL,
+    writes an error message that the caller should free. */
+LCD_TRANSPORT *lcd_transport_i2c_create(const char *dev, char **error);
+
+/** Create a transport that talks to a /dev/i2c-x device using the
+    I2C_RDWR ioctl, which carries the slave address in each message. Error
+    handling is as for lcd_transport_i2c_create(). */
+LCD_TRANSPORT *lcd_transport_i2c_rdwr_create(const char *dev, char **error);
+
+/** Create a transport for a /dev/i2c-x device, using I2C_RDWR if the
+    adapter supports plain I2C transactions (most do), and write() and
+    read() otherwise -- for example, on an adapter that only supports
+    SMBus. Error handling is as for lcd_transport_i2c_create(). */
+LCD_TRANSPORT *lcd_transport_i2c_auto_create(const char *dev, char **error);
+
+/** Create an in-memory transport that records every byte written, with a
+    timestamp on a virtual clock. Nothing ever sleeps -- delays and the
+    time taken to clock bytes onto the (imaginary) bus just advance the
+    clock. This method always succeeds. */
+LCD_TRANSPORT *lcd_transport_mock_create(void);
+
+/** Create a transport that writes each byte to a file, as a line of text
+    giving the time (on a virtual clock, as for the mock), the address,
+    and the byte value. This is useful for comparing the output of
+    different versions of the library. Error handling is as for
+    lcd_transport_i2c_create(). */
+LCD_TRANSPORT *lcd_transport_file_create(const char *path, char **error);
+
+/** Create a transport that passes every operation on to inner, and
+    records each write and read in a compact binary trace file at path,
+    with the time it started and the time it took, on inner's clock.
+    This captures the exact byte stream that a workload sends -- to the
+    mock, or to a real bus -- so that it can be replayed, decoded and
+    compared with another version's by bench/lcd_trace.c. inner is not
+    owned by the trace; destroy it after the trace. Error handling is as
+    for lcd_transport_i2c_create(). */
+LCD_TRANSPORT *lcd_transport_trace_create(LCD_TRANSPORT *inner,
+                                          const char *path,
+                                          char **error);
+
+/** Add a marker to a trace, to divide it into frames. Does nothing if
+    self is not a trace transport. */
+void lcd_transport_trace_mark(LCD_TRANSPORT *self);
+
+/** Close and free the transport. */
+void lcd_transport_destroy(LCD_TRANSPORT *self);
+
+/** Helpers that invoke the transport's operations. lcd_transport_read()
+    fails if the transport can't read. */
+_Bool lcd_transport_write(LCD_TRANSPORT *self,
+                          int addr,
+                          const unsigned char *buf,
+                          int len);
+_Bool lcd_transport_read(LCD_TRANSPORT *self,
+                         int addr,
+                         unsigned char *buf,
+                         int len);
+void lcd_transport_delay(LCD_TRANSPORT *self, long ns);
+
+/** Carry out n messages as one transaction if the transport can, or one
+    at a time if it can't. */
+_Bool lcd_transport_transfer(LCD_TRANSPORT *self,
+                             LCD_TRANSPORT_MSG *msgs,
+                             int n);
+
+/** Get the current time in nanoseconds, on the transport's clock. For
+    transports that drive real hardware, this is CLOCK_MONOTONIC; the mock
+    and file transports have a virtual clock. */
+long long lcd_transport_now(LCD_TRANSPORT *self);
+
+/** Returns 1 if the transport is able to read from the device. */
+_Bool lcd_transport_can_read(LCD_TRANSPORT *self);
+
+/** Set the I2C clock rate that the mock and file transports assume when
+    working out how long each byte takes on the bus. The default is
+    100kHz, which is the fastest the PCF8574 supports. */
+void lcd_transport_mock_set_bus_hz(LCD_TRANSPORT *self, long hz);
+
+/** Get the array of bytes recorded by the mock transport, and its size. */
+const LCD_MOCK_RECORD *lcd_transport_mock_records(LCD_TRANSPORT *self,
+                                                  int *count);
+
+/** Attach a model of an HD44780 (see hd44780_emu.h) to an address on the
+    mock transport. Every byte written to that address is fed to the
+    model, and reads return the state of the model's pins. Pass NULL to
+    detach. The model is not owned by the transport. */
+void lcd_transport_mock_attach(LCD_TRANSPORT *self,
+                               int addr,
+                               struct HD44780_EMU *emu);
+
+/** Attach a second model to an address, for a 40x4 display, whose two
+    controllers share the PCF8574 but have their E pins on different
+    outputs (see hd44780_emu_set_pins()). Every byte written is fed to
+    both models, and reads see the data lines as both models drive
+    them, so a line reads low if either model pulls it low. Pass NULL
+    to detach. */
+void lcd_transport_mock_attach_second(LCD_TRANSPORT *self,
+                                      int addr,
+                                      struct HD44780_EMU *emu);
+
+/** Get the number of write operations the mock transport has handled. */
+long lcd_transport_mock_writes(LCD_TRANSPORT *self);
+
+/** Get the number of operations the mock transport has handled that
+    would each have been a system call on a real bus: writes, reads, and
+    delays of more than zero. */
+long lcd_transport_mock_calls(LCD_TRANSPORT *self);
+
+/** Get the current time on the mock transport's virtual clock. */
+long long lcd_transport_mock_now(LCD_TRANSPORT *self);
+
+/** Discard the mock's recorded bytes and reset its counters. The virtual
+    clock is not reset. */
+void lcd_transport_mock_reset(LCD_TRANSPORT *self);
+
+#endif
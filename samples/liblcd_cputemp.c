@@ -1,26 +1,50 @@
 /*============================================================================
 
-    main.c
+    liblcd_cputemp.c
 
-    A test driver for the LCD "class". It just displays the current
-    time and date on the LCD.
+    A test driver for the LCD widgets. It shows the CPU temperature on
+    a 16x2 display, in big digits, with a bar graph of it alongside.
+    The reading is taken ten times a second; since the widgets only
+    redraw what changes, most updates send nothing at all.
 
     Copyright (c)2020 Kevin Boone, GPL v3.0
 
 ============================================================================*/
-//#include "../lib/liblcd.h"
+#include "../lib/lcd_widget.h"
+#include "../lib/liblcd.h"
 #include <errno.h>
-#include <liblcd/liblcd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 #include <unistd.h>
 
 #define I2C_ADDR 0x27
 #define ROWS 2
 #define COLS 16
 
+// The temperature of the first thermal zone, in thousandths of a degree
+#define TEMP_FILE "/sys/class/thermal/thermal_zone0/temp"
+// The temperature at which the bar graph is full
+#define TEMP_MAX 100
+
+/*============================================================================
+
+  read_temp
+
+  Returns the temperature in tenths of a degree, or -1 if it can't be
+  read.
+
+============================================================================*/
+static int read_temp(void) {
+    FILE *f = fopen(TEMP_FILE, "r");
+    if (!f)
+        return -1;
+    long t;
+    int n = fscanf(f, "%ld", &t);
+    fclose(f);
+    return n == 1 && t >= 0 ? (int)(t / 100) : -1;
+}
+
 /*============================================================================
 
   main
@@ -30,40 +54,38 @@ int main(int argc, char **argv) {
     argc = argc;
     argv = argv; // Suppress warnings
 
-    setenv("TZ", "MST7MDT", 1);
-    tzset();
-
-    // Set up the LCD instance with the three GPIO pin numbers.
-    LCD *hc = lcd8574_create(I2C_ADDR, ROWS, COLS);
+    LCD *hc = lcd_create(I2C_ADDR, ROWS, COLS);
     char *error = NULL;
 
     char *dev = "/dev/i2c-1";
-    if (lcd8574_init(hc, &error)) {
-        // Note that because the text we're writing is a fixed length,
-        //  there's no need to clear the display before refreshing it --
-        //  we just write the old text on top of the new. This causes
-        //  less flicker than a full refresh.
-        lcd8574_clear(hc);
+    if (lcd_init(dev, hc, &error)) {
+        lcd_clear(hc);
+        // Everything for one reading goes out in one update
+        lcd_set_deferred(hc, 1);
+
+        // Three big digits take up eleven columns; then a degree sign, and
+        //  a vertical bar in the last column
+        LCD_BIGNUM *digits = lcd_bignum_create(hc, 0, 0, 2, 3);
+        LCD_BAR *bar = lcd_bar_create(hc, 1, COLS - 1, 2, 1, TEMP_MAX * 10);
+        lcd_write_char_at(hc, 0, 12, 0xDF);
+        lcd_write_char_at(hc, 0, 13, 'C');
         while (1) {
-            // Write the whole output. In a real appliation, we'd only write
-            //  the character cells that had changed between updates, to
-            //  save time and reduce flicker
-            char s[50];
-            time_t t = time(NULL);
-            struct tm *tm = localtime(&t);
-            sprintf(s, "%02d:%02d:%02d", tm->tm_hour, tm->tm_min, tm->tm_sec);
-            lcd8574_write_string_at(hc, 0, 0, (unsigned char *)s, 0);
-            sprintf(s,
-                    "%04d/%02d/%02d",
-                    tm->tm_year + 1900,
-                    tm->tm_mon + 1,
-                    tm->tm_mday);
-            lcd8574_write_string_at(hc, 1, 0, (unsigned char *)s, 0);
-            usleep(1000000);
+            int t = read_temp();
+            char s[10];
+            if (t >= 0)
+                snprintf(s, sizeof(s), "%3d", t / 10);
+            else
+                strcpy(s, "---");
+            lcd_bignum_set(digits, s);
+            lcd_bar_set(bar, t);
+            lcd_flush(hc);
+            usleep(100000);
         }
 
-        lcd8574_uninit(hc);
-        lcd8574_destroy(hc);
+        lcd_bar_destroy(bar);
+        lcd_bignum_destroy(digits);
+        lcd_terminate(hc);
+        lcd_destroy(hc);
     } else {
         fprintf(stderr, "%s: %s\n", argv[0], error);
         free(error);
@@ -8,6 +8,7 @@
     Copyright (c)2020 Kevin Boone, GPL v3.0
 
 ============================================================================*/
+#include "../lib/lcd_layout.h"
 #include "../lib/liblcd.h"
 #include <errno.h>
 //#include <liblcd/liblcd.h>
@@ -39,29 +40,31 @@ int main(int argc, char **argv) {
 
     char *dev = "/dev/i2c-1";
     if (lcd_init(dev, hc, &error)) {
-        // Note that because the text we're writing is a fixed length,
-        //  there's no need to clear the display before refreshing it --
-        //  we just write the old text on top of the new. This causes
-        //  less flicker than a full refresh.
         lcd_clear(hc);
+        // Describe the screen once. Then, on each tick, the layout works
+        //  out which characters have changed -- usually just one or two
+        //  of the seconds digits -- and only those are sent
+        LCD_LAYOUT *layout = lcd_layout_create(hc);
+        int clock = lcd_layout_time(layout, 0, 0, LCD_LAYOUT_HMS);
+        int year = lcd_layout_int(layout, 1, 0, 4, LCD_LAYOUT_ZERO);
+        lcd_layout_label(layout, 1, 4, "/");
+        int month = lcd_layout_int(layout, 1, 5, 2, LCD_LAYOUT_ZERO);
+        lcd_layout_label(layout, 1, 7, "/");
+        int day = lcd_layout_int(layout, 1, 8, 2, LCD_LAYOUT_ZERO);
         while (1) {
-            // Write the whole output. In a real appliation, we'd only write
-            //  the character cells that had changed between updates, to
-            //  save time and reduce flicker
-            char s[50];
             time_t t = time(NULL);
             struct tm *tm = localtime(&t);
-            sprintf(s, "%02d:%02d:%02d", tm->tm_hour, tm->tm_min, tm->tm_sec);
-            lcd_write_string_at(hc, 0, 0, (unsigned char *)s, 0);
-            sprintf(s,
-                    "%04d/%02d/%02d",
-                    tm->tm_year + 1900,
-                    tm->tm_mon + 1,
-                    tm->tm_mday);
-            lcd_write_string_at(hc, 1, 0, (unsigned char *)s, 0);
+            lcd_layout_set_int(layout,
+                               clock,
+                               tm->tm_hour * 3600 + tm->tm_min * 60 +
+                                   tm->tm_sec);
+            lcd_layout_set_int(layout, year, tm->tm_year + 1900);
+            lcd_layout_set_int(layout, month, tm->tm_mon + 1);
+            lcd_layout_set_int(layout, day, tm->tm_mday);
             usleep(1000000);
         }
 
+        lcd_layout_destroy(layout);
         lcd_terminate(hc);
         lcd_destroy(hc);
     } else {
@@ -0,0 +1,30 @@
+/*==========================================================================
+
+    err_msg.c
+
+    Implementation of the error-message helper specified in err_msg.h.
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/err_msg.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*============================================================================
+  err_msg
+============================================================================*/
+void err_msg(const char *what, const char *name, int err, char **error) {
+    if (error) {
+        const char *sep = name ? " " : "";
+        if (!name)
+            name = "";
+        size_t error_size =
+            snprintf(NULL, 0, "%s%s%s: %s", what, sep, name, strerror(err)) +
+            1;
+        *error = (char *)malloc(error_size);
+        snprintf(
+            *error, error_size, "%s%s%s: %s", what, sep, name, strerror(err));
+    }
+}
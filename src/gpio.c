@@ -2,21 +2,29 @@
 
     gpio.c
 
-    A "class" for setting values of specific GPIO pins.
+    "Classes" for setting values of GPIO pins -- GPIO, which uses sysfs,
+    and GPIO_LINES, which uses the gpiochip character device, or a mock.
 
     Copyright (c)2020 Kevin Boone, GPL v3.0
 
 ============================================================================*/
 #include "../lib/gpio.h"
+#include "../lib/err_msg.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/gpio.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
 #include <unistd.h>
 
+// The time the mock's clock advances for each operation, by default
+#define GPIO_MOCK_OP_NS 1000
+
 /*============================================================================
   gpio_create
 ============================================================================*/
@@ -134,3 +142,378 @@ void gpio_set(GPIO *self, _Bool val) {
     char c = val ? '1' : '0';
     write(self->value_fd, &c, 1);
 }
+
+/*============================================================================
+  gpio_lines_mask
+
+  The mask with a bit set for each line in a set of count lines.
+============================================================================*/
+static unsigned long long gpio_lines_mask(int count) {
+    return count >= 64 ? ~0ULL : (1ULL << count) - 1;
+}
+
+/*============================================================================
+
+  The character device implementation
+
+============================================================================*/
+typedef struct GPIO_CHIP_LINES {
+    GPIO_LINES base;
+    int fd; // The line request, from GPIO_V2_GET_LINE_IOCTL
+} GPIO_CHIP_LINES;
+
+/*============================================================================
+  chip_set
+============================================================================*/
+static _Bool chip_set(GPIO_LINES *base,
+                      unsigned long long mask,
+                      unsigned long long values) {
+    GPIO_CHIP_LINES *self = (GPIO_CHIP_LINES *)base;
+    struct gpio_v2_line_values v;
+    v.mask = mask;
+    v.bits = values;
+    return ioctl(self->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v) >= 0;
+}
+
+/*============================================================================
+  chip_get
+============================================================================*/
+static _Bool chip_get(GPIO_LINES *base,
+                      unsigned long long mask,
+                      unsigned long long *values) {
+    GPIO_CHIP_LINES *self = (GPIO_CHIP_LINES *)base;
+    struct gpio_v2_line_values v;
+    v.mask = mask;
+    v.bits = 0;
+    if (ioctl(self->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0)
+        return 0;
+    *values = v.bits & mask;
+    return 1;
+}
+
+/*============================================================================
+
+  chip_delay
+
+  The waits needed by the devices on GPIO lines are usually a few
+  microseconds at most, and the scheduler can't be relied on to wake us
+  that promptly, so short waits are made by spinning on the clock.
+
+============================================================================*/
+static void chip_delay(GPIO_LINES *base, long ns) {
+    (void)base;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long deadline = ts.tv_sec * 1000000000LL + ts.tv_nsec + ns;
+    if (ns > 100000) {
+        struct timespec t;
+        t.tv_sec = (deadline - 50000) / 1000000000LL;
+        t.tv_nsec = (deadline - 50000) % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) ==
+               EINTR)
+            ;
+    }
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    } while (ts.tv_sec * 1000000000LL + ts.tv_nsec < deadline);
+}
+
+/*============================================================================
+  chip_now
+============================================================================*/
+static long long chip_now(GPIO_LINES *base) {
+    (void)base;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*============================================================================
+  chip_close
+============================================================================*/
+static void chip_close(GPIO_LINES *base) {
+    GPIO_CHIP_LINES *self = (GPIO_CHIP_LINES *)base;
+    if (self->fd >= 0)
+        close(self->fd);
+    self->fd = -1;
+}
+
+static const GPIO_LINES_OPS chip_ops = {
+    "gpiochip", chip_set, chip_get, chip_delay, chip_now, chip_close};
+
+/*============================================================================
+  gpio_lines_open
+============================================================================*/
+GPIO_LINES *gpio_lines_open(const char *chip,
+                            const unsigned int *offsets,
+                            int count,
+                            const char *consumer,
+                            char **error) {
+    assert(chip != NULL);
+    assert(offsets != NULL);
+    assert(count > 0 && count <= GPIO_LINES_MAX);
+    int chip_fd = open(chip, O_RDWR | O_CLOEXEC);
+    if (chip_fd < 0) {
+        err_msg("Can't open", chip, errno, error);
+        return NULL;
+    }
+
+    // All the lines are outputs, and start low
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    for (int i = 0; i < count; i++)
+        req.offsets[i] = offsets[i];
+    req.num_lines = count;
+    snprintf(req.consumer, sizeof(req.consumer), "%s", consumer);
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = 0;
+    req.config.attrs[0].mask = gpio_lines_mask(count);
+    int ret = ioctl(chip_fd, GPIO_V2_GET_LINE_IOCTL, &req);
+    if (ret < 0)
+        err_msg("Can't request lines from", chip, errno, error);
+    // The line request has its own file descriptor, which stays open
+    //  after the chip is closed
+    close(chip_fd);
+    if (ret < 0)
+        return NULL;
+
+    GPIO_CHIP_LINES *self = malloc(sizeof(GPIO_CHIP_LINES));
+    memset(self, 0, sizeof(GPIO_CHIP_LINES));
+    self->base.ops = &chip_ops;
+    self->base.count = count;
+    self->fd = req.fd;
+    return &self->base;
+}
+
+/*============================================================================
+
+  The mock implementation
+
+  Every change is appended to an array of records, with the time on a
+  virtual clock. Each operation advances the clock by op_ns, which
+  stands for the cost of the ioctl().
+
+============================================================================*/
+typedef struct GPIO_MOCK_LINES {
+    GPIO_LINES base;
+    long op_ns;
+    long long now_ns;
+    GPIO_MOCK_RECORD *records;
+    int count;
+    int size;
+    long calls;
+    unsigned long long inputs; // Lines that read back input_values
+    unsigned long long input_values;
+    void (*watch)(void *arg, long long t_ns, unsigned long long values);
+    void *watch_arg;
+} GPIO_MOCK_LINES;
+
+/*============================================================================
+  mock_set
+============================================================================*/
+static _Bool mock_set(GPIO_LINES *base,
+                      unsigned long long mask,
+                      unsigned long long values) {
+    GPIO_MOCK_LINES *self = (GPIO_MOCK_LINES *)base;
+    // The lines change at the end of the ioctl()
+    self->now_ns += self->op_ns;
+    self->calls++;
+    unsigned long long v = (base->values & ~mask) | (values & mask);
+    if (self->count == self->size) {
+        self->size = self->size ? self->size * 2 : 1024;
+        self->records =
+            realloc(self->records, self->size * sizeof(GPIO_MOCK_RECORD));
+    }
+    self->records[self->count].t_ns = self->now_ns;
+    self->records[self->count].values = v;
+    self->count++;
+    if (self->watch)
+        self->watch(self->watch_arg, self->now_ns, v);
+    return 1;
+}
+
+/*============================================================================
+  mock_get
+============================================================================*/
+static _Bool mock_get(GPIO_LINES *base,
+                      unsigned long long mask,
+                      unsigned long long *values) {
+    GPIO_MOCK_LINES *self = (GPIO_MOCK_LINES *)base;
+    self->now_ns += self->op_ns;
+    self->calls++;
+    unsigned long long v = (base->values & ~self->inputs) |
+                           (self->input_values & self->inputs);
+    *values = v & mask;
+    return 1;
+}
+
+/*============================================================================
+  mock_delay
+============================================================================*/
+static void mock_delay(GPIO_LINES *base, long ns) {
+    GPIO_MOCK_LINES *self = (GPIO_MOCK_LINES *)base;
+    if (ns > 0)
+        self->now_ns += ns;
+}
+
+/*============================================================================
+  mock_now
+============================================================================*/
+static long long mock_now(GPIO_LINES *base) {
+    return ((GPIO_MOCK_LINES *)base)->now_ns;
+}
+
+/*============================================================================
+  mock_close
+============================================================================*/
+static void mock_close(GPIO_LINES *base) {
+    GPIO_MOCK_LINES *self = (GPIO_MOCK_LINES *)base;
+    free(self->records);
+    self->records = NULL;
+    self->count = self->size = 0;
+}
+
+static const GPIO_LINES_OPS mock_ops = {
+    "mock", mock_set, mock_get, mock_delay, mock_now, mock_close};
+
+/*============================================================================
+  gpio_lines_mock_create
+============================================================================*/
+GPIO_LINES *gpio_lines_mock_create(int count) {
+    assert(count > 0 && count <= GPIO_LINES_MAX);
+    GPIO_MOCK_LINES *self = malloc(sizeof(GPIO_MOCK_LINES));
+    memset(self, 0, sizeof(GPIO_MOCK_LINES));
+    self->base.ops = &mock_ops;
+    self->base.count = count;
+    self->op_ns = GPIO_MOCK_OP_NS;
+    return &self->base;
+}
+
+/*============================================================================
+  gpio_lines_mock_set_op_ns
+============================================================================*/
+void gpio_lines_mock_set_op_ns(GPIO_LINES *base, long ns) {
+    assert(base->ops == &mock_ops);
+    ((GPIO_MOCK_LINES *)base)->op_ns = ns;
+}
+
+/*============================================================================
+  gpio_lines_mock_records
+============================================================================*/
+const GPIO_MOCK_RECORD *gpio_lines_mock_records(GPIO_LINES *base,
+                                                int *count) {
+    assert(base->ops == &mock_ops);
+    GPIO_MOCK_LINES *self = (GPIO_MOCK_LINES *)base;
+    *count = self->count;
+    return self->records;
+}
+
+/*============================================================================
+  gpio_lines_mock_calls
+============================================================================*/
+long gpio_lines_mock_calls(GPIO_LINES *base) {
+    assert(base->ops == &mock_ops);
+    return ((GPIO_MOCK_LINES *)base)->calls;
+}
+
+/*============================================================================
+  gpio_lines_mock_watch
+============================================================================*/
+void gpio_lines_mock_watch(GPIO_LINES *base,
+                           void (*watch)(void *arg,
+                                         long long t_ns,
+                                         unsigned long long values),
+                           void *arg) {
+    assert(base->ops == &mock_ops);
+    GPIO_MOCK_LINES *self = (GPIO_MOCK_LINES *)base;
+    self->watch = watch;
+    self->watch_arg = arg;
+}
+
+/*============================================================================
+  gpio_lines_mock_set_inputs
+============================================================================*/
+void gpio_lines_mock_set_inputs(GPIO_LINES *base,
+                                unsigned long long mask,
+                                unsigned long long values) {
+    assert(base->ops == &mock_ops);
+    GPIO_MOCK_LINES *self = (GPIO_MOCK_LINES *)base;
+    self->inputs = mask;
+    self->input_values = values;
+}
+
+/*============================================================================
+  gpio_lines_mock_reset
+============================================================================*/
+void gpio_lines_mock_reset(GPIO_LINES *base) {
+    assert(base->ops == &mock_ops);
+    GPIO_MOCK_LINES *self = (GPIO_MOCK_LINES *)base;
+    self->count = 0;
+    self->calls = 0;
+}
+
+/*============================================================================
+
+  Generic functions
+
+============================================================================*/
+
+/*============================================================================
+  gpio_lines_destroy
+============================================================================*/
+void gpio_lines_destroy(GPIO_LINES *self) {
+    if (self) {
+        if (self->ops->close)
+            self->ops->close(self);
+        free(self);
+    }
+}
+
+/*============================================================================
+  gpio_lines_set
+============================================================================*/
+_Bool gpio_lines_set(GPIO_LINES *self,
+                     unsigned long long mask,
+                     unsigned long long values,
+                     _Bool *written) {
+    assert(self != NULL);
+    mask &= gpio_lines_mask(self->count);
+    _Bool change = ((self->values ^ values) & mask) != 0;
+    if (written)
+        *written = change;
+    if (!change)
+        return 1;
+    if (!self->ops->set(self, mask, values))
+        return 0;
+    self->values = (self->values & ~mask) | (values & mask);
+    return 1;
+}
+
+/*============================================================================
+  gpio_lines_get
+============================================================================*/
+_Bool gpio_lines_get(GPIO_LINES *self,
+                     unsigned long long mask,
+                     unsigned long long *values) {
+    assert(self != NULL);
+    assert(values != NULL);
+    return self->ops->get(self, mask & gpio_lines_mask(self->count), values);
+}
+
+/*============================================================================
+  gpio_lines_delay
+============================================================================*/
+void gpio_lines_delay(GPIO_LINES *self, long ns) {
+    assert(self != NULL);
+    self->ops->delay(self, ns);
+}
+
+/*============================================================================
+  gpio_lines_now
+============================================================================*/
+long long gpio_lines_now(GPIO_LINES *self) {
+    assert(self != NULL);
+    return self->ops->now(self);
+}
@@ -0,0 +1,429 @@
+/*==========================================================================
+
+    hd44780_emu.c
+
+    Implementation of the HD44780 model that is specified in
+    hd44780_emu.h. The behaviour and the timings come from the
+    HD44780 datasheet:
+    https://www.sparkfun.com/datasheets/LCD/HD44780.pdf
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/hd44780_emu.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The oscillator frequency for which the datasheet gives execution times
+#define EMU_FOSC_HZ 270000
+
+// Execution times, at 270kHz
+#define EMU_EXEC_NS 37000L
+#define EMU_CLEAR_NS 1520000L
+// tADD -- the address counter is updated this long after a data
+//  read or write finishes
+#define EMU_ADD_NS 4000L
+// Waits required during initialization by instruction (datasheet
+//  figure 24). These don't scale with the oscillator.
+#define EMU_RESET1_NS 4100000L
+#define EMU_RESET2_NS 100000L
+
+// Bus timing, for the worst case (low supply voltage) in the datasheet
+// Enable pulse width (high level)
+#define EMU_PW_EH_NS 450
+// Enable cycle time
+#define EMU_T_CYCE_NS 1000
+
+/*============================================================================
+  emu_bit
+============================================================================*/
+static _Bool emu_bit(unsigned int b, int bit) {
+    return bit >= 0 && (b & (1 << bit)) != 0;
+}
+
+/*============================================================================
+
+  emu_violation
+
+  Record the description of a timing violation. The counter is
+  incremented by the caller.
+
+============================================================================*/
+static void
+emu_violation(HD44780_EMU *self, long long t_ns, const char *what) {
+    snprintf(self->last_violation,
+             sizeof(self->last_violation),
+             "%s at %lld ns",
+             what,
+             t_ns);
+}
+
+/*============================================================================
+  emu_scale
+
+  Scale an execution time from the datasheet to the oscillator frequency
+============================================================================*/
+static long long emu_scale(HD44780_EMU *self, long ns) {
+    return (long long)ns * EMU_FOSC_HZ / self->fosc_hz;
+}
+
+/*============================================================================
+  emu_busy
+============================================================================*/
+static _Bool emu_busy(HD44780_EMU *self, long long t_ns) {
+    return t_ns < self->busy_until_ns;
+}
+
+/*============================================================================
+
+  emu_move_ac
+
+  Move the address counter one place in the direction given, wrapping
+  the way the controller does. In two-line mode, the end of the first
+  line (0x27) runs on to the start of the second (0x40), and the end of
+  the second runs back to the start of the first.
+
+============================================================================*/
+static void emu_move_ac(HD44780_EMU *self, int dir) {
+    if (self->ac_cgram) {
+        self->ac = (self->ac + dir) & (HD44780_CGRAM_SIZE - 1);
+    } else if (self->two_line) {
+        int line = self->ac & 0x40;
+        int pos = (self->ac & 0x3F) + dir;
+        if (pos >= HD44780_LINE_LEN) {
+            pos = 0;
+            line ^= 0x40;
+        } else if (pos < 0) {
+            pos = HD44780_LINE_LEN - 1;
+            line ^= 0x40;
+        }
+        self->ac = line | pos;
+    } else {
+        int len = 2 * HD44780_LINE_LEN;
+        self->ac = (self->ac + dir + len) % len;
+    }
+}
+
+/*============================================================================
+
+  emu_shift_display
+
+  Shift the display one place. A shift to the left moves the text left,
+  so that a higher DDRAM address appears at the left edge.
+
+============================================================================*/
+static void emu_shift_display(HD44780_EMU *self, int dir) {
+    int len = self->two_line ? HD44780_LINE_LEN : 2 * HD44780_LINE_LEN;
+    self->shift = (self->shift + dir + len) % len;
+}
+
+/*============================================================================
+
+  emu_instruction
+
+  Execute an instruction (RS low), and work out how long it keeps
+  the controller busy.
+
+============================================================================*/
+static long long emu_instruction(HD44780_EMU *self, unsigned char v) {
+    long ns = EMU_EXEC_NS;
+    self->instructions++;
+    if (v & 0x80) {
+        // Set DDRAM address
+        self->ac = v & 0x7F;
+        self->ac_cgram = 0;
+    } else if (v & 0x40) {
+        // Set CGRAM address
+        self->ac = v & 0x3F;
+        self->ac_cgram = 1;
+    } else if (v & 0x20) {
+        // Function set
+        _Bool was_eight = self->eight_bit;
+        self->eight_bit = (v & 0x10) != 0;
+        self->two_line = (v & 0x08) != 0;
+        if (was_eight && self->resets < 2) {
+            // Initialization by instruction: the first two function
+            //  sets after power-on need longer waits
+            long long wait = self->resets == 0 ? EMU_RESET1_NS : EMU_RESET2_NS;
+            self->resets++;
+            return wait;
+        }
+    } else if (v & 0x10) {
+        // Cursor or display shift
+        int dir = (v & 0x04) ? 1 : -1;
+        if (v & 0x08)
+            emu_shift_display(self, -dir);
+        else
+            emu_move_ac(self, dir);
+    } else if (v & 0x08) {
+        // Display on/off control
+        self->display_on = (v & 0x04) != 0;
+        self->cursor_on = (v & 0x02) != 0;
+        self->blink_on = (v & 0x01) != 0;
+    } else if (v & 0x04) {
+        // Entry mode set
+        self->entry_inc = (v & 0x02) != 0;
+        self->entry_shift = (v & 0x01) != 0;
+    } else if (v & 0x02) {
+        // Return home
+        self->ac = 0;
+        self->ac_cgram = 0;
+        self->shift = 0;
+        ns = EMU_CLEAR_NS;
+    } else if (v & 0x01) {
+        // Clear display
+        memset(self->ddram, ' ', sizeof(self->ddram));
+        self->ac = 0;
+        self->ac_cgram = 0;
+        self->shift = 0;
+        self->entry_inc = 1;
+        ns = EMU_CLEAR_NS;
+    }
+    return emu_scale(self, ns);
+}
+
+/*============================================================================
+  emu_data_write
+============================================================================*/
+static long long emu_data_write(HD44780_EMU *self, unsigned char v) {
+    if (self->ac_cgram)
+        self->cgram[self->ac] = v & 0x1F;
+    else
+        self->ddram[self->ac & (HD44780_DDRAM_SIZE - 1)] = v;
+    emu_move_ac(self, self->entry_inc ? 1 : -1);
+    if (self->entry_shift && !self->ac_cgram)
+        emu_shift_display(self, self->entry_inc ? 1 : -1);
+    self->data_writes++;
+    return emu_scale(self, EMU_EXEC_NS + EMU_ADD_NS);
+}
+
+/*============================================================================
+
+  emu_write_nibble
+
+  Handle the falling edge of E with RW low. In 8-bit mode, the low four
+  bits of the byte come from D0-D3, which read as zero if they aren't
+  connected -- as they aren't, behind a PCF8574.
+
+============================================================================*/
+static void emu_write_nibble(
+    HD44780_EMU *self, long long t_ns, _Bool rs, int nibble, int low) {
+    if (emu_busy(self, t_ns)) {
+        self->busy_violations++;
+        emu_violation(self, t_ns, "Write while busy");
+    }
+    unsigned char v;
+    if (self->eight_bit) {
+        v = (nibble << 4) | low;
+        self->have_nibble = 0;
+    } else if (!self->have_nibble) {
+        self->high = nibble;
+        self->have_nibble = 1;
+        return;
+    } else {
+        v = (self->high << 4) | nibble;
+        self->have_nibble = 0;
+    }
+    if (self->watch)
+        self->watch(self->watch_arg, t_ns, rs, v);
+    long long ns = rs ? emu_data_write(self, v) : emu_instruction(self, v);
+    self->busy_until_ns = t_ns + ns;
+}
+
+/*============================================================================
+
+  emu_read_value
+
+  The 8-bit value that the controller puts out for a read: the busy flag
+  and address counter for RS low, the data at the address counter for
+  RS high.
+
+============================================================================*/
+static unsigned char
+emu_read_value(HD44780_EMU *self, long long t_ns, _Bool rs) {
+    if (rs) {
+        if (self->ac_cgram)
+            return self->cgram[self->ac];
+        return self->ddram[self->ac & (HD44780_DDRAM_SIZE - 1)];
+    }
+    return (emu_busy(self, t_ns) ? 0x80 : 0) | (self->ac & 0x7F);
+}
+
+/*============================================================================
+
+  emu_read_done
+
+  Handle the falling edge of E with RW high. A data read advances the
+  address counter once the whole byte has been read.
+
+============================================================================*/
+static void emu_read_done(HD44780_EMU *self, long long t_ns, _Bool rs) {
+    _Bool complete = self->eight_bit || self->read_low;
+    if (!self->eight_bit)
+        self->read_low = !self->read_low;
+    if (complete && rs) {
+        if (emu_busy(self, t_ns)) {
+            self->busy_violations++;
+            emu_violation(self, t_ns, "Data read while busy");
+        }
+        emu_move_ac(self, self->entry_inc ? 1 : -1);
+        self->busy_until_ns = t_ns + emu_scale(self, EMU_EXEC_NS + EMU_ADD_NS);
+    }
+}
+
+/*============================================================================
+  hd44780_emu_create
+============================================================================*/
+HD44780_EMU *hd44780_emu_create(void) {
+    static const int d[4] = {4, 5, 6, 7};
+    HD44780_EMU *self = malloc(sizeof(HD44780_EMU));
+    memset(self, 0, sizeof(HD44780_EMU));
+    hd44780_emu_set_pins(self, 0, 1, 2, d);
+    for (int i = 0; i < 4; i++)
+        self->pin_d_low[i] = -1;
+    self->fosc_hz = EMU_FOSC_HZ;
+    memset(self->ddram, ' ', sizeof(self->ddram));
+    self->eight_bit = 1;
+    self->entry_inc = 1;
+    self->last_rise_ns = -1;
+    return self;
+}
+
+/*============================================================================
+  hd44780_emu_destroy
+============================================================================*/
+void hd44780_emu_destroy(HD44780_EMU *self) {
+    free(self);
+}
+
+/*============================================================================
+  hd44780_emu_set_pins
+============================================================================*/
+void hd44780_emu_set_pins(
+    HD44780_EMU *self, int rs, int rw, int e, const int d[4]) {
+    assert(self != NULL);
+    self->pin_rs = rs;
+    self->pin_rw = rw;
+    self->pin_e = e;
+    memcpy(self->pin_d, d, sizeof(self->pin_d));
+}
+
+/*============================================================================
+  hd44780_emu_set_pins8
+============================================================================*/
+void hd44780_emu_set_pins8(
+    HD44780_EMU *self, int rs, int rw, int e, const int d[8]) {
+    assert(self != NULL);
+    hd44780_emu_set_pins(self, rs, rw, e, d + 4);
+    memcpy(self->pin_d_low, d, sizeof(self->pin_d_low));
+}
+
+/*============================================================================
+  hd44780_emu_set_fosc
+============================================================================*/
+void hd44780_emu_set_fosc(HD44780_EMU *self, long hz) {
+    assert(hz > 0);
+    self->fosc_hz = hz;
+}
+
+/*============================================================================
+
+  hd44780_emu_latch
+
+  The controller only cares about the edges of E. On the rising edge we
+  check the enable cycle time; on the falling edge we check the pulse
+  width, and then act on the RS, RW and data lines as they were while
+  E was high.
+
+============================================================================*/
+void hd44780_emu_latch(HD44780_EMU *self, long long t_ns, unsigned int b) {
+    assert(self != NULL);
+    unsigned int prev = self->latch;
+    self->latch = b;
+    _Bool e_was = emu_bit(prev, self->pin_e);
+    _Bool e_now = emu_bit(b, self->pin_e);
+
+    if (!e_was && e_now) {
+        if (self->last_rise_ns >= 0 &&
+            t_ns - self->last_rise_ns < EMU_T_CYCE_NS) {
+            self->e_cycle_violations++;
+            emu_violation(self, t_ns, "E cycle too short");
+        }
+        self->e_rise_ns = self->last_rise_ns = t_ns;
+    } else if (e_was && !e_now) {
+        if (t_ns - self->e_rise_ns < EMU_PW_EH_NS) {
+            self->e_pulse_violations++;
+            emu_violation(self, t_ns, "E pulse too short");
+        }
+        _Bool rs = emu_bit(prev, self->pin_rs);
+        if (emu_bit(prev, self->pin_rw)) {
+            emu_read_done(self, t_ns, rs);
+        } else {
+            int nibble = 0, low = 0;
+            for (int i = 0; i < 4; i++) {
+                if (emu_bit(prev, self->pin_d[i]))
+                    nibble |= 1 << i;
+                if (emu_bit(prev, self->pin_d_low[i]))
+                    low |= 1 << i;
+            }
+            emu_write_nibble(self, t_ns, rs, nibble, low);
+        }
+    }
+}
+
+/*============================================================================
+  hd44780_emu_watch
+============================================================================*/
+void hd44780_emu_watch(HD44780_EMU *self,
+                       void (*watch)(void *arg,
+                                     long long t_ns,
+                                     _Bool rs,
+                                     unsigned char v),
+                       void *arg) {
+    assert(self != NULL);
+    self->watch = watch;
+    self->watch_arg = arg;
+}
+
+/*============================================================================
+  hd44780_emu_pins
+============================================================================*/
+unsigned char hd44780_emu_pins(HD44780_EMU *self, long long t_ns) {
+    assert(self != NULL);
+    unsigned char b = (unsigned char)self->latch;
+    if (emu_bit(b, self->pin_e) && emu_bit(b, self->pin_rw)) {
+        unsigned char v = emu_read_value(self, t_ns, emu_bit(b, self->pin_rs));
+        int nibble = (self->eight_bit || !self->read_low) ? v >> 4 : v & 0x0F;
+        for (int i = 0; i < 4; i++)
+            if (!(nibble & (1 << i)) && self->pin_d[i] >= 0)
+                b &= ~(1 << self->pin_d[i]);
+    }
+    return b;
+}
+
+/*============================================================================
+  hd44780_emu_text
+============================================================================*/
+void hd44780_emu_text(
+    const HD44780_EMU *self, int line, int pos, int n, unsigned char *out) {
+    assert(self != NULL);
+    for (int i = 0; i < n; i++) {
+        int addr;
+        if (self->two_line)
+            addr = (line ? 0x40 : 0) +
+                   (pos + i + self->shift) % HD44780_LINE_LEN;
+        else
+            addr = (pos + i + self->shift) % (2 * HD44780_LINE_LEN);
+        out[i] = self->ddram[addr];
+    }
+}
+
+/*============================================================================
+  hd44780_emu_violations
+============================================================================*/
+long hd44780_emu_violations(const HD44780_EMU *self) {
+    return self->e_pulse_violations + self->e_cycle_violations +
+           self->busy_violations;
+}
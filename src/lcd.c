@@ -15,22 +15,26 @@
     Copyright (c)2020 Kevin Boone, GPL v3.0
 
 ============================================================================*/
+#include "../lib/err_msg.h"
 #include "../lib/gpio.h"
 #include "../lib/liblcd.h"
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <linux/i2c-dev.h>
-#include <linux/i2c.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 // Define how the LCD module pins are connected to the PCF8547
-//  outputs 0-7
+//  outputs 0-7, by default. A different wiring can be set at run time
+//  with lcd_set_pins()
 
 // Register select -- pin 4 on the LCD module. 0=command, 1=data
 #define PIN_RS 0
@@ -44,7 +48,7 @@
 #define PIN_E 2
 // Backlight LED anode -- pin 15. The cathode is usually connected to 0V
 //  If the LED is wired permanently on, set this value to -1, so the
-//  code won't bother setting it
+//  code won't bother setting it. Likewise for R/W, if it's tied low
 #define PIN_LED 3
 // Four data pins (pins 11-14). In four-bit mode,
 //  we only use highest four data lines
@@ -54,6 +58,20 @@
 #define PIN_D7 7
 // Pins 7-10 are connected in 4-bit mode
 
+static const LCD_PCF8574_PINS lcd_default_pins = {
+    PIN_RS, PIN_RW, PIN_E, PIN_LED, {PIN_D4, PIN_D5, PIN_D6, PIN_D7}, -1};
+
+// When the module is wired directly to GPIO lines, rather than through a
+//  PCF8574, the lines are requested in this order: RS, E, and then the
+//  data lines -- D4-D7 in 4-bit mode, or D0-D7 in 8-bit mode. R/W is
+//  assumed to be tied low. Each output state is a bit mask of the lines
+#define LCD_GPIO_RS 0
+#define LCD_GPIO_E 1
+#define LCD_GPIO_DATA 2
+
+// The shortest time from one rising edge of E to the next (t_cycE)
+#define LCD_T_CYCE_NS 1000
+
 /// ************* LCD commands ************
 // Clear display
 #define CMD_CLEAR 0x01
@@ -95,34 +113,290 @@
 // Data Length -- set for 4-bit mode
 #define LCD_FUNC_DL 0x10
 
+// Shift the display, rather than moving the cursor
+#define LCD_CDSHIFT_SC 0x08
+// To the right
 #define LCD_CDSHIFT_RL 0x04
 
-// The number of "addresses" occupied by a single row of text on the
-//  display. This will be longer than the number of characters, presumably
-//  so that the same controller can be used for different display sizes.
-// The value of 64 comes from the datasheet
+// The number of "addresses" occupied by a single line of DDRAM. This
+//  will be longer than the number of characters, presumably so that the
+//  same controller can be used for different display sizes. The value
+//  of 64 comes from the datasheet. A display with more than two rows
+//  folds each line of DDRAM into two rows
 #define LCD_CHARS_PER_ROW 64
 
+// The number of characters in a line of DDRAM, in two-line mode. After
+//  the last of them, the address counter jumps to the other line
+#define LCD_LINE_LEN 40
+
+// The cost of moving the DDRAM address, measured in characters. It takes
+//  one instruction, which is the same number of bytes on the wire as
+//  one character.
+#define LCD_JUMP_COST 1
+
+// The longest wait that is made up by repeating an output state on the
+//  bus, rather than ending the write and sleeping. A repeated state is
+//  harmless -- E doesn't change, so the LCD module ignores it -- and a
+//  few of them cost less than a system call and a trip through the
+//  scheduler.
+#define LCD_MAX_PAD_NS 250000
+
+// Set on the output state that completes a byte -- E low after its last
+//  strobe -- which is the only place where the busy flag may be polled.
+//  It's above every PCF8574 output and GPIO line, and is masked off
+//  before a state is sent
+#define LCD_TX_DONE 0x8000
+
+// How long to keep polling the busy flag, as a multiple of the expected
+//  execution time, before deciding that it is never going to clear
+#define LCD_BUSY_TIMEOUT_FACTOR 4
+
+// The first bytes of the state file written for warm attach
+#define LCD_STATE_MAGIC "liblcd-state-1"
+
+// Operations, as queued for the render thread
+#define LCD_OP_WRITE 0
+#define LCD_OP_CLEAR 1
+#define LCD_OP_MODE 2
+#define LCD_OP_CURSOR 3
+#define LCD_OP_FLUSH 4
+#define LCD_OP_MARQUEE 5
+#define LCD_OP_STEP 6
+#define LCD_OP_DEFINE 7
+#define LCD_OP_GLYPH 8
+
+// The HD44780 has eight user-defined characters of eight rows each, at
+//  character codes 0-7 (and again at 8-15)
+#define LCD_GLYPH_SLOTS 8
+#define LCD_GLYPH_ROWS 8
+
+// The most text that one operation carries -- the widest row
+//  that an HD44780 can drive
+#define LCD_OP_TEXT 40
+
+// The most operations that lcd_write_string_at() needs for a string
+//  that fills the screen, so that it can go as one request
+#define LCD_OP_STRING_MAX \
+    (LCD_MAX_ROWS * ((LCD_LINE_LEN + LCD_OP_TEXT - 1) / LCD_OP_TEXT))
+
+// The most operations that lcd_write_cells() builds on the stack
+#define LCD_OP_CELLS_MAX 64
+
+// The number of operations in the render thread's queue. This must be
+//  a power of two
+#define LCD_ASYNC_QUEUE 256
+
+// The most displays that lcd_send_next_all() puts in one transaction.
+//  The kernel allows 42 messages in an I2C_RDWR transaction, but the
+//  PCF8574 only has eight addresses (sixteen, counting the PCF8574A)
+#define LCD_BATCH_MAX 16
+
+typedef struct LCD_OP {
+    unsigned char type;
+    unsigned char len;
+    unsigned char mode;
+    short row;
+    short col;
+    unsigned char text[LCD_OP_TEXT];
+    unsigned char *data; // LCD_OP_MARQUEE: a copy of the text, handed over
+    int id;              // LCD_OP_DEFINE and LCD_OP_GLYPH: the glyph
+} LCD_OP;
+
+// The rows that scroll, and how far they've got
+typedef struct LCD_MARQUEE {
+    unsigned char *text[LCD_MAX_ROWS]; // NULL if the row doesn't scroll
+    int len[LCD_MAX_ROWS];
+    int pos[LCD_MAX_ROWS]; // The character shown in the first column
+} LCD_MARQUEE;
+
+// A custom character, as the application defined it
+typedef struct LCD_GLYPH {
+    int id;
+    unsigned char bitmap[LCD_GLYPH_ROWS];
+    unsigned char fallback; // Shown if there's no slot for it
+} LCD_GLYPH;
+
+// The glyph cache: the glyphs the application has defined, the one in
+//  each CGRAM slot, and what we think each controller's CGRAM holds
+typedef struct LCD_GLYPHS {
+    LCD_GLYPH *defs;
+    int ndefs;
+    int size;
+    int slot[LCD_GLYPH_SLOTS];       // Index into defs, -1 if free
+    unsigned long used[LCD_GLYPH_SLOTS]; // When each slot was last written
+    unsigned long clock;
+    short cgram[LCD_MAX_CONTROLLERS][LCD_GLYPH_SLOTS * LCD_GLYPH_ROWS];
+} LCD_GLYPHS;
+
+// The state shared between the render thread and the callers of the
+//  lcd_* methods. The head and tail of the queue are written by
+//  different threads, so they're kept on different cache lines.
+typedef struct LCD_ASYNC {
+    pthread_t thread;
+    sem_t wake;
+    pthread_mutex_t lock; // Only for lcd_sync()
+    pthread_cond_t cond;
+    int sleeping;
+    int stop;
+    int waiters;
+    char pad0[64];
+    unsigned long head; // Written only by the producer
+    char pad1[64];
+    unsigned long tail; // Written only by the render thread
+    unsigned long done; // Operations applied and flushed
+    char pad2[64];
+    LCD_OP ops[LCD_ASYNC_QUEUE];
+} LCD_ASYNC;
+
+// A caller's operations, waiting for the combiner. It lives on the
+//  caller's stack, and the caller doesn't return until done is set
+typedef struct LCD_REQUEST {
+    const LCD_OP *ops;
+    int n;
+    struct LCD_REQUEST *next;
+    int done;
+} LCD_REQUEST;
+
+// The state that lets several threads use one LCD. Whichever thread
+//  holds lock is the combiner, and carries out the requests of all
+//  the others; they wait on cond until theirs is done, or until the
+//  lock is free and they can become the combiner themselves
+typedef struct LCD_COMBINER {
+    pthread_mutex_t lock;
+    int busy;              // lock is held
+    LCD_REQUEST *pending;  // Newest first
+    pthread_mutex_t wait_lock;
+    pthread_cond_t cond;
+    int waiters;
+} LCD_COMBINER;
+
+// How the rows of a display map onto DDRAM: the address of the start of
+//  each row, and the controller that drives it. cols is zero for a
+//  layout that suits any width
+typedef struct LCD_GEOMETRY {
+    int rows;
+    int cols;
+    int controllers;
+    unsigned char row_addr[LCD_MAX_ROWS];
+    unsigned char row_ctrl[LCD_MAX_ROWS];
+} LCD_GEOMETRY;
+
+static const LCD_GEOMETRY lcd_geometries[] = {
+    {1, 0, 1, {0x00}, {0}},
+    {2, 0, 1, {0x00, 0x40}, {0, 0}},
+    {4, 16, 1, {0x00, 0x40, 0x10, 0x50}, {0, 0, 0, 0}},
+    {4, 20, 1, {0x00, 0x40, 0x14, 0x54}, {0, 0, 0, 0}},
+    {4, 40, 2, {0x00, 0x40, 0x00, 0x40}, {0, 0, 1, 1}},
+};
+
+#define LCD_NGEOMETRIES \
+    (int)(sizeof(lcd_geometries) / sizeof(lcd_geometries[0]))
+
+// The timing profiles for the presets. See lcd_set_timing_preset()
+static const LCD_TIMING lcd_timing_presets[] = {
+    // LCD_TIMING_CONSERVATIVE
+    {100000,
+     1000000,
+     1000000,
+     1000000,
+     1000000,
+     2000000,
+     35000000,
+     35000000,
+     35000000},
+    // LCD_TIMING_DATASHEET
+    {100000, 450, 0, 37000, 41000, 1520000, 40000000, 4100000, 100000},
+};
+
+/*============================================================================
+
+  lcd_set_geometry
+
+  Look up the layout of the display in the table. Displays of other
+  sizes follow the same pattern as the 16x4 and 20x4: the third and
+  fourth rows continue the first and second lines of DDRAM.
+
+============================================================================*/
+static void lcd_set_geometry(LCD *self) {
+    for (int i = 0; i < LCD_NGEOMETRIES; i++) {
+        const LCD_GEOMETRY *g = &lcd_geometries[i];
+        if (g->rows == self->rows && (!g->cols || g->cols == self->cols)) {
+            self->controllers = g->controllers;
+            memcpy(self->row_addr, g->row_addr, sizeof(self->row_addr));
+            memcpy(self->row_ctrl, g->row_ctrl, sizeof(self->row_ctrl));
+            return;
+        }
+    }
+    self->controllers = 1;
+    for (int row = 0; row < self->rows; row++) {
+        self->row_addr[row] =
+            (row % 2) * LCD_CHARS_PER_ROW + (row / 2) * self->cols;
+        self->row_ctrl[row] = 0;
+    }
+}
+
 /*============================================================================
   lcd_create
 ============================================================================*/
 LCD *lcd_create(int i2c_addr, int rows, int cols) {
+    assert(rows > 0 && rows <= LCD_MAX_ROWS);
+    assert(cols > 0 && cols <= LCD_LINE_LEN);
     LCD *self = malloc(sizeof(LCD));
     memset(self, 0, sizeof(LCD));
     self->i2c_addr = i2c_addr;
-    self->fd = -1;
+    self->transport = NULL;
     self->ready = 0;
+    self->tx_len = 0;
+    self->tx_pos = 0;
+    self->timing = lcd_timing_presets[LCD_TIMING_DATASHEET];
+    self->pins = lcd_default_pins;
     self->rows = rows;
     self->cols = cols;
+    lcd_set_geometry(self);
+    self->ctrl = -1;
+    self->fb = malloc(rows * cols);
+    memset(self->fb, ' ', rows * cols);
+    lcd_invalidate(self);
+    self->combiner = malloc(sizeof(LCD_COMBINER));
+    memset(self->combiner, 0, sizeof(LCD_COMBINER));
+    pthread_mutex_init(&self->combiner->lock, NULL);
+    pthread_mutex_init(&self->combiner->wait_lock, NULL);
+    pthread_cond_init(&self->combiner->cond, NULL);
+    self->timer_fd = -1;
+    self->armed_at = -1;
     return self;
 }
 
+/*============================================================================
+
+  lcd_max
+
+============================================================================*/
+static long lcd_max(long a, long b) {
+    return a > b ? a : b;
+}
+
 /*============================================================================
   lcd_destroy
 ============================================================================*/
 void lcd_destroy(LCD *self) {
     if (self) {
         lcd_terminate(self);
+        if (self->marquee)
+            for (int row = 0; row < LCD_MAX_ROWS; row++)
+                free(self->marquee->text[row]);
+        free(self->marquee);
+        if (self->glyphs)
+            free(self->glyphs->defs);
+        free(self->glyphs);
+        pthread_mutex_destroy(&self->combiner->lock);
+        pthread_mutex_destroy(&self->combiner->wait_lock);
+        pthread_cond_destroy(&self->combiner->cond);
+        free(self->combiner);
+        if (self->timer_fd >= 0)
+            close(self->timer_fd);
+        free(self->state_path);
+        free(self->fb);
         free(self);
     }
 }
@@ -146,236 +420,2732 @@ lcd_set_bit_value(unsigned char b, int bit, _Bool val) {
 
 /*============================================================================
 
-  lcd_send_4_bits
+  lcd_byte_ns
+
+  The time it takes to clock one byte onto the I2C bus -- nine clocks,
+  counting the acknowledge.
+
+============================================================================*/
+static long lcd_byte_ns(LCD *self) {
+    return (long)(9000000000LL / self->timing.bus_hz);
+}
+
+/*============================================================================
+
+  lcd_now
+
+  The time on the clock of whatever drives the module.
+
+============================================================================*/
+static long long lcd_now(LCD *self) {
+    if (self->gpio)
+        return gpio_lines_now(self->gpio);
+    return lcd_transport_now(self->transport);
+}
+
+/*============================================================================
+
+  lcd_write
+
+  Write to the transport, keeping count. Failures are counted, but
+  otherwise there's not much that can be done about them here -- the
+  next operation will probably fail too, and the counters will show it.
+
+============================================================================*/
+static _Bool lcd_write(LCD *self, const unsigned char *buf, int len) {
+    long long start = lcd_transport_now(self->transport);
+    _Bool ok = lcd_transport_write(self->transport, self->i2c_addr, buf, len);
+    self->stats.io_ns += lcd_transport_now(self->transport) - start;
+    self->stats.writes++;
+    if (ok) {
+        self->stats.bytes += len;
+    } else {
+        self->stats.errors++;
+        self->stats.last_errno = errno;
+    }
+    return ok;
+}
+
+/*============================================================================
+  lcd_delay
+============================================================================*/
+static void lcd_delay(LCD *self, long ns) {
+    long long start = lcd_now(self);
+    if (self->gpio)
+        gpio_lines_delay(self->gpio, ns);
+    else
+        lcd_transport_delay(self->transport, ns);
+    self->stats.sleep_ns += lcd_now(self) - start;
+    self->stats.sleeps++;
+}
+
+/*============================================================================
+
+  lcd_wait_until
+
+  Wait until t, on the clock of whatever drives the module, if it hasn't
+  passed already. Everything that writes to the module comes through
+  here first, with t the deadline in ready_at, so this is the only
+  place that waits for an instruction to finish -- and the wait happens
+  as late as possible, when the next byte is actually ready to go.
+
+============================================================================*/
+static void lcd_wait_until(LCD *self, long long t) {
+    long long now = lcd_now(self);
+    if (t > now)
+        lcd_delay(self, t - now);
+}
+
+/*============================================================================
+  lcd_transfer
+============================================================================*/
+static _Bool lcd_transfer(LCD *self, LCD_TRANSPORT_MSG *msgs, int n) {
+    long long start = lcd_transport_now(self->transport);
+    _Bool ok = lcd_transport_transfer(self->transport, msgs, n);
+    self->stats.io_ns += lcd_transport_now(self->transport) - start;
+    for (int i = 0; i < n; i++) {
+        if (msgs[i].read) {
+            self->stats.reads++;
+        } else {
+            self->stats.writes++;
+            self->stats.bytes += msgs[i].len;
+        }
+    }
+    if (!ok) {
+        self->stats.errors++;
+        self->stats.last_errno = errno;
+    }
+    return ok;
+}
+
+/*============================================================================
+
+  lcd_wait_ready
+
+  Poll the busy flag until it clears. The PCF8574 outputs are
+  quasi-bidirectional: an output that is latched high is only weakly
+  pulled up, so the LCD module can drive it low. So we set the four
+  data lines high, raise R/W, and pulse E twice -- reading the PCF8574
+  while E is high on the first pulse gives the busy flag on D7, and the
+  second pulse clocks out the low half of the address counter, which we
+  don't need. Finally, R/W goes low again, with E low, so it's settled
+  before the next write.
+
+  Returns 0 if the busy flag didn't clear within a reasonable multiple
+  of the expected time, or the transport failed.
+
+============================================================================*/
+static _Bool lcd_wait_ready(LCD *self, long expected) {
+    const LCD_PCF8574_PINS *p = &self->pins;
+    unsigned char b = 0;
+    for (int i = 0; i < 4; i++)
+        b = lcd_set_bit_value(b, p->d[i], 1);
+    if (p->led >= 0)
+        b = lcd_set_bit_value(b, p->led, 1);
+    b = lcd_set_bit_value(b, p->rw, 1);
+    unsigned char e_high = lcd_set_bit_value(b, p->e, 1);
+    unsigned char pulse[3] = {b, e_high, b};
+    unsigned char idle = lcd_set_bit_value(b, p->rw, 0);
+
+    // Each poll is three messages, of eight bytes in all, including
+    //  the address bytes
+    long poll_ns = 8 * lcd_byte_ns(self);
+    long waited = 0;
+    _Bool ready = 0;
+    _Bool ok = lcd_write(self, &b, 1);
+    while (ok) {
+        // One transaction, if the transport can manage it
+        unsigned char in;
+        LCD_TRANSPORT_MSG poll[3] = {{self->i2c_addr, 0, &e_high, 1},
+                                     {self->i2c_addr, 1, &in, 1},
+                                     {self->i2c_addr, 0, pulse, 3}};
+        ok = lcd_transfer(self, poll, 3);
+        if (!ok)
+            break;
+        self->stats.polls++;
+        ready = !(in & (1 << p->d[3]));
+        waited += poll_ns;
+        if (ready || waited > LCD_BUSY_TIMEOUT_FACTOR * expected)
+            break;
+    }
+    if (ok)
+        ok = lcd_write(self, &idle, 1);
+    return ok && ready;
+}
+
+/*============================================================================
+
+  lcd_tx_take
+
+  Take the next segment of the PCF8574 output states that have been
+  collected by lcd_strobe, and put it in tx_out, ready to write to
+  the I2C device. The PCF8574 latches each byte of a multi-byte write as
+  a new output state, so the effect on the LCD module is exactly the
+  same as writing the bytes one at a time -- but it costs one system
+  call instead of dozens.
+
+  Each output state carries the time that must elapse before the next
+  one is latched. Each byte takes nine clocks on the bus, so short waits
+  take care of themselves. Somewhat longer ones are made up by repeating
+  the output state -- except after the last state, since nothing
+  follows it yet, and there's no point keeping the bus busy. A segment
+  ends at the first long wait (clear, home and initialization), or when
+  tx_out is full, or at the end of the buffer; the return value is the
+  wait that's needed after it. If tx_out fills up, the padding has
+  already been added, and the next write can follow straight on. If
+  done is not NULL, it's set if the segment ends with a byte complete,
+  rather than partway through a strobe.
+
+============================================================================*/
+static long lcd_tx_take(LCD *self, int *out_len, _Bool *done) {
+    long byte_ns = lcd_byte_ns(self);
+    long wait = 0;
+    int len = 0;
+    _Bool complete = 0;
+    while (self->tx_pos < self->tx_len && !wait) {
+        int i = self->tx_pos;
+        long hold = self->tx_hold[i];
+        int pad = 0;
+        _Bool last = i + 1 == self->tx_len;
+        if (hold > byte_ns && hold <= LCD_MAX_PAD_NS && !last)
+            pad = (hold + byte_ns - 1) / byte_ns - 1;
+        if (len + pad + 1 > LCD_TX_MAX)
+            break;
+        for (int j = 0; j <= pad; j++)
+            self->tx_out[len++] = (unsigned char)self->tx[i];
+        if (hold > LCD_MAX_PAD_NS || last)
+            wait = hold;
+        complete = (self->tx[i] & LCD_TX_DONE) != 0;
+        self->tx_pos++;
+    }
+    if (self->tx_pos == self->tx_len)
+        self->tx_pos = self->tx_len = 0;
+    *out_len = len;
+    if (done)
+        *done = complete;
+    return wait;
+}
+
+/*============================================================================
+
+  lcd_set_ready
+
+  Set the deadline for the next write, given that the last one ended at
+  end, and its last state needs hold nanoseconds. The next write starts
+  with the address byte, and none of its states is latched until that
+  has gone, so the wait can be that much shorter.
+
+============================================================================*/
+static void lcd_set_ready(LCD *self, long long end, long hold) {
+    self->ready_at = end + hold - lcd_byte_ns(self);
+}
+
+/*============================================================================
+
+  lcd_tx_segment
+
+  Write the next segment of output states, and return the wait that's
+  needed after it. done is as for lcd_tx_take.
+
+============================================================================*/
+static long lcd_tx_segment(LCD *self, _Bool *done) {
+    int len;
+    long wait = lcd_tx_take(self, &len, done);
+    if (len > 0)
+        lcd_write(self, self->tx_out, len);
+    return wait;
+}
+
+/*============================================================================
+
+  lcd_tx_flush
+
+  Write all the pending output states, waiting as long as necessary
+  between segments. The wait after the last state isn't made here: it
+  becomes the deadline in ready_at, and whatever the caller does next
+  -- formatting, diffing, encoding the next update -- happens while the
+  module executes the last instruction. If busy-flag polling is enabled,
+  the long waits after a complete instruction or data byte are made by
+  polling instead of sleeping. A long wait anywhere else -- with E high,
+  or between the two nibbles of a byte -- is always a plain wait, since
+  a poll would change R/W and the data lines under the module.
+
+============================================================================*/
+static void lcd_tx_flush_gpio(LCD *self);
+
+static void lcd_tx_flush(LCD *self) {
+    if (self->gpio) {
+        lcd_tx_flush_gpio(self);
+        return;
+    }
+    while (self->tx_len > 0) {
+        lcd_wait_until(self, self->ready_at);
+        _Bool done;
+        long hold = lcd_tx_segment(self, &done);
+        if (hold > LCD_MAX_PAD_NS && done && self->busy_poll &&
+            self->synced) {
+            // If the busy flag doesn't work, we've no idea how long
+            //  we've waited, so wait the full time as well
+            if (!lcd_wait_ready(self, hold)) {
+                self->busy_poll = 0;
+                lcd_delay(self, hold);
+            }
+            hold = 0;
+        }
+        lcd_set_ready(self, lcd_now(self), hold);
+    }
+}
+
+/*============================================================================
+
+  lcd_tx_flush_gpio
+
+  Write the pending output states to the GPIO lines. Each state changes
+  all the lines at once, in one operation, and there is nothing to be
+  gained by padding, so each wait is made by sleeping, or spinning
+  when it's short -- and, as on I2C, the wait after the last state is
+  left to the next write.
+
+============================================================================*/
+static void lcd_tx_next_gpio(LCD *self);
+
+static void lcd_tx_flush_gpio(LCD *self) {
+    while (self->tx_len > 0) {
+        lcd_wait_until(self, self->ready_at);
+        lcd_tx_next_gpio(self);
+    }
+}
+
+/*============================================================================
+
+  lcd_tx_next_gpio
+
+  Write the next pending output state to the GPIO lines, and set the
+  deadline for the one after it.
+
+============================================================================*/
+static void lcd_tx_next_gpio(LCD *self) {
+    unsigned long long all = (1ULL << self->gpio->count) - 1;
+    int i = self->tx_pos;
+    long long start = lcd_now(self);
+    _Bool written;
+    _Bool ok = gpio_lines_set(
+        self->gpio, all, self->tx[i] & ~LCD_TX_DONE, &written);
+    self->stats.io_ns += lcd_now(self) - start;
+    // A state that repeats the last one costs nothing, and isn't counted
+    if (written)
+        self->stats.writes++;
+    if (ok && written) {
+        self->stats.bytes++;
+    } else if (!ok) {
+        self->stats.errors++;
+        self->stats.last_errno = errno;
+    }
+    self->ready_at = lcd_now(self) + self->tx_hold[i];
+    if (++self->tx_pos == self->tx_len)
+        self->tx_pos = self->tx_len = 0;
+}
+
+/*============================================================================
+
+  lcd_tx_send_due
+
+  Write as much of the pending output as the module is ready for, and
+  stop at the first wait, instead of making it.
+
+============================================================================*/
+static void lcd_tx_send_due(LCD *self) {
+    while (self->tx_len > 0 && self->ready_at <= lcd_now(self)) {
+        if (self->gpio) {
+            lcd_tx_next_gpio(self);
+        } else {
+            long hold = lcd_tx_segment(self, NULL);
+            lcd_set_ready(self, lcd_now(self), hold);
+        }
+    }
+}
+
+/*============================================================================
+
+  lcd_deadline
+
+  When lcd_step() should next be called, on the clock of whatever
+  drives the module, or -1 if there's nothing for it to do.
+
+============================================================================*/
+static long long lcd_deadline(LCD *self) {
+    if (self->tx_len == 0 && !self->stale)
+        return -1;
+    return self->ready_at;
+}
+
+/*============================================================================
+
+  lcd_arm
+
+  Set the timer behind lcd_poll_fd() to expire at the deadline, or stop
+  it if there is none. A deadline that has passed already is set as
+  one nanosecond after the epoch, so the timer expires at once -- zero
+  would stop it.
+
+============================================================================*/
+static void lcd_arm(LCD *self) {
+    if (self->timer_fd < 0)
+        return;
+    long long t = lcd_deadline(self);
+    if (t == self->armed_at)
+        return;
+    self->armed_at = t;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (t >= 0) {
+        if (t < 1)
+            t = 1;
+        its.it_value.tv_sec = t / 1000000000LL;
+        its.it_value.tv_nsec = t % 1000000000LL;
+    }
+    timerfd_settime(self->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*============================================================================
+
+  lcd_tx_send
+
+  Send what's queued -- or, in non-blocking mode, leave it for
+  lcd_step().
+
+============================================================================*/
+static void lcd_tx_send(LCD *self) {
+    if (self->nonblocking)
+        lcd_arm(self);
+    else
+        lcd_tx_flush(self);
+}
+
+/*============================================================================
+
+  lcd_queue
+
+  Add an output state to the transmit buffer, with the time that must
+  elapse after it is latched. If the buffer is full, it is flushed first.
+
+============================================================================*/
+static void lcd_queue(LCD *self, unsigned short b, long hold) {
+    if (self->tx_len == LCD_TX_MAX)
+        lcd_tx_flush(self);
+    self->tx[self->tx_len] = b;
+    self->tx_hold[self->tx_len] = hold;
+    self->tx_len++;
+}
+
+/*============================================================================
+
+  lcd_tx_interleave
+
+  Merge the output states queued for the first controller, from start
+  to mid, with those queued after them for the second, so that one is
+  fed while the other is executing an instruction. The states come in
+  pairs -- E high, then E low -- and a pair is never split, since the
+  data lines are shared. The hold of a pair's second state is the time
+  its controller needs before its next strobe; here that becomes a
+  constraint on that controller only, and the holds are rewritten as
+  the gaps between one state and the next, whichever controller it's
+  for. The time of each state on the bus is estimated as we go, and the
+  next pair goes to whichever controller is ready first. The last state
+  waits for both.
+
+============================================================================*/
+static void lcd_tx_interleave(LCD *self, int start, int mid) {
+    int na = mid - start;
+    if (mid < start || self->tx_len < mid || na > LCD_TX_MAX / 2)
+        return; // Not as we left it -- sending it as it is is still fine
+    assert(na % 2 == 0 && (self->tx_len - mid) % 2 == 0);
+    unsigned short states[LCD_TX_MAX / 2];
+    long holds[LCD_TX_MAX / 2];
+    memcpy(states, self->tx + start, na * sizeof(unsigned short));
+    memcpy(holds, self->tx_hold + start, na * sizeof(long));
+
+    long byte_ns = self->gpio ? 0 : lcd_byte_ns(self);
+    int pos[2] = {0, mid};
+    int end[2] = {na, self->tx_len};
+    long long ready[2] = {0, 0};
+    long long t = 0, last_t = 0;
+    int out = start;
+    int last = -1;
+    while (pos[0] < end[0] || pos[1] < end[1]) {
+        int c;
+        if (pos[0] == end[0])
+            c = 1;
+        else if (pos[1] == end[1])
+            c = 0;
+        else
+            c = ready[1] < ready[0];
+        const unsigned short *s = c ? self->tx + pos[c] : states + pos[c];
+        const long *h = c ? self->tx_hold + pos[c] : holds + pos[c];
+        unsigned short high = s[0], low = s[1];
+        long pulse = h[0], wait = h[1];
+        pos[c] += 2;
+
+        long long at = t > ready[c] ? t : ready[c];
+        if (last >= 0)
+            self->tx_hold[last] = at - last_t;
+        self->tx[out] = high;
+        self->tx_hold[out++] = pulse;
+        last_t = at + lcd_max(pulse, byte_ns);
+        self->tx[out] = low;
+        last = out++;
+        ready[c] = last_t + wait;
+        t = last_t + byte_ns;
+    }
+    if (last >= 0)
+        self->tx_hold[last] =
+            (ready[0] > ready[1] ? ready[0] : ready[1]) - last_t;
+}
+
+/*============================================================================
+
+  lcd_state
+
+  Work out the output state that puts a value on the data lines, with
+  E low. In 4-bit mode, the value is a nibble; in 8-bit mode (only
+  possible when the module is wired to GPIO lines), it's a whole byte.
+  For the PCF8574, the backlight LED line is on, if a pin was specified
+  for it, and the register select bit is set if the caller requires
+  this (this selects between command and data registers).
+
+============================================================================*/
+static unsigned short lcd_state(LCD *self, _Bool rs, unsigned char data) {
+    if (self->gpio)
+        return (rs << LCD_GPIO_RS) | (data << LCD_GPIO_DATA);
+    const LCD_PCF8574_PINS *p = &self->pins;
+    unsigned char b = 0;
+    if (p->led >= 0)
+        b = lcd_set_bit_value(b, p->led, 1);
+    b = lcd_set_bit_value(b, p->rs, rs);
+    for (int i = 0; i < 4; i++)
+        b = lcd_set_bit_value(b, p->d[i], (data >> i) & 1);
+    return b;
+}
+
+/*============================================================================
+
+  lcd_e_mask
+
+  The E line of controller ctrl, or of both controllers if ctrl is -1.
+  On GPIO, E of the second controller is the last line.
+
+============================================================================*/
+static unsigned short lcd_e_mask(LCD *self, int ctrl) {
+    unsigned short e0 = self->gpio ? 1 << LCD_GPIO_E : 1 << self->pins.e;
+    if (self->controllers == 1 || ctrl == 0)
+        return e0;
+    unsigned short e1 =
+        self->gpio ? 1 << (self->gpio->count - 1) : 1 << self->pins.e2;
+    return ctrl == 1 ? e1 : e0 | e1;
+}
+
+/*============================================================================
+
+  lcd_build_encoding
+
+  Fill in the table of output states for every byte, so that encoding
+  text is a matter of copying entries rather than fiddling with bits.
+  This has to be done again whenever the wiring changes. The table pulses
+  E of the first controller; lcd_send_bytes swaps in the others. The
+  last state of each entry is marked with LCD_TX_DONE.
+
+============================================================================*/
+static void lcd_build_encoding(LCD *self) {
+    unsigned short e = lcd_e_mask(self, 0);
+    for (int rs = 0; rs < 2; rs++) {
+        for (int n = 0; n < 256; n++) {
+            unsigned short *states = self->enc[rs][n];
+            if (self->eight_bit) {
+                states[0] = lcd_state(self, rs, n) | e;
+                states[1] = lcd_state(self, rs, n) | LCD_TX_DONE;
+                continue;
+            }
+            unsigned short high = lcd_state(self, rs, n >> 4);
+            unsigned short low = lcd_state(self, rs, n & 0x0F);
+            states[0] = high | e;
+            states[1] = high;
+            states[2] = low | e;
+            states[3] = low | LCD_TX_DONE;
+        }
+    }
+}
+
+/*============================================================================
 
-  Here's the sequence:
+  lcd_strobe
 
-  1. Ensure the backlight LED line is on, if a value was specified for it
-  2. Set the register select bit, if the caller requires this (this selects
-     between command and data registers)
-  3. Send the four-bit command and the other (register, backlight)
-     bits on an 8-bit write to the PCF8574, with the E (clock) bit
-     high
-  3. Repeat with the clock bit low
+  Put a value on the data lines and pulse E of the controller being
+  addressed: queue the output state (see lcd_state) with the E (clock)
+  bit high, and then with it low.
+  Ordinary bytes go through the table made by lcd_build_encoding
+  instead; this is for the odd nibbles of the initialization sequence.
 
   This is bit fiddly, because we have to write the PCF8574 in 8-bit
   words. What we really want to do is set the RS, LED, and data bits,
   then pulse the E (clock) bit. But we can't, because we can only
-  change the set of 8 PCF8574 outputs in a single operation.
+  change the set of 8 PCF8574 outputs in a single operation. GPIO lines
+  work the same way: RS, the data and E all change in one operation.
 
-============================================================================*/
-static void lcd_send_4_bits(LCD *self, _Bool rs, unsigned char n) {
-    unsigned char b = (n << 4) & 0xF0;
+  Nothing is actually written here -- the output states are added to
+  the transmit buffer, and go to the device when lcd_tx_flush is called.
+  The E pulse has to last for the pulse width in the timing profile, and
+  the caller supplies the time that the LCD module needs after the
+  falling edge, which is when it acts on the data.
 
-    if (PIN_LED > 0)
-        b = lcd_set_bit_value(b, PIN_LED, 1);
-    b = lcd_set_bit_value(b, PIN_RS, rs);
+============================================================================*/
+static void lcd_strobe(LCD *self, _Bool rs, unsigned char data, long exec) {
+    const LCD_TIMING *t = &self->timing;
+    long high = lcd_max(t->e_pulse_ns, t->edge_ns);
+    unsigned short b = lcd_state(self, rs, data);
+    unsigned short e = lcd_e_mask(self, self->ctrl);
 
     // I think we don't need to set E (clock) low every time a command
     //  is sent. It starts off low, then gets pulse high and then low
     //  by this method. So long as we don't accidentally set it high
     //  anywhere else, we don't need to set it low repeatedly. This saves
-    //  a couple of milliseconds on each command.
-    // b = lcd_set_bit_value (b, PIN_E, 0);
-    // write (self->fd, &b, 1);
-    // usleep (1000);
+    //  a byte on the wire for each nibble.
+    lcd_queue(self, b | e, high);
+    lcd_queue(self,
+              b,
+              lcd_max(lcd_max(high, LCD_T_CYCE_NS - high), exec));
+}
+
+/*============================================================================
+
+  lcd_send_bytes
+
+  Queue a run of bytes, all commands or all data, each of which needs
+  exec nanoseconds to execute. To send a byte in 4-bit mode, we send the
+  high four bits and then the low four bits. The LCD module doesn't do
+  anything until it has both halves, so it's only the second half that
+  needs the execution time of the instruction. In 8-bit mode, the byte
+  goes in one strobe. Either way, the output states come straight from
+  the encoding table, and the waits are the same for every byte.
 
-    b = lcd_set_bit_value(b, PIN_E, 1);
-    write(self->fd, &b, 1);
-    usleep(1000);
-    b = lcd_set_bit_value(b, PIN_E, 0);
-    write(self->fd, &b, 1);
-    usleep(1000);
+============================================================================*/
+static void lcd_send_bytes(LCD *self,
+                           _Bool rs,
+                           const unsigned char *s,
+                           int n,
+                           long exec) {
+    const LCD_TIMING *t = &self->timing;
+    long high = lcd_max(t->e_pulse_ns, t->edge_ns);
+    long low = lcd_max(high, LCD_T_CYCE_NS - high);
+    long hold[4] = {high, low, high, low};
+    int count = self->eight_bit ? 2 : 4;
+    hold[count - 1] = lcd_max(low, exec);
+    unsigned short e0 = lcd_e_mask(self, 0);
+    unsigned short e = lcd_e_mask(self, self->ctrl);
+    for (int i = 0; i < n; i++) {
+        if (self->tx_len + count > LCD_TX_MAX)
+            lcd_tx_flush(self);
+        unsigned short *tx = self->tx + self->tx_len;
+        memcpy(tx, self->enc[rs][s[i]], count * sizeof(unsigned short));
+        if (e != e0)
+            for (int j = 0; j < count; j += 2)
+                tx[j] = (tx[j] & ~e0) | e;
+        memcpy(self->tx_hold + self->tx_len, hold, count * sizeof(long));
+        self->tx_len += count;
+    }
 }
 
 /*============================================================================
 
   lcd_send_byte
 
-  To send a byte in 4-bit mode, we send the high four bits and then the
-  low four bits.
+  Queue one command or data byte.
 
 ============================================================================*/
 static void lcd_send_byte(LCD *self, _Bool rs, unsigned char n) {
-    lcd_send_4_bits(self, rs, (n >> 4) & 0x0F);
-    lcd_send_4_bits(self, rs, n & 0x0F);
+    long exec;
+    if (rs)
+        exec = self->timing.data_ns;
+    else if (n == CMD_CLEAR || (n & ~0x01) == CMD_HOME)
+        exec = self->timing.clear_ns;
+    else
+        exec = self->timing.exec_ns;
+    lcd_send_bytes(self, rs, &n, 1, exec);
+    if (rs)
+        self->stats.data++;
+    else
+        self->stats.commands++;
+    if (!rs && (n & CMD_SET_DDRAM_ADDR))
+        self->stats.addr_jumps++;
 }
 
 /*============================================================================
 
-  lcd_write_char_at
+  lcd_addr
 
-  Use the SET_DDRAM_ADDR command to the LCD module to set the
-  memory address where the char will be written. The send the
-  char as a byte, with the register-select bit high to indicate this
-  is data, not a command.
+  Work out the DDRAM address of a character cell, taking the display
+  shift into account: it moves the window onto each line of DDRAM
+  that the rows show, wrapping round at the end of the line. The
+  addresses of the second controller, if there is one, follow those of
+  the first, so the result is an index into self->ddram: the controller
+  is addr / LCD_DDRAM_SIZE, and the address within it
+  addr % LCD_DDRAM_SIZE.
 
 ============================================================================*/
-void lcd_write_char_at(LCD *self, int row, int col, unsigned char c) {
-    if (row < self->rows && col < self->cols) {
-        int addr = row * LCD_CHARS_PER_ROW + col;
-        lcd_send_byte(self, 0, CMD_SET_DDRAM_ADDR | addr);
-        lcd_send_byte(self, 1, c);
-    }
+static int lcd_addr(LCD *self, int row, int col) {
+    int c = self->row_ctrl[row];
+    int line = self->row_addr[row] & LCD_CHARS_PER_ROW;
+    int pos = (self->row_addr[row] & (LCD_CHARS_PER_ROW - 1)) + col;
+    return c * LCD_DDRAM_SIZE + line + (pos + self->shift[c]) % LCD_LINE_LEN;
 }
 
 /*============================================================================
 
-  lcd_write_string_at
+  lcd_tx_full
 
-  Write a whole string, wrapping if necessary. The slightly convoluted
-  logic is because the rows of characters are not contiguous in the LCD
-  module's memory. Repeated calls to write_char_at would be easier
-  to implement, but would send a "set address" command for each character,
-  which is wasteful. We only want to set a new address when the text
-  wraps to another line.
+  In non-blocking mode, check that n more bytes fit in the transmit
+  buffer. If they don't, the framebuffer is left stale, and 1 is
+  returned; the encoder stops there, and lcd_step() carries on from the
+  cells that are still dirty once the buffer has drained. The encoder
+  only stops between pieces that leave its records of the module's
+  memory true. In blocking mode, a full buffer is flushed as it fills,
+  so this always returns 0.
 
 ============================================================================*/
-void lcd_write_string_at(LCD *self,
-                             int row,
-                             int col,
-                             const unsigned char *s,
-                             _Bool wrap) {
-    if (row < self->rows && col < self->cols) {
-        int addr = row * LCD_CHARS_PER_ROW + col;
-        lcd_send_byte(self, 0, CMD_SET_DDRAM_ADDR | addr);
-        while (*s && row < self->rows && col < self->cols) {
-            lcd_send_byte(self, 1, *s);
-            col++;
-            if (col >= self->cols && wrap) {
-                row++;
-                col = 0;
-                addr = row * LCD_CHARS_PER_ROW + col;
-                lcd_send_byte(self, 0, CMD_SET_DDRAM_ADDR | addr);
-            }
-            s++;
-        }
-    }
+static _Bool lcd_tx_full(LCD *self, int n) {
+    if (!self->nonblocking)
+        return 0;
+    if (self->tx_len + n * (self->eight_bit ? 2 : 4) <= LCD_TX_MAX)
+        return 0;
+    self->stale = 1;
+    return 1;
 }
 
 /*============================================================================
 
-  lcd_clear
+  lcd_dirty
 
-  Just send the clear command.
+  Returns 1 if the character cell in the framebuffer differs from what
+  we believe to be in the LCD module's memory.
 
 ============================================================================*/
-void lcd_clear(LCD *self) {
-    lcd_send_byte(self, 0, CMD_CLEAR);
+static _Bool lcd_dirty(LCD *self, int row, int col) {
+    return self->ddram[lcd_addr(self, row, col)] !=
+           self->fb[row * self->cols + col];
 }
 
 /*============================================================================
 
-  lcd_set_cursor
+  lcd_send_clear
 
-  This is a bit hacky, because the HD44780 does have a "move cursor"
-  function. The cursor goes right of the last text. So we print an invisible
-  null at the cursor position. The null doesn't print anything (and any
-  existing character is left alone), but the cursor is placed it
-  the specified position. To be frank, I don't know whether all HD44780
-  implementations support this.
+  Send the clear command to the controller being addressed, and note
+  that the whole of its memory is now spaces, and its address counter
+  and display shift are zero.
 
 ============================================================================*/
-void lcd_set_cursor(LCD *self, int row, int col) {
-    lcd_write_string_at(self, row, col, (unsigned char *)"\0", 1);
+static void lcd_send_clear(LCD *self) {
+    lcd_send_byte(self, 0, CMD_CLEAR);
+    for (int c = 0; c < self->controllers; c++) {
+        if (self->ctrl >= 0 && self->ctrl != c)
+            continue;
+        for (int i = 0; i < LCD_DDRAM_SIZE; i++)
+            self->ddram[c * LCD_DDRAM_SIZE + i] = ' ';
+        self->ac[c] = c * LCD_DDRAM_SIZE;
+        self->shift_sent[c] = 0;
+    }
 }
 
 /*============================================================================
 
-  lcd_set_mode
+  lcd_put_cells
 
-  Just send a "control register" command, with the mode bits specified
-  by the caller.
+  Send the characters in the framebuffer for the cells of a row from
+  col up to end, assuming that the address counter already points to
+  the first. The address counter moves on by one for each, except at
+  the end of a 40-character line of DDRAM, where it jumps to the other
+  line -- it's easier just to forget it, then.
 
 ============================================================================*/
-void lcd_set_mode(LCD *self, unsigned char mode) {
-    lcd_send_byte(self, 0, CMD_CTRL | mode);
+static void lcd_put_cells(LCD *self, int row, int col, int end) {
+    const unsigned char *s = self->fb + row * self->cols + col;
+    lcd_send_bytes(self, 1, s, end - col, self->timing.data_ns);
+    self->stats.data += end - col;
+    int c = self->row_ctrl[row];
+    for (; col < end; col++, s++) {
+        int addr = lcd_addr(self, row, col);
+        self->ddram[addr] = *s;
+        self->ac[c] = (addr & 0x3F) == LCD_LINE_LEN - 1 ? -1 : addr + 1;
+    }
 }
 
 /*============================================================================
 
-  lcd_init
+  lcd_sync_shift
 
-  Initialize the display module
+  Send the display shift instructions that bring the controller being
+  addressed to the shift we want, going whichever way round is
+  shorter. If we don't know its shift, "return home" puts it at zero.
 
 ============================================================================*/
-_Bool lcd_init(char *dev, LCD *self, char **error) {
-    assert(self != NULL);
-    int ret = 0;
-    // See if we can open the I2C device
-    self->fd = open(dev, O_WRONLY);
-    if (self->fd >= 0) {
-        // Set the I2C slave address that was supplied when this
-        //   object was created
-        if (ioctl(self->fd, I2C_SLAVE, self->i2c_addr) >= 0) {
-            // Set all output PCF8574 lines to zero, because we don't really
-            // know how they will power up
-            unsigned char c = 0;
-            write(self->fd, &c, 1);
-            usleep(35000);
-
-            // Now... this is all a bit nasty...
-            // We need to set 4-bit mode, but the LCD module powers up in
-            //  eight bit mode. We can't be sure this is the first program
-            //  to use the LCD since power-up, so we don't know what
-            //  mode it's in. And we need to issue a command to set 4-bit
-            //  mode -- without knowing what mode we're in. So first we have
-            //  to enable 8-bit mode and then, knowing we're in 8-bit mode,
-            //  we must set 4-bit mode. Setting 8-bit mode without knowing the
-            //  current mode can be accomplished by sending the mode-setting
-            //  command as three identical 4-bit commands. If we start in
-            //  8-bit mode, some of these commands are gibberish 8-bit
-            //  commands with four of their bits set wrongly. But there's still
-            //  enough coherence for the module to get the message with thi
-            //  command sequence. This method of setting the mode is widely
-            //  used, even though it isn't documented, and it seems to work OK.
-
-            // set 8-bit mode by sending 4-bit cmds 3 times in a row
-            unsigned char func = CMD_FUNC | LCD_FUNC_DL;
-            for (int i = 0; i < 3; ++i) {
-                lcd_send_4_bits(self, 0, func >> 4);
-                usleep(35000);
-            }
+static void lcd_sync_shift(LCD *self) {
+    int c = self->ctrl;
+    if (lcd_tx_full(self, 1 + LCD_LINE_LEN / 2))
+        return;
+    if (self->shift_sent[c] < 0) {
+        lcd_send_byte(self, 0, CMD_HOME);
+        self->shift_sent[c] = 0;
+        self->ac[c] = c * LCD_DDRAM_SIZE;
+    }
+    int n = (self->shift[c] - self->shift_sent[c] + LCD_LINE_LEN) %
+            LCD_LINE_LEN;
+    unsigned char cmd = CMD_CDSHIFT | LCD_CDSHIFT_SC;
+    if (n > LCD_LINE_LEN / 2) {
+        n = LCD_LINE_LEN - n;
+        cmd |= LCD_CDSHIFT_RL;
+    }
+    for (int i = 0; i < n; i++)
+        lcd_send_byte(self, 0, cmd);
+    self->shift_sent[c] = self->shift[c];
+}
 
-            // set 4-bit mode
-            func = CMD_FUNC | 0;
-            lcd_send_4_bits(self, 0, func >> 4);
-            usleep(35000);
-
-            // Set more than one row (the LCD only has two line modes,
-            //  "one" or "more that one")
-            func = CMD_FUNC | LCD_FUNC_N;
-            // NB -- send_byte sends two 4-bit commands in a row
-            lcd_send_byte(self, 0, func);
-
-            // Clear display
-            lcd_clear(self);
-            lcd_set_mode(self, LCD_MODE_DISPLAY_ON);
-
-            // We might want to set the cursor and shift modes -- but, honestly,
-            //   it's more likely that the user of this class will take care of
-            //   these things.
-            // lcd_send_byte (self, 0, CMD_ENTRY | LCD_ENTRY_ID);
-            // lcd_send_byte (self, 0, CMD_CDSHIFT | LCD_CDSHIFT_RL);
-
-            ret = 1;
-            self->ready = 1;
-        } else {
-            gpio_err_msg("Can't set I2C device address", error);
+/*============================================================================
+
+  lcd_can_shift
+
+  Whether the marquees on controller c can be moved with the display
+  shift: every row of the controller must have a line of DDRAM to
+  itself, and be either a marquee or blank.
+
+============================================================================*/
+static _Bool lcd_can_shift(LCD *self, int c) {
+    if (!self->marquee)
+        return 0;
+    int lines = 0;
+    _Bool any = 0;
+    for (int row = 0; row < self->rows; row++) {
+        if (self->row_ctrl[row] != c)
+            continue;
+        if (self->row_addr[row] & (LCD_CHARS_PER_ROW - 1) || ++lines > 2)
+            return 0;
+        if (self->marquee->text[row]) {
+            any = 1;
+            continue;
         }
-    } else {
-        gpio_err_msg("Can't open I2C device", error);
+        const unsigned char *fb = self->fb + row * self->cols;
+        for (int col = 0; col < self->cols; col++)
+            if (fb[col] != ' ')
+                return 0;
+    }
+    return any;
+}
+
+/*============================================================================
+
+  lcd_refill
+
+  Write the text that is about to scroll into view into the part of
+  each line of DDRAM that isn't shown, if the display shift is being
+  used for the marquees. Nothing is done until the next character to
+  come into view is wrong; then the whole of the hidden part of the
+  line is brought up to date, as one run of characters, so that the
+  next (40 - cols) steps cost only the shift instruction. Blank rows
+  get spaces, so that they stay blank as the display shifts.
 
+============================================================================*/
+static void lcd_refill(LCD *self) {
+    int c = self->ctrl;
+    if (self->cols >= LCD_LINE_LEN || !lcd_can_shift(self, c))
+        return;
+    LCD_MARQUEE *m = self->marquee;
+    unsigned char text[LCD_LINE_LEN];
+    for (int row = 0; row < self->rows; row++) {
+        if (self->row_ctrl[row] != c)
+            continue;
+        int n = LCD_LINE_LEN - self->cols;
+        for (int i = 0; i < n; i++) {
+            int col = self->cols + i;
+            text[i] = m->text[row]
+                          ? m->text[row][(m->pos[row] + col) % m->len[row]]
+                          : ' ';
+        }
+        if (self->ddram[lcd_addr(self, row, self->cols)] == text[0])
+            continue;
+        // A row that was half done would look finished, so it's all or
+        //  nothing
+        if (lcd_tx_full(self, 2 + n))
+            return;
+        // The hidden columns wrap round the end of the line at most
+        //  once, so this is one or two runs
+        int i = 0;
+        while (i < n) {
+            int addr = lcd_addr(self, row, self->cols + i);
+            int run = LCD_LINE_LEN - addr % LCD_CHARS_PER_ROW;
+            if (run > n - i)
+                run = n - i;
+            if (self->ac[c] != addr)
+                lcd_send_byte(
+                    self, 0, CMD_SET_DDRAM_ADDR | (addr % LCD_DDRAM_SIZE));
+            lcd_send_bytes(self, 1, text + i, run, self->timing.data_ns);
+            self->stats.data += run;
+            for (int j = 0; j < run; j++)
+                self->ddram[addr + j] = text[i + j];
+            self->ac[c] =
+                (addr + run) % LCD_CHARS_PER_ROW == LCD_LINE_LEN ? -1
+                                                               : addr + run;
+            i += run;
+        }
     }
-    return ret;
 }
 
 /*============================================================================
-  lcd_terminate
+
+  lcd_glyph_mask
+
+  The CGRAM slots whose characters appear among n cells, as a bit mask.
+  Codes 8-15 show the same characters as 0-7.
+
+============================================================================*/
+static unsigned lcd_glyph_mask(const unsigned char *s, int n) {
+    unsigned mask = 0;
+    for (int i = 0; i < n; i++)
+        if (s[i] < 2 * LCD_GLYPH_SLOTS)
+            mask |= 1u << (s[i] % LCD_GLYPH_SLOTS);
+    return mask;
+}
+
+/*============================================================================
+
+  lcd_sync_cgram
+
+  Bring the CGRAM of the controller being addressed up to date, for the
+  glyphs that its rows show. Only the rows of the bitmaps that differ
+  from what the controller holds are sent -- a glyph whose slot already
+  holds the right bitmap costs nothing. As with DDRAM, a short gap
+  between changed rows is cheaper to rewrite than to skip with another
+  set-address instruction. Afterwards, the address counter points into
+  CGRAM, so the next character needs a set DDRAM address.
+
+============================================================================*/
+static void lcd_sync_cgram(LCD *self) {
+    LCD_GLYPHS *g = self->glyphs;
+    if (!g)
+        return;
+    int c = self->ctrl;
+    unsigned mask = 0;
+    for (int row = 0; row < self->rows; row++)
+        if (self->row_ctrl[row] == c)
+            mask |= lcd_glyph_mask(self->fb + row * self->cols, self->cols);
+
+    // What each row of CGRAM should hold. Slots that aren't on screen
+    //  are left as they are
+    const int n = LCD_GLYPH_SLOTS * LCD_GLYPH_ROWS;
+    short *cgram = g->cgram[c];
+    short want[LCD_GLYPH_SLOTS * LCD_GLYPH_ROWS];
+    for (int i = 0; i < n; i++) {
+        int s = i / LCD_GLYPH_ROWS;
+        want[i] = mask >> s & 1 && g->slot[s] >= 0
+                      ? g->defs[g->slot[s]].bitmap[i % LCD_GLYPH_ROWS]
+                      : cgram[i];
+    }
+
+    int i = 0;
+    while (i < n) {
+        if (want[i] == cgram[i]) {
+            i++;
+            continue;
+        }
+        // Rows in a gap are rewritten with what they hold, so they
+        //  must be known
+        int end = i + 1;
+        for (;;) {
+            int next = end;
+            while (next < n && want[next] == cgram[next] && want[next] >= 0)
+                next++;
+            if (next >= n || want[next] < 0 || next - end > LCD_JUMP_COST)
+                break;
+            end = next + 1;
+        }
+        if (lcd_tx_full(self, 1 + end - i))
+            return;
+        unsigned char bytes[LCD_GLYPH_SLOTS * LCD_GLYPH_ROWS];
+        for (int j = i; j < end; j++)
+            bytes[j - i] = cgram[j] = want[j];
+        lcd_send_byte(self, 0, CMD_SET_CGRAM_ADDR | i);
+        lcd_send_bytes(self, 1, bytes, end - i, self->timing.data_ns);
+        self->stats.glyph_rows += end - i;
+        self->ac[c] = -1;
+        i = end;
+    }
+}
+
+/*============================================================================
+
+  lcd_maybe_clear
+
+  If most of the rows of the controller being addressed have to be
+  blanked, the clear command is cheaper than writing spaces, even though
+  it takes 1.52msec to execute. So compare the number of cells that
+  would have to be written with and without a clear, counting the clear
+  itself as the number of characters that could have been sent in the
+  time it takes.
+
+============================================================================*/
+static void lcd_maybe_clear(LCD *self) {
+    int dirty = 0;
+    int non_blank = 0;
+    for (int row = 0; row < self->rows; row++) {
+        if (self->row_ctrl[row] != self->ctrl)
+            continue;
+        for (int col = 0; col < self->cols; col++) {
+            if (lcd_dirty(self, row, col))
+                dirty++;
+            if (self->fb[row * self->cols + col] != ' ')
+                non_blank++;
+        }
+    }
+    long char_ns = 4 * lcd_byte_ns(self);
+    int clear_cost = 1 + self->timing.clear_ns / char_ns;
+    if (non_blank + clear_cost >= dirty || lcd_tx_full(self, 1))
+        return;
+    lcd_send_clear(self);
+    // If we're going to send the update anyway, start the clear now,
+    //  and the rest of it can be worked out while the clear executes.
+    //  With two controllers, the streams have to be interleaved first
+    if (self->sending && self->controllers == 1)
+        lcd_tx_flush(self);
+}
+
+/*============================================================================
+
+  lcd_encode_fb
+
+  Queue the cells of the framebuffer that have changed. Unchanged cells
+  are skipped by setting a new DDRAM address -- but that's an
+  instruction, and costs as much to send as a character, so short
+  gaps between changed cells are cheaper to fill in by rewriting the
+  unchanged cells. Each run of cells to be written goes to
+  lcd_put_cells in one piece.
+
+  With two controllers, each one's rows are queued in turn, and then
+  the two streams are interleaved (see lcd_tx_interleave), so that one
+  controller is fed while the other is busy. They are small enough to
+  fit in the transmit buffer together, if it's no more than half full;
+  in non-blocking mode, if it's fuller, they wait for lcd_step().
+
+============================================================================*/
+static void lcd_encode_rows(LCD *self);
+
+static void lcd_encode_fb(LCD *self) {
+    self->stats.flushes++;
+    if (self->controllers == 1) {
+        self->ctrl = 0;
+        lcd_encode_rows(self);
+        return;
+    }
+    if (self->tx_len > LCD_TX_MAX / 2) {
+        if (self->nonblocking) {
+            self->stale = 1;
+            return;
+        }
+        lcd_tx_flush(self);
+    }
+    int start = self->tx_len;
+    self->ctrl = 0;
+    lcd_encode_rows(self);
+    int mid = self->tx_len;
+    self->ctrl = 1;
+    if (!self->stale)
+        lcd_encode_rows(self);
+    lcd_tx_interleave(self, start, mid);
+}
+
+/*============================================================================
+
+  lcd_encode_rows
+
+  Queue the changed cells of the rows that belong to the controller being
+  addressed.
+
+============================================================================*/
+static void lcd_encode_rows(LCD *self) {
+    int c = self->ctrl;
+    // Each step stops, in non-blocking mode, if it's out of room
+    lcd_maybe_clear(self);
+    if (!self->stale)
+        lcd_sync_shift(self);
+    if (!self->stale)
+        lcd_sync_cgram(self);
+    if (!self->stale)
+        lcd_refill(self);
+    if (self->stale)
+        return;
+    for (int row = 0; row < self->rows; row++) {
+        if (self->row_ctrl[row] != c)
+            continue;
+        int col = 0;
+        while (col < self->cols) {
+            if (!lcd_dirty(self, row, col)) {
+                col++;
+                continue;
+            }
+            int end = col + 1;
+            for (;;) {
+                int next = end;
+                while (next < self->cols && !lcd_dirty(self, row, next))
+                    next++;
+                if (next >= self->cols || next - end > LCD_JUMP_COST)
+                    break;
+                end = next + 1;
+            }
+            if (lcd_tx_full(self, 1 + end - col))
+                return;
+            int addr = lcd_addr(self, row, col);
+            if (self->ac[c] != addr)
+                lcd_send_byte(
+                    self, 0, CMD_SET_DDRAM_ADDR | (addr % LCD_DDRAM_SIZE));
+            lcd_put_cells(self, row, col, end);
+            col = end;
+        }
+    }
+}
+
+/*============================================================================
+
+  lcd_flush_fb
+
+  Send the changes in the framebuffer. The module may still be
+  executing the last instruction when this returns; ready_at says when
+  it will have finished.
+
+  In non-blocking mode, the framebuffer is only marked as changed.
+  lcd_step() works out what to send once the output before it has
+  gone, so changes that are made while the bus is busy are merged, as
+  they are by the render thread.
+
+============================================================================*/
+static void lcd_flush_fb(LCD *self) {
+    if (!self->transport && !self->gpio)
+        return;
+    if (self->nonblocking) {
+        self->stale = 1;
+        lcd_arm(self);
+        return;
+    }
+    self->sending = 1;
+    lcd_encode_fb(self);
+    self->sending = 0;
+    lcd_tx_flush(self);
+}
+
+/*============================================================================
+
+  lcd_encode_stale
+
+  Queue the changes that lcd_flush_fb() has left for lcd_step(), for
+  output that has to follow them. They must all be queued first, so
+  if the transmit buffer fills up, it is flushed -- which is the only
+  time that non-blocking mode blocks, and only for an operation that
+  comes while a buffer's worth of output is still waiting to go.
+
+============================================================================*/
+static void lcd_encode_stale(LCD *self) {
+    while (self->stale) {
+        self->stale = 0;
+        lcd_encode_fb(self);
+        if (self->stale)
+            lcd_tx_flush(self);
+    }
+}
+
+/*============================================================================
+
+  lcd_send_mode
+
+  Send the mode to every controller. Only the one with the cursor gets
+  the cursor flags; the other just gets the display turned on or off.
+
+============================================================================*/
+static void lcd_send_mode(LCD *self) {
+    for (int c = 0; c < self->controllers; c++) {
+        unsigned char mode = self->mode;
+        if (c != self->cursor_ctrl)
+            mode &= LCD_MODE_DISPLAY_ON;
+        self->ctrl = c;
+        lcd_send_byte(self, 0, CMD_CTRL | mode);
+    }
+}
+
+/*============================================================================
+
+  lcd_do_set_cursor
+
+  If the cursor moves to the other controller of a 40x4 display, the
+  cursor flags move with it.
+
+============================================================================*/
+static void lcd_do_set_cursor(LCD *self, int row, int col) {
+    lcd_flush_fb(self);
+    lcd_encode_stale(self);
+    int addr = lcd_addr(self, row, col);
+    int c = self->row_ctrl[row];
+    self->ctrl = c;
+    lcd_send_byte(self, 0, CMD_SET_DDRAM_ADDR | (addr % LCD_DDRAM_SIZE));
+    self->ac[c] = addr;
+    if (c != self->cursor_ctrl) {
+        self->cursor_ctrl = c;
+        lcd_send_mode(self);
+    }
+    lcd_tx_send(self);
+}
+
+/*============================================================================
+
+  lcd_marquee_fill
+
+  Put the part of a marquee's text that should be showing into the
+  framebuffer.
+
+============================================================================*/
+static void lcd_marquee_fill(LCD *self, int row) {
+    LCD_MARQUEE *m = self->marquee;
+    unsigned char *fb = self->fb + row * self->cols;
+    for (int col = 0; col < self->cols; col++)
+        fb[col] = m->text[row][(m->pos[row] + col) % m->len[row]];
+}
+
+/*============================================================================
+
+  lcd_do_set_marquee
+
+  Take over text, which has been allocated for us.
+
+============================================================================*/
+static void lcd_do_set_marquee(LCD *self, int row, unsigned char *text) {
+    if (!self->marquee) {
+        self->marquee = malloc(sizeof(LCD_MARQUEE));
+        memset(self->marquee, 0, sizeof(LCD_MARQUEE));
+    }
+    LCD_MARQUEE *m = self->marquee;
+    free(m->text[row]);
+    m->text[row] = text;
+    m->len[row] = text ? strlen((char *)text) : 0;
+    m->pos[row] = 0;
+    if (text)
+        lcd_marquee_fill(self, row);
+}
+
+/*============================================================================
+
+  lcd_do_marquee_step
+
+  Move the marquees along in the framebuffer. On a controller whose
+  rows can all move together, the display shift goes up by one too, so
+  that the text that's already in DDRAM lines up with the new contents
+  of the framebuffer.
+
+============================================================================*/
+static void lcd_do_marquee_step(LCD *self) {
+    LCD_MARQUEE *m = self->marquee;
+    if (!m)
+        return;
+    for (int c = 0; c < self->controllers; c++)
+        if (lcd_can_shift(self, c))
+            self->shift[c] = (self->shift[c] + 1) % LCD_LINE_LEN;
+    for (int row = 0; row < self->rows; row++) {
+        if (!m->text[row])
+            continue;
+        m->pos[row] = (m->pos[row] + 1) % m->len[row];
+        lcd_marquee_fill(self, row);
+    }
+}
+
+/*============================================================================
+
+  lcd_glyph_find
+
+  The index of a glyph in the table of definitions, or -1.
+
+============================================================================*/
+static int lcd_glyph_find(LCD_GLYPHS *g, int id) {
+    for (int d = 0; g && d < g->ndefs; d++)
+        if (g->defs[d].id == id)
+            return d;
+    return -1;
+}
+
+/*============================================================================
+
+  lcd_do_define_glyph
+
+  Add the glyph to the table, or change its bitmap. If it has a slot,
+  it keeps it, and the next flush sends whichever rows have changed.
+
+============================================================================*/
+static void lcd_do_define_glyph(LCD *self,
+                                int id,
+                                const unsigned char *bitmap,
+                                unsigned char fallback) {
+    LCD_GLYPHS *g = self->glyphs;
+    if (!g) {
+        g = self->glyphs = malloc(sizeof(LCD_GLYPHS));
+        memset(g, 0, sizeof(LCD_GLYPHS));
+        for (int s = 0; s < LCD_GLYPH_SLOTS; s++)
+            g->slot[s] = -1;
+        for (int i = 0; i < LCD_GLYPH_SLOTS * LCD_GLYPH_ROWS; i++)
+            for (int c = 0; c < LCD_MAX_CONTROLLERS; c++)
+                g->cgram[c][i] = -1;
+    }
+    int d = lcd_glyph_find(g, id);
+    if (d < 0) {
+        if (g->ndefs == g->size) {
+            g->size = g->size ? 2 * g->size : LCD_GLYPH_SLOTS;
+            g->defs = realloc(g->defs, g->size * sizeof(LCD_GLYPH));
+        }
+        d = g->ndefs++;
+        g->defs[d].id = id;
+    }
+    for (int r = 0; r < LCD_GLYPH_ROWS; r++)
+        g->defs[d].bitmap[r] = bitmap[r] & 0x1F;
+    g->defs[d].fallback = fallback;
+}
+
+/*============================================================================
+
+  lcd_glyph_slot
+
+  Find a CGRAM slot for a glyph. If it doesn't have one, it gets the
+  slot that is cheapest to take over: a slot isn't a candidate if its
+  character is in the framebuffer, and of the rest, we prefer one that
+  already holds the glyph's bitmap (so it needn't be sent again), then
+  one whose character isn't on the screen at all (so nothing changes
+  on the screen before the flush rewrites the cells), and then the one
+  least recently used. Returns -1 if every slot is in use.
+
+============================================================================*/
+static int lcd_glyph_slot(LCD *self, int d) {
+    LCD_GLYPHS *g = self->glyphs;
+    for (int s = 0; s < LCD_GLYPH_SLOTS; s++)
+        if (g->slot[s] == d)
+            return s;
+    unsigned in_fb = lcd_glyph_mask(self->fb, self->rows * self->cols);
+    unsigned in_ddram = 0;
+    for (int i = 0; i < self->controllers * LCD_DDRAM_SIZE; i++)
+        if (self->ddram[i] >= 0 && self->ddram[i] < 2 * LCD_GLYPH_SLOTS)
+            in_ddram |= 1u << (self->ddram[i] % LCD_GLYPH_SLOTS);
+
+    int best = -1;
+    int best_rank = 0;
+    for (int s = 0; s < LCD_GLYPH_SLOTS; s++) {
+        if (in_fb >> s & 1)
+            continue;
+        _Bool same = 1;
+        for (int c = 0; c < self->controllers; c++)
+            for (int r = 0; r < LCD_GLYPH_ROWS; r++)
+                if (g->cgram[c][s * LCD_GLYPH_ROWS + r] !=
+                    g->defs[d].bitmap[r])
+                    same = 0;
+        int rank = (same ? 0 : 2) + (in_ddram >> s & 1);
+        if (best < 0 || rank < best_rank ||
+            (rank == best_rank && g->used[s] < g->used[best])) {
+            best = s;
+            best_rank = rank;
+        }
+    }
+    if (best >= 0)
+        g->slot[best] = d;
+    return best;
+}
+
+/*============================================================================
+
+  lcd_do_write_glyph
+
+  Put a glyph's character code into the framebuffer, or its fallback if
+  it can't have a slot. The cell is given the fallback first, so that
+  whatever glyph it showed before can give up its slot.
+
+============================================================================*/
+static void lcd_do_write_glyph(LCD *self, int row, int col, int id) {
+    LCD_GLYPHS *g = self->glyphs;
+    int d = lcd_glyph_find(g, id);
+    if (d < 0)
+        return;
+    unsigned char *cell = self->fb + row * self->cols + col;
+    *cell = g->defs[d].fallback;
+    int s = lcd_glyph_slot(self, d);
+    if (s >= 0) {
+        *cell = s;
+        g->used[s] = ++g->clock;
+    }
+}
+
+/*============================================================================
+
+  lcd_do_set_mode
+
+  Pending changes to the framebuffer are sent first, so that text
+  written before the display is turned on (for example) doesn't appear
+  after it.
+
+============================================================================*/
+static void lcd_do_set_mode(LCD *self, unsigned char mode) {
+    lcd_flush_fb(self);
+    lcd_encode_stale(self);
+    self->mode = mode;
+    lcd_send_mode(self);
+    lcd_tx_send(self);
+}
+
+/*============================================================================
+
+  lcd_apply_op
+
+  Carry out an operation taken from the render thread's queue. Changes
+  to the framebuffer aren't sent here; the return value says whether
+  the caller should flush once it has applied everything that's queued.
+
+============================================================================*/
+static _Bool lcd_apply_op(LCD *self, const LCD_OP *op) {
+    switch (op->type) {
+    case LCD_OP_WRITE:
+        memcpy(self->fb + op->row * self->cols + op->col, op->text, op->len);
+        return !self->deferred;
+    case LCD_OP_CLEAR:
+        memset(self->fb, ' ', self->rows * self->cols);
+        return !self->deferred;
+    case LCD_OP_MODE:
+        lcd_do_set_mode(self, op->mode);
+        return 0;
+    case LCD_OP_CURSOR:
+        lcd_do_set_cursor(self, op->row, op->col);
+        return 0;
+    case LCD_OP_FLUSH:
+        return 1;
+    case LCD_OP_MARQUEE:
+        lcd_do_set_marquee(self, op->row, op->data);
+        return !self->deferred;
+    case LCD_OP_STEP:
+        lcd_do_marquee_step(self);
+        return !self->deferred;
+    case LCD_OP_DEFINE:
+        lcd_do_define_glyph(self, op->id, op->text, op->mode);
+        return !self->deferred;
+    case LCD_OP_GLYPH:
+        lcd_do_write_glyph(self, op->row, op->col, op->id);
+        return !self->deferred;
+    }
+    return 0;
+}
+
+/*============================================================================
+
+  lcd_async_wake
+
+  Wake the render thread if it's asleep. The order of operations here
+  and in lcd_async_main matters: the producer publishes the new head
+  and then looks at the sleeping flag, and the render thread sets the
+  flag and then looks at the head, so at least one of them sees the
+  other's change.
+
+============================================================================*/
+static void lcd_async_wake(LCD_ASYNC *a) {
+    if (__atomic_load_n(&a->sleeping, __ATOMIC_SEQ_CST))
+        sem_post(&a->wake);
+}
+
+/*============================================================================
+
+  lcd_async_push
+
+  Add an operation to the render thread's queue. This is the producer
+  side of a single-producer, single-consumer ring: only this thread
+  writes the head, and only the render thread writes the tail, so no
+  locks are needed. If the ring is full, which only happens if the
+  caller produces operations faster than the render thread can even
+  copy them into the framebuffer, we have to wait for space.
+
+============================================================================*/
+static void lcd_async_push(LCD *self, const LCD_OP *op) {
+    LCD_ASYNC *a = self->async;
+    unsigned long head = a->head;
+    while (head - __atomic_load_n(&a->tail, __ATOMIC_ACQUIRE) ==
+           LCD_ASYNC_QUEUE) {
+        sem_post(&a->wake);
+        sched_yield();
+    }
+    a->ops[head & (LCD_ASYNC_QUEUE - 1)] = *op;
+    __atomic_store_n(&a->head, head + 1, __ATOMIC_SEQ_CST);
+    lcd_async_wake(a);
+}
+
+/*============================================================================
+
+  lcd_async_main
+
+  The render thread. It takes everything that's in the queue, applies it
+  to the framebuffer, and then does a single flush. While that flush is
+  on the wire, more operations pile up in the queue, and they are all
+  applied before the next flush -- so if a cell is written several
+  times while the bus is busy, only the last value is ever sent.
+
+============================================================================*/
+static void *lcd_async_main(void *arg) {
+    LCD *self = arg;
+    LCD_ASYNC *a = self->async;
+    unsigned long tail = a->tail;
+    for (;;) {
+        unsigned long head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            if (__atomic_load_n(&a->stop, __ATOMIC_ACQUIRE))
+                break;
+            __atomic_store_n(&a->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&a->head, __ATOMIC_SEQ_CST) == tail &&
+                !__atomic_load_n(&a->stop, __ATOMIC_SEQ_CST))
+                sem_wait(&a->wake);
+            __atomic_store_n(&a->sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        _Bool flush = 0;
+        while (tail != head) {
+            if (lcd_apply_op(self, &a->ops[tail & (LCD_ASYNC_QUEUE - 1)]))
+                flush = 1;
+            tail++;
+            __atomic_store_n(&a->tail, tail, __ATOMIC_RELEASE);
+            if (tail == head)
+                head = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+        }
+        if (flush)
+            lcd_flush_fb(self);
+        __atomic_store_n(&a->done, tail, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&a->waiters, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&a->lock);
+            pthread_cond_broadcast(&a->cond);
+            pthread_mutex_unlock(&a->lock);
+        }
+    }
+    return NULL;
+}
+
+/*============================================================================
+
+  lcd_dispatch
+
+  Carry out one operation: queue it for the render thread if that's
+  running, or apply it here. Returns whether a flush is needed, as
+  lcd_apply_op() does.
+
+============================================================================*/
+static _Bool lcd_dispatch(LCD *self, const LCD_OP *op) {
+    if (self->async) {
+        lcd_async_push(self, op);
+        return 0;
+    }
+    return lcd_apply_op(self, op);
+}
+
+/*============================================================================
+
+  lcd_combine
+
+  Carry out every request that's waiting, with the combiner lock held.
+  The waiting requests are taken all at once, applied to the
+  framebuffer in the order they were made, and sent with a single
+  flush -- so the threads that queued up while the last flush was on
+  the wire share the next one, and if they wrote the same cells, only
+  the last values are sent. Requests that arrive meanwhile are dealt
+  with in the same way, before the lock is given up.
+
+============================================================================*/
+static void lcd_combine(LCD *self) {
+    LCD_COMBINER *k = self->combiner;
+    LCD_REQUEST *list;
+    while ((list = __atomic_exchange_n(&k->pending, NULL, __ATOMIC_ACQUIRE))) {
+        // The list is newest first, so turn it round
+        LCD_REQUEST *first = NULL;
+        while (list) {
+            LCD_REQUEST *next = list->next;
+            list->next = first;
+            first = list;
+            list = next;
+        }
+        _Bool flush = 0;
+        for (LCD_REQUEST *r = first; r; r = r->next)
+            for (int i = 0; i < r->n; i++)
+                if (lcd_dispatch(self, &r->ops[i]))
+                    flush = 1;
+        if (flush)
+            lcd_flush_fb(self);
+        // The requests belong to their threads as soon as they're done
+        while (first) {
+            LCD_REQUEST *next = first->next;
+            __atomic_store_n(&first->done, 1, __ATOMIC_SEQ_CST);
+            first = next;
+        }
+        if (__atomic_load_n(&k->waiters, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&k->wait_lock);
+            pthread_cond_broadcast(&k->cond);
+            pthread_mutex_unlock(&k->wait_lock);
+        }
+    }
+}
+
+/*============================================================================
+
+  lcd_release
+
+  Give up the combiner lock, and wake any threads that are waiting for
+  it. A waiter counts itself before it looks at busy, and we clear busy
+  before we look at the count, so either it sees the lock free or we
+  see it waiting.
+
+============================================================================*/
+static void lcd_release(LCD *self) {
+    LCD_COMBINER *k = self->combiner;
+    __atomic_store_n(&k->busy, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&k->lock);
+    if (__atomic_load_n(&k->waiters, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&k->wait_lock);
+        pthread_cond_broadcast(&k->cond);
+        pthread_mutex_unlock(&k->wait_lock);
+    }
+}
+
+/*============================================================================
+
+  lcd_acquire
+
+  Take the combiner lock, waiting if necessary, and carry out whatever
+  is waiting -- for methods that need the framebuffer and the transmit
+  queue to themselves.
+
+============================================================================*/
+static void lcd_acquire(LCD *self) {
+    LCD_COMBINER *k = self->combiner;
+    pthread_mutex_lock(&k->lock);
+    __atomic_store_n(&k->busy, 1, __ATOMIC_SEQ_CST);
+    lcd_combine(self);
+}
+
+/*============================================================================
+
+  lcd_submit
+
+  Carry out n operations, as one request, on behalf of the calling
+  thread, and return when they're done. The request goes on the
+  pending list, and then, if no other thread is the combiner, this one
+  becomes it; otherwise it waits for the combiner to get round to it.
+  With a single thread, this costs an exchange and an uncontended lock.
+
+============================================================================*/
+static void lcd_submit(LCD *self, const LCD_OP *ops, int n) {
+    LCD_COMBINER *k = self->combiner;
+    LCD_REQUEST req;
+    req.ops = ops;
+    req.n = n;
+    req.done = 0;
+    req.next = __atomic_load_n(&k->pending, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&k->pending,
+                                        &req.next,
+                                        &req,
+                                        1,
+                                        __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+    for (;;) {
+        if (pthread_mutex_trylock(&k->lock) == 0) {
+            __atomic_store_n(&k->busy, 1, __ATOMIC_SEQ_CST);
+            lcd_combine(self);
+            lcd_release(self);
+            return;
+        }
+        pthread_mutex_lock(&k->wait_lock);
+        __atomic_add_fetch(&k->waiters, 1, __ATOMIC_SEQ_CST);
+        _Bool done;
+        while (!(done = __atomic_load_n(&req.done, __ATOMIC_SEQ_CST)) &&
+               __atomic_load_n(&k->busy, __ATOMIC_SEQ_CST))
+            pthread_cond_wait(&k->cond, &k->wait_lock);
+        __atomic_sub_fetch(&k->waiters, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&k->wait_lock);
+        if (done)
+            return;
+    }
+}
+
+/*============================================================================
+
+  lcd_submit_simple
+
+  Carry out an operation that doesn't carry any text.
+
+============================================================================*/
+static void lcd_submit_simple(LCD *self, int type, int row, int col, int mode) {
+    LCD_OP op;
+    op.type = type;
+    op.row = row;
+    op.col = col;
+    op.mode = mode;
+    op.len = 0;
+    op.data = NULL;
+    lcd_submit(self, &op, 1);
+}
+
+/*============================================================================
+
+  lcd_write_char_at
+
+  Put the character into the framebuffer, and send it unless output
+  is deferred.
+
+============================================================================*/
+void lcd_write_char_at(LCD *self, int row, int col, unsigned char c) {
+    if (row >= 0 && row < self->rows && col >= 0 && col < self->cols) {
+        LCD_OP op;
+        op.type = LCD_OP_WRITE;
+        op.row = row;
+        op.col = col;
+        op.len = 1;
+        op.text[0] = c;
+        lcd_submit(self, &op, 1);
+    }
+}
+
+/*============================================================================
+
+  lcd_write_string_at
+
+  Write a whole string into the framebuffer, wrapping if necessary, and
+  send it unless output is deferred. Only the characters that differ
+  from what is already on the screen are actually sent. The string is
+  handled a row at a time, because the rows are the largest pieces that
+  are contiguous in the framebuffer, and the rows go as one request, so
+  another thread's writes can't come between them.
+
+============================================================================*/
+void lcd_write_string_at(LCD *self,
+                             int row,
+                             int col,
+                             const unsigned char *s,
+                             _Bool wrap) {
+    LCD_OP ops[LCD_OP_STRING_MAX];
+    int n = 0;
+    if (row >= 0 && row < self->rows && col >= 0 && col < self->cols) {
+        while (*s && row < self->rows) {
+            int len = 0;
+            while (s[len] && col + len < self->cols)
+                len++;
+            // Rows wider than an operation go in pieces
+            while (len > 0) {
+                LCD_OP *op = &ops[n++];
+                op->type = LCD_OP_WRITE;
+                op->row = row;
+                op->col = col;
+                op->len = len < LCD_OP_TEXT ? len : LCD_OP_TEXT;
+                memcpy(op->text, s, op->len);
+                s += op->len;
+                col += op->len;
+                len -= op->len;
+            }
+            if (!wrap)
+                break;
+            row++;
+            col = 0;
+        }
+        if (n > 0)
+            lcd_submit(self, ops, n);
+    }
+}
+
+/*============================================================================
+
+  lcd_clear
+
+  Fill the framebuffer with spaces. When it's flushed, lcd_flush decides
+  whether it's cheaper to send the clear command or to overwrite the
+  characters that are on the screen.
+
+============================================================================*/
+void lcd_clear(LCD *self) {
+    lcd_submit_simple(self, LCD_OP_CLEAR, 0, 0, 0);
+}
+
+/*============================================================================
+
+  lcd_set_marquee
+
+  The text is copied here, in the caller's thread, and the copy is
+  handed over with the operation.
+
+============================================================================*/
+void lcd_set_marquee(LCD *self, int row, const unsigned char *text) {
+    assert(self != NULL);
+    if (row < 0 || row >= self->rows)
+        return;
+    unsigned char *copy = text && *text ? (unsigned char *)strdup(
+                                              (const char *)text)
+                                        : NULL;
+    LCD_OP op;
+    memset(&op, 0, sizeof(op));
+    op.type = LCD_OP_MARQUEE;
+    op.row = row;
+    op.data = copy;
+    lcd_submit(self, &op, 1);
+}
+
+/*============================================================================
+  lcd_marquee_step
+============================================================================*/
+void lcd_marquee_step(LCD *self) {
+    assert(self != NULL);
+    lcd_submit_simple(self, LCD_OP_STEP, 0, 0, 0);
+}
+
+/*============================================================================
+  lcd_define_glyph
+============================================================================*/
+void lcd_define_glyph(LCD *self,
+                      int id,
+                      const unsigned char bitmap[8],
+                      unsigned char fallback) {
+    assert(self != NULL);
+    assert(bitmap != NULL);
+    LCD_OP op;
+    memset(&op, 0, sizeof(op));
+    op.type = LCD_OP_DEFINE;
+    op.id = id;
+    op.mode = fallback;
+    memcpy(op.text, bitmap, LCD_GLYPH_ROWS);
+    lcd_submit(self, &op, 1);
+}
+
+/*============================================================================
+  lcd_write_glyph_at
+============================================================================*/
+void lcd_write_glyph_at(LCD *self, int row, int col, int id) {
+    assert(self != NULL);
+    if (row < 0 || row >= self->rows || col < 0 || col >= self->cols)
+        return;
+    LCD_OP op;
+    memset(&op, 0, sizeof(op));
+    op.type = LCD_OP_GLYPH;
+    op.row = row;
+    op.col = col;
+    op.id = id;
+    lcd_submit(self, &op, 1);
+}
+
+/*============================================================================
+
+  lcd_write_cells
+
+  Each cell is one operation, or two if it defines a glyph, and they all
+  go in one request. A request that doesn't fit in the array on the
+  stack gets one from the heap.
+
+============================================================================*/
+void lcd_write_cells(LCD *self, const LCD_CELL *cells, int n) {
+    assert(self != NULL);
+    assert(n == 0 || cells != NULL);
+    LCD_OP stack_ops[LCD_OP_CELLS_MAX];
+    LCD_OP *ops = n <= LCD_OP_CELLS_MAX / 2 ? stack_ops
+                                            : malloc(2 * n * sizeof(LCD_OP));
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        const LCD_CELL *cell = &cells[i];
+        if (cell->glyph && cell->bitmap) {
+            LCD_OP *op = &ops[count++];
+            memset(op, 0, sizeof(LCD_OP));
+            op->type = LCD_OP_DEFINE;
+            op->id = cell->id;
+            op->mode = cell->c;
+            memcpy(op->text, cell->bitmap, LCD_GLYPH_ROWS);
+        }
+        if (cell->row < 0 || cell->row >= self->rows || cell->col < 0 ||
+            cell->col >= self->cols)
+            continue;
+        LCD_OP *op = &ops[count++];
+        memset(op, 0, sizeof(LCD_OP));
+        op->type = cell->glyph ? LCD_OP_GLYPH : LCD_OP_WRITE;
+        op->row = cell->row;
+        op->col = cell->col;
+        op->id = cell->id;
+        op->len = 1;
+        op->text[0] = cell->c;
+    }
+    if (count > 0)
+        lcd_submit(self, ops, count);
+    if (ops != stack_ops)
+        free(ops);
+}
+
+/*============================================================================
+
+  lcd_flush
+
+============================================================================*/
+void lcd_flush(LCD *self) {
+    assert(self != NULL);
+    lcd_submit_simple(self, LCD_OP_FLUSH, 0, 0, 0);
+}
+
+/*============================================================================
+
+  lcd_set_cursor
+
+  The HD44780 has no specific "move cursor" instruction -- the cursor
+  just sits at the address counter. So any pending output is flushed,
+  and then the address counter is set to the cell.
+
+============================================================================*/
+void lcd_set_cursor(LCD *self, int row, int col) {
+    if (row >= 0 && row < self->rows && col >= 0 && col < self->cols)
+        lcd_submit_simple(self, LCD_OP_CURSOR, row, col, 0);
+}
+
+/*============================================================================
+  lcd_start_async
+============================================================================*/
+_Bool lcd_start_async(LCD *self, char **error) {
+    assert(self != NULL);
+    assert(self->async == NULL);
+    LCD_ASYNC *a = malloc(sizeof(LCD_ASYNC));
+    memset(a, 0, sizeof(LCD_ASYNC));
+    sem_init(&a->wake, 0, 0);
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->cond, NULL);
+    self->async = a;
+    errno = pthread_create(&a->thread, NULL, lcd_async_main, self);
+    if (errno != 0) {
+        err_msg("Can't start render thread", NULL, errno, error);
+        self->async = NULL;
+        sem_destroy(&a->wake);
+        pthread_mutex_destroy(&a->lock);
+        pthread_cond_destroy(&a->cond);
+        free(a);
+        return 0;
+    }
+    return 1;
+}
+
+/*============================================================================
+
+  lcd_sync
+
+  Wait until the render thread has dealt with everything queued so far.
+
+============================================================================*/
+void lcd_sync(LCD *self) {
+    assert(self != NULL);
+    LCD_ASYNC *a = self->async;
+    if (!a)
+        return;
+    unsigned long target = __atomic_load_n(&a->head, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&a->done, __ATOMIC_ACQUIRE) >= target)
+        return;
+    pthread_mutex_lock(&a->lock);
+    __atomic_add_fetch(&a->waiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&a->done, __ATOMIC_SEQ_CST) < target)
+        pthread_cond_wait(&a->cond, &a->lock);
+    __atomic_sub_fetch(&a->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*============================================================================
+
+  lcd_stop_async
+
+  Let the render thread finish what's queued, and then stop it.
+
+============================================================================*/
+void lcd_stop_async(LCD *self) {
+    assert(self != NULL);
+    LCD_ASYNC *a = self->async;
+    if (!a)
+        return;
+    __atomic_store_n(&a->stop, 1, __ATOMIC_SEQ_CST);
+    sem_post(&a->wake);
+    pthread_join(a->thread, NULL);
+    self->async = NULL;
+    sem_destroy(&a->wake);
+    pthread_mutex_destroy(&a->lock);
+    pthread_cond_destroy(&a->cond);
+    free(a);
+}
+
+/*============================================================================
+  lcd_encode
+============================================================================*/
+void lcd_encode(LCD *self) {
+    assert(self != NULL);
+    assert(self->async == NULL);
+    lcd_acquire(self);
+    lcd_encode_fb(self);
+    lcd_release(self);
+}
+
+/*============================================================================
+  lcd_pending
+============================================================================*/
+_Bool lcd_pending(LCD *self) {
+    assert(self != NULL);
+    return self->tx_len > 0;
+}
+
+/*============================================================================
+  lcd_send_next
+============================================================================*/
+long long lcd_send_next(LCD *self) {
+    assert(self != NULL);
+    if (self->gpio) {
+        lcd_tx_flush(self);
+    } else if (self->tx_len > 0) {
+        long hold = lcd_tx_segment(self, NULL);
+        lcd_set_ready(self, lcd_now(self), hold);
+    }
+    return self->ready_at;
+}
+
+/*============================================================================
+
+  lcd_send_next_all
+
+  Each display's segment becomes one message of a combined transaction.
+  We can't tell exactly when each message finished, only when the whole
+  transaction did. But the messages that followed a display's message
+  took at least as long as they would on a bus running at full speed,
+  so the display's wait can safely start that much before the end. This
+  keeps the displays from falling into step with each other, which
+  would leave the bus idle while they all wait at once.
+
+============================================================================*/
+void lcd_send_next_all(LCD *const *lcds, int n) {
+    LCD_TRANSPORT_MSG msgs[LCD_BATCH_MAX];
+    LCD *sent[LCD_BATCH_MAX];
+    long holds[LCD_BATCH_MAX];
+    while (n > 0) {
+        int count = 0;
+        for (; n > 0 && count < LCD_BATCH_MAX; lcds++, n--) {
+            LCD *self = *lcds;
+            assert(self->async == NULL);
+            assert(count == 0 || self->transport == sent[0]->transport);
+            int len;
+            if (self->tx_len == 0)
+                continue;
+            holds[count] = lcd_tx_take(self, &len, NULL);
+            msgs[count].addr = self->i2c_addr;
+            msgs[count].read = 0;
+            msgs[count].buf = self->tx_out;
+            msgs[count].len = len;
+            sent[count++] = self;
+        }
+        if (count == 0)
+            break;
+        LCD_TRANSPORT *transport = sent[0]->transport;
+        long long start = lcd_transport_now(transport);
+        _Bool ok = lcd_transport_transfer(transport, msgs, count);
+        long long end = lcd_transport_now(transport);
+        long long after = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            LCD *self = sent[i];
+            lcd_set_ready(self, end - after, holds[i]);
+            after += (msgs[i].len + 1) * (long long)lcd_byte_ns(self);
+            self->stats.io_ns += (end - start) / count;
+            self->stats.writes++;
+            self->stats.bytes += msgs[i].len;
+            if (!ok) {
+                self->stats.errors++;
+                self->stats.last_errno = errno;
+            }
+        }
+    }
+}
+
+/*============================================================================
+  lcd_ready_at
+============================================================================*/
+long long lcd_ready_at(LCD *self) {
+    assert(self != NULL);
+    return self->ready_at;
+}
+
+/*============================================================================
+
+  lcd_set_nonblocking
+
+  Output that's still waiting for lcd_step() is sent before leaving
+  non-blocking mode.
+
+============================================================================*/
+void lcd_set_nonblocking(LCD *self, _Bool nonblocking) {
+    assert(self != NULL);
+    assert(self->async == NULL);
+    lcd_acquire(self);
+    if (self->nonblocking && !nonblocking) {
+        lcd_encode_stale(self);
+        lcd_tx_flush(self);
+    }
+    self->nonblocking = nonblocking;
+    lcd_arm(self);
+    lcd_release(self);
+}
+
+/*============================================================================
+
+  lcd_poll_fd
+
+  The timerfd is made on the first call, and set from then on whenever
+  the deadline changes.
+
+============================================================================*/
+int lcd_poll_fd(LCD *self) {
+    assert(self != NULL);
+    lcd_acquire(self);
+    if (self->timer_fd < 0) {
+        self->timer_fd =
+            timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        self->armed_at = -1;
+        lcd_arm(self);
+    }
+    int fd = self->timer_fd;
+    lcd_release(self);
+    return fd;
+}
+
+/*============================================================================
+  lcd_next_deadline
+============================================================================*/
+long long lcd_next_deadline(LCD *self) {
+    assert(self != NULL);
+    lcd_acquire(self);
+    long long t = lcd_deadline(self);
+    lcd_release(self);
+    return t;
+}
+
+/*============================================================================
+
+  lcd_step
+
+  Send whatever is due. When the output queued before has all gone, the
+  framebuffer's latest changes are encoded, and sending carries on
+  until the module needs time. This never sleeps: the encoder stops
+  when the transmit buffer is full (see lcd_tx_full), rather than
+  flushing it.
+
+============================================================================*/
+long long lcd_step(LCD *self) {
+    assert(self != NULL);
+    assert(self->async == NULL);
+    lcd_acquire(self);
+    if (self->timer_fd >= 0) {
+        uint64_t expirations;
+        if (read(self->timer_fd, &expirations, sizeof(expirations)) > 0)
+            self->armed_at = -2; // It has expired, so it must be set again
+    }
+    for (;;) {
+        lcd_tx_send_due(self);
+        if (self->tx_len > 0 || !self->stale)
+            break;
+        // As much as fits; the rest stays stale for the next round
+        self->stale = 0;
+        lcd_encode_fb(self);
+    }
+    lcd_arm(self);
+    long long t = lcd_deadline(self);
+    lcd_release(self);
+    return t;
+}
+
+/*============================================================================
+  lcd_get_stats
+============================================================================*/
+void lcd_get_stats(LCD *self, LCD_STATS *stats) {
+    assert(self != NULL);
+    assert(stats != NULL);
+    lcd_sync(self);
+    lcd_acquire(self);
+    *stats = self->stats;
+    lcd_release(self);
+}
+
+/*============================================================================
+  lcd_reset_stats
+============================================================================*/
+void lcd_reset_stats(LCD *self) {
+    assert(self != NULL);
+    lcd_sync(self);
+    lcd_acquire(self);
+    memset(&self->stats, 0, sizeof(LCD_STATS));
+    lcd_release(self);
+}
+
+/*============================================================================
+
+  lcd_write_stats_textfile
+
+  Each counter in LCD_STATS becomes one metric, with a sample for each
+  display. Counters of nanoseconds are converted to seconds, which is
+  the Prometheus convention.
+
+============================================================================*/
+typedef struct LCD_METRIC {
+    const char *name;
+    const char *help;
+    size_t offset;
+    _Bool ns;
+} LCD_METRIC;
+
+static const LCD_METRIC lcd_metrics[] = {
+    {"transport_writes", "Transport write operations",
+     offsetof(LCD_STATS, writes), 0},
+    {"transport_reads", "Transport read operations",
+     offsetof(LCD_STATS, reads), 0},
+    {"transport_errors", "Transport operations that failed",
+     offsetof(LCD_STATS, errors), 0},
+    {"bytes", "PCF8574 output states written",
+     offsetof(LCD_STATS, bytes), 0},
+    {"commands", "HD44780 instructions sent",
+     offsetof(LCD_STATS, commands), 0},
+    {"data", "HD44780 data bytes sent", offsetof(LCD_STATS, data), 0},
+    {"address_jumps", "Set DDRAM address instructions sent",
+     offsetof(LCD_STATS, addr_jumps), 0},
+    {"glyph_rows", "Custom character bitmap rows sent",
+     offsetof(LCD_STATS, glyph_rows), 0},
+    {"flushes", "Framebuffer updates", offsetof(LCD_STATS, flushes), 0},
+    {"busy_polls", "Busy-flag reads", offsetof(LCD_STATS, polls), 0},
+    {"sleeps", "Waits for the module that needed a sleep",
+     offsetof(LCD_STATS, sleeps), 0},
+    {"sleep_seconds", "Time spent waiting for the module",
+     offsetof(LCD_STATS, sleep_ns), 1},
+    {"io_seconds", "Time spent in transport reads and writes",
+     offsetof(LCD_STATS, io_ns), 1},
+};
+
+static void lcd_write_label(FILE *f, const char *s) {
+    for (; *s; s++) {
+        if (*s == '\\' || *s == '"')
+            fputc('\\', f);
+        if (*s == '\n')
+            fputs("\\n", f);
+        else
+            fputc(*s, f);
+    }
+}
+
+_Bool lcd_write_stats_textfile(const char *path,
+                               LCD *const *lcds,
+                               const char *const *names,
+                               int count,
+                               char **error) {
+    assert(path != NULL);
+    assert(count == 0 || (lcds != NULL && names != NULL));
+    LCD_STATS *stats = malloc((count ? count : 1) * sizeof(LCD_STATS));
+    for (int i = 0; i < count; i++)
+        lcd_get_stats(lcds[i], &stats[i]);
+
+    size_t tmp_size = strlen(path) + 5;
+    char *tmp = malloc(tmp_size);
+    snprintf(tmp, tmp_size, "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    _Bool ok = f != NULL;
+    for (size_t m = 0;
+         ok && m < sizeof(lcd_metrics) / sizeof(lcd_metrics[0]);
+         m++) {
+        const LCD_METRIC *metric = &lcd_metrics[m];
+        fprintf(f,
+                "# HELP liblcd_%s_total %s.\n"
+                "# TYPE liblcd_%s_total counter\n",
+                metric->name,
+                metric->help,
+                metric->name);
+        for (int i = 0; i < count; i++) {
+            long long v =
+                *(long long *)((char *)&stats[i] + metric->offset);
+            fprintf(f, "liblcd_%s_total{display=\"", metric->name);
+            lcd_write_label(f, names[i]);
+            fprintf(f, "\",addr=\"0x%02x\"} ", lcds[i]->i2c_addr);
+            if (metric->ns)
+                fprintf(f, "%.9f\n", v / 1e9);
+            else
+                fprintf(f, "%lld\n", v);
+        }
+    }
+    if (f) {
+        ok = !ferror(f);
+        ok = fclose(f) == 0 && ok;
+    }
+    if (ok)
+        ok = rename(tmp, path) == 0;
+    if (!ok) {
+        err_msg("Can't write statistics file", NULL, errno, error);
+        unlink(tmp);
+    }
+    free(tmp);
+    free(stats);
+    return ok;
+}
+
+/*============================================================================
+  lcd_set_deferred
+============================================================================*/
+void lcd_set_deferred(LCD *self, _Bool deferred) {
+    assert(self != NULL);
+    self->deferred = deferred;
+}
+
+/*============================================================================
+  lcd_invalidate
+============================================================================*/
+void lcd_invalidate(LCD *self) {
+    assert(self != NULL);
+    for (int i = 0; i < LCD_MAX_CONTROLLERS * LCD_DDRAM_SIZE; i++)
+        self->ddram[i] = -1;
+    for (int c = 0; c < LCD_MAX_CONTROLLERS; c++) {
+        self->ac[c] = -1;
+        self->shift_sent[c] = -1;
+    }
+    if (self->glyphs)
+        for (int i = 0; i < LCD_GLYPH_SLOTS * LCD_GLYPH_ROWS; i++)
+            for (int c = 0; c < LCD_MAX_CONTROLLERS; c++)
+                self->glyphs->cgram[c][i] = -1;
+}
+
+/*============================================================================
+  lcd_set_timing_preset
+============================================================================*/
+void lcd_set_timing_preset(LCD *self, int preset) {
+    assert(self != NULL);
+    assert(preset == LCD_TIMING_CONSERVATIVE || preset == LCD_TIMING_DATASHEET);
+    self->timing = lcd_timing_presets[preset];
+}
+
+/*============================================================================
+  lcd_set_timing
+============================================================================*/
+void lcd_set_timing(LCD *self, const LCD_TIMING *timing) {
+    assert(self != NULL);
+    assert(timing->bus_hz > 0);
+    self->timing = *timing;
+}
+
+/*============================================================================
+  lcd_get_timing
+============================================================================*/
+void lcd_get_timing(LCD *self, LCD_TIMING *timing) {
+    assert(self != NULL);
+    *timing = self->timing;
+}
+
+/*============================================================================
+  lcd_get_timing_preset
+============================================================================*/
+void lcd_get_timing_preset(int preset, LCD_TIMING *timing) {
+    assert(preset == LCD_TIMING_CONSERVATIVE || preset == LCD_TIMING_DATASHEET);
+    assert(timing != NULL);
+    *timing = lcd_timing_presets[preset];
+}
+
+/*============================================================================
+  lcd_set_busy_poll
+============================================================================*/
+_Bool lcd_set_busy_poll(LCD *self, _Bool enable) {
+    assert(self != NULL);
+    if (enable && self->gpio)
+        return 0;
+    if (enable && self->transport &&
+        !lcd_transport_can_read(self->transport))
+        return 0;
+    if (enable && (self->pins.rw < 0 || self->controllers > 1))
+        return 0;
+    self->busy_poll = enable;
+    return 1;
+}
+
+/*============================================================================
+  lcd_set_warm_attach
+============================================================================*/
+void lcd_set_warm_attach(LCD *self, _Bool enable, const char *state_path) {
+    assert(self != NULL);
+    self->warm = enable;
+    free(self->state_path);
+    self->state_path = enable && state_path ? strdup(state_path) : NULL;
+}
+
+/*============================================================================
+  lcd_set_pins
+============================================================================*/
+void lcd_set_pins(LCD *self, const LCD_PCF8574_PINS *pins) {
+    assert(self != NULL);
+    assert(pins != NULL);
+    assert(pins->rs >= 0 && pins->rs < 8);
+    assert(pins->e >= 0 && pins->e < 8);
+    self->pins = *pins;
+    if (pins->rw < 0)
+        self->busy_poll = 0;
+    lcd_build_encoding(self);
+}
+
+/*============================================================================
+  lcd_get_pins
+============================================================================*/
+void lcd_get_pins(LCD *self, LCD_PCF8574_PINS *pins) {
+    assert(self != NULL);
+    assert(pins != NULL);
+    *pins = self->pins;
+}
+
+/*============================================================================
+
+  lcd_set_mode
+
+  Just send a "control register" command, with the mode bits specified
+  by the caller.
+
+============================================================================*/
+void lcd_set_mode(LCD *self, unsigned char mode) {
+    lcd_submit_simple(self, LCD_OP_MODE, 0, 0, mode);
+}
+
+/*============================================================================
+
+  lcd_reset
+
+  Send the sequence that puts the module into 4-bit mode (or 8-bit mode,
+  if all the data lines are wired) whatever state it was in before.
+
+  After power-on, the datasheet requires long waits between the steps.
+  For a warm attach, we assume that the module has been initialized
+  already, and is in 4-bit mode -- but perhaps half-way through a byte,
+  if the last program to use it was interrupted. The same sequence
+  gets it back in step, and only the ordinary execution times are
+  needed. The exception is the first step: if it completes a byte, that
+  byte is something-and-3, which could be "return home", so it gets the
+  time that instruction needs.
+
+============================================================================*/
+static void lcd_reset(LCD *self, _Bool warm) {
+    const LCD_TIMING *t = &self->timing;
+    long first = warm ? t->clear_ns : t->reset1_ns;
+    long next = warm ? t->exec_ns : t->reset2_ns;
+    if (!warm)
+        self->ready_at = lcd_now(self) + t->power_on_ns;
+
+    // Now... this is all a bit nasty...
+    // We need to set 4-bit mode, but the LCD module powers up in
+    //  eight bit mode. We can't be sure this is the first program
+    //  to use the LCD since power-up, so we don't know what
+    //  mode it's in. And we need to issue a command to set 4-bit
+    //  mode -- without knowing what mode we're in. So first we have
+    //  to enable 8-bit mode and then, knowing we're in 8-bit mode,
+    //  we must set 4-bit mode. Setting 8-bit mode without knowing the
+    //  current mode can be accomplished by sending the mode-setting
+    //  command as three identical 4-bit commands. If we start in
+    //  8-bit mode, some of these commands are gibberish 8-bit
+    //  commands with four of their bits set wrongly. But there's still
+    //  enough coherence for the module to get the message with thi
+    //  command sequence. This method of setting the mode is widely
+    //  used, even though it isn't documented, and it seems to work OK.
+
+    // set 8-bit mode by sending 4-bit cmds 3 times in a row. The datasheet
+    //  gives the waits needed after each one. If all eight data lines
+    //  are wired, these are ordinary 8-bit commands.
+    unsigned char func = CMD_FUNC | LCD_FUNC_DL;
+    unsigned char data = self->eight_bit ? func : func >> 4;
+    lcd_strobe(self, 0, data, first);
+    lcd_strobe(self, 0, data, next);
+    lcd_strobe(self, 0, data, next);
+
+    // set 4-bit mode, unless all eight data lines are wired
+    if (!self->eight_bit) {
+        func = CMD_FUNC | 0;
+        lcd_strobe(self, 0, func >> 4, next);
+    }
+    lcd_tx_flush(self);
+    // From now on, the busy flag can be read
+    self->synced = 1;
+}
+
+/*============================================================================
+
+  lcd_load_state
+
+  Read the DDRAM contents saved by lcd_save_state, and put them in the
+  framebuffer too. Returns 0 if there's no state file, or it doesn't
+  match this display -- and then we don't know what's on the screen.
+
+============================================================================*/
+static _Bool lcd_load_state(LCD *self) {
+    FILE *f = fopen(self->state_path, "rb");
+    if (!f)
+        return 0;
+    char magic[sizeof(LCD_STATE_MAGIC)];
+    int geometry[2];
+    int shift[LCD_MAX_CONTROLLERS];
+    short ddram[LCD_MAX_CONTROLLERS * LCD_DDRAM_SIZE];
+    _Bool ok = fread(magic, sizeof(magic), 1, f) == 1 &&
+               memcmp(magic, LCD_STATE_MAGIC, sizeof(magic)) == 0 &&
+               fread(geometry, sizeof(geometry), 1, f) == 1 &&
+               geometry[0] == self->rows && geometry[1] == self->cols &&
+               fread(shift, sizeof(shift), 1, f) == 1 &&
+               fread(ddram, sizeof(ddram), 1, f) == 1;
+    fclose(f);
+    // The state is only good until the display is written again by
+    //  someone else, so it's used once
+    unlink(self->state_path);
+    if (!ok)
+        return 0;
+    // Leave the screen as it is, until the caller changes it. The
+    //  resync in lcd_reset() may have completed a "return home", so the
+    //  controller's shift isn't known: it's put back as it was, with
+    //  home and the shift instructions, at the first flush
+    memcpy(self->ddram, ddram, sizeof(ddram));
+    for (int c = 0; c < LCD_MAX_CONTROLLERS; c++) {
+        self->shift_sent[c] = -1;
+        self->shift[c] = shift[c] < 0 ? 0 : shift[c] % LCD_LINE_LEN;
+    }
+    for (int row = 0; row < self->rows; row++) {
+        for (int col = 0; col < self->cols; col++) {
+            short c = ddram[lcd_addr(self, row, col)];
+            if (c >= 0)
+                self->fb[row * self->cols + col] = (unsigned char)c;
+        }
+    }
+    return 1;
+}
+
+/*============================================================================
+
+  lcd_save_state
+
+  Write the display shift, and what we think is in DDRAM, to the state
+  file, so the next warm attach knows what's on the screen. The file is
+  written under another name and renamed, so a reader never sees half
+  of it. Errors are ignored: the worst that can happen is a cold start
+  next time.
+
+============================================================================*/
+static void lcd_save_state(LCD *self) {
+    size_t size = strlen(self->state_path) + 5;
+    char *tmp = malloc(size);
+    snprintf(tmp, size, "%s.tmp", self->state_path);
+    FILE *f = fopen(tmp, "wb");
+    if (f) {
+        int geometry[2] = {self->rows, self->cols};
+        _Bool ok = fwrite(LCD_STATE_MAGIC, sizeof(LCD_STATE_MAGIC), 1, f) &&
+                   fwrite(geometry, sizeof(geometry), 1, f) &&
+                   fwrite(self->shift_sent, sizeof(self->shift_sent), 1, f) &&
+                   fwrite(self->ddram, sizeof(self->ddram), 1, f);
+        if (fclose(f) == 0 && ok)
+            rename(tmp, self->state_path);
+        else
+            unlink(tmp);
+    }
+    free(tmp);
+}
+
+/*============================================================================
+
+  lcd_init_module
+
+  Initialize the module, and then clear the display -- or, for a warm
+  attach, resynchronize with a module that is already running, and find
+  out what's on the screen if we can.
+
+  A warm attach falls back to the full sequence if there's a state file
+  path but no state file, since then we don't know that the module was
+  ever initialized, or if the busy flag can be read but never clears.
+
+============================================================================*/
+static void lcd_init_module(LCD *self) {
+    lcd_build_encoding(self);
+    lcd_invalidate(self);
+    // Everything up to the display mode goes to both controllers at once
+    self->ctrl = -1;
+    self->cursor_ctrl = 0;
+    _Bool warm = self->warm;
+    if (warm && self->state_path)
+        warm = lcd_load_state(self);
+    if (warm) {
+        lcd_reset(self, 1);
+        if (self->busy_poll && !lcd_wait_ready(self, self->timing.exec_ns))
+            warm = 0;
+    }
+    if (!warm)
+        lcd_reset(self, 0);
+
+    unsigned char func;
+
+    // Set more than one row (the LCD only has two line modes,
+    //  "one" or "more that one")
+    func = CMD_FUNC | LCD_FUNC_N | (self->eight_bit ? LCD_FUNC_DL : 0);
+    // NB -- in 4-bit mode, send_byte sends two 4-bit commands in a row
+    lcd_send_byte(self, 0, func);
+
+    // Clear display. Whatever is in the framebuffer will be written
+    //  by the first flush. After a warm attach, the screen is left as
+    //  it is, and the first flush decides whether a clear is worthwhile
+    if (!warm)
+        lcd_send_clear(self);
+    lcd_do_set_mode(self, LCD_MODE_DISPLAY_ON);
+
+    // We might want to set the cursor and shift modes -- but, honestly,
+    //   it's more likely that the user of this class will take care of
+    //   these things.
+    // lcd_send_byte (self, 0, CMD_ENTRY | LCD_ENTRY_ID);
+    // lcd_send_byte (self, 0, CMD_CDSHIFT | LCD_CDSHIFT_RL);
+
+    self->ready = 1;
+}
+
+/*============================================================================
+
+  lcd_init_transport
+
+  Initialize the display module, using a transport supplied by the caller
+
+============================================================================*/
+_Bool lcd_init_transport(LCD *self, LCD_TRANSPORT *transport, char **error) {
+    assert(self != NULL);
+    assert(transport != NULL);
+    self->transport = transport;
+    self->owns_transport = 0;
+    self->eight_bit = 0;
+    if (!lcd_transport_can_read(transport) || self->pins.rw < 0)
+        self->busy_poll = 0;
+    if (self->controllers > 1 && self->pins.e2 < 0) {
+        errno = EINVAL;
+        err_msg("No E pin for the second controller", NULL, errno, error);
+        self->transport = NULL;
+        return 0;
+    }
+
+    // Set all output PCF8574 lines to zero, because we don't really
+    // know how they will power up. This is also the first time we find
+    // out whether there's anything at the I2C address we were given.
+    unsigned char c = 0;
+    if (!lcd_write(self, &c, 1)) {
+        err_msg("Can't write to I2C device", NULL, errno, error);
+        self->transport = NULL;
+        return 0;
+    }
+    lcd_init_module(self);
+    return 1;
+}
+
+/*============================================================================
+
+  lcd_init
+
+  Initialize the display module on a /dev/i2c-x device, using the
+  default i2c-dev transport, which this object owns.
+
+============================================================================*/
+_Bool lcd_init(char *dev, LCD *self, char **error) {
+    assert(self != NULL);
+    LCD_TRANSPORT *transport = lcd_transport_i2c_auto_create(dev, error);
+    if (!transport)
+        return 0;
+    if (!lcd_init_transport(self, transport, error)) {
+        lcd_transport_destroy(transport);
+        return 0;
+    }
+    self->owns_transport = 1;
+    return 1;
+}
+
+/*============================================================================
+
+  lcd_init_gpio_lines
+
+  Initialize the display module, wired directly to GPIO lines supplied
+  by the caller.
+
+============================================================================*/
+_Bool lcd_init_gpio_lines(LCD *self,
+                          GPIO_LINES *lines,
+                          _Bool eight_bit,
+                          char **error) {
+    assert(self != NULL);
+    assert(lines != NULL);
+    int extra_e = self->controllers - 1;
+    if (lines->count != LCD_GPIO_DATA + (eight_bit ? 8 : 4) + extra_e) {
+        errno = EINVAL;
+        err_msg("Wrong number of GPIO lines", NULL, errno, error);
+        return 0;
+    }
+    self->gpio = lines;
+    self->owns_gpio = 0;
+    self->eight_bit = eight_bit;
+    self->busy_poll = 0;
+    // All lines low, which is where the request leaves them
+    if (!gpio_lines_set(lines, (1ULL << lines->count) - 1, 0, NULL)) {
+        err_msg("Can't set GPIO lines", NULL, errno, error);
+        self->gpio = NULL;
+        return 0;
+    }
+    lcd_init_module(self);
+    return 1;
+}
+
+/*============================================================================
+
+  lcd_init_gpio
+
+  Initialize the display module, wired directly to lines of a gpiochip,
+  which this object requests and owns.
+
+============================================================================*/
+_Bool lcd_init_gpio(LCD *self,
+                    const char *chip,
+                    const LCD_GPIO_PINS *pins,
+                    _Bool eight_bit,
+                    char **error) {
+    assert(self != NULL);
+    assert(chip != NULL);
+    assert(pins != NULL);
+    unsigned int offsets[LCD_GPIO_DATA + 8 + 1];
+    int count = 0;
+    offsets[count++] = pins->rs;
+    offsets[count++] = pins->e;
+    for (int i = eight_bit ? 0 : 4; i < 8; i++)
+        offsets[count++] = pins->d[i];
+    if (self->controllers > 1)
+        offsets[count++] = pins->e2;
+    GPIO_LINES *lines = gpio_lines_open(chip, offsets, count, "liblcd", error);
+    if (!lines)
+        return 0;
+    if (!lcd_init_gpio_lines(self, lines, eight_bit, error)) {
+        gpio_lines_destroy(lines);
+        return 0;
+    }
+    self->owns_gpio = 1;
+    return 1;
+}
+
+/*============================================================================
+  lcd_terminate
 ============================================================================*/
 void lcd_terminate(LCD *self) {
     assert(self != NULL);
-    if (self->fd >= 0)
-        close(self->fd);
+    lcd_stop_async(self);
+    if (self->ready && self->nonblocking) {
+        lcd_encode_stale(self);
+        lcd_tx_flush(self);
+    }
+    if (self->ready && self->state_path) {
+        lcd_tx_flush(self);
+        lcd_save_state(self);
+    }
+    // Leave the module ready for whatever uses it next
+    if (self->ready)
+        lcd_wait_until(self, self->ready_at);
+    if (self->transport && self->owns_transport)
+        lcd_transport_destroy(self->transport);
+    self->transport = NULL;
+    self->owns_transport = 0;
+    if (self->gpio && self->owns_gpio)
+        gpio_lines_destroy(self->gpio);
+    self->gpio = NULL;
+    self->owns_gpio = 0;
+    self->eight_bit = 0;
     self->ready = 0;
+    self->synced = 0;
 }
@@ -0,0 +1,279 @@
+/*==========================================================================
+
+    lcd_client.c
+
+    Implementation of the LCD_CLIENT "class" that is specified in
+    lcd_client.h.
+
+    The daemon's socket is a SOCK_SEQPACKET Unix socket. A client sends
+    the number of the display it wants, as an int, and gets back an
+    LCD_CLIENT_HELLO, with the shared memory and the daemon's eventfd
+    attached as SCM_RIGHTS. The connection stays open for as long as
+    the client holds the layer; when it closes -- even because the
+    client has died -- the daemon takes the layer back.
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/lcd_client.h"
+#include "../lib/err_msg.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+struct LCD_CLIENT {
+    int sock;
+    int event_fd;
+    LCD_CLIENT_SHM *shm;
+    LCD_CLIENT_LAYER *layer;
+};
+
+/*============================================================================
+
+  lcd_client_take_fds
+
+  Collect the descriptors that came with a message, into fds if there
+  is room, and close the rest. Returns how many there were. other is
+  set if anything other than SCM_RIGHTS was attached.
+
+============================================================================*/
+static int
+lcd_client_take_fds(struct msghdr *msg, int *fds, int max, _Bool *other) {
+    int count = 0;
+    *other = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg;
+         cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            *other = 1;
+            continue;
+        }
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (count < max)
+                fds[count] = fd;
+            else
+                close(fd);
+            count++;
+        }
+    }
+    return count;
+}
+
+/*============================================================================
+
+  lcd_client_hello
+
+  Ask the daemon for a display, and receive the reply and its two
+  descriptors. Returns 0, or an errno value. Whatever goes wrong, no
+  descriptor that arrived with the reply is left open, apart from the
+  eventfd when it succeeds.
+
+============================================================================*/
+static int
+lcd_client_hello(LCD_CLIENT *self, int display, LCD_CLIENT_HELLO *hello) {
+    if (send(self->sock, &display, sizeof(display), 0) != sizeof(display))
+        return errno;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = {hello, sizeof(*hello)};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(self->sock, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0)
+        return errno;
+    int fds[2];
+    _Bool other;
+    int nfds = lcd_client_take_fds(&msg, fds, 2, &other);
+    int err = 0;
+    if (msg.msg_flags & MSG_CTRUNC || n != sizeof(*hello))
+        err = EPROTO;
+    else if (hello->status)
+        err = hello->status;
+    else if (nfds != 2 || other)
+        err = EPROTO;
+    if (err) {
+        for (int i = 0; i < nfds && i < 2; i++)
+            close(fds[i]);
+        return err;
+    }
+    self->event_fd = fds[1];
+    void *shm = mmap(NULL,
+                     sizeof(LCD_CLIENT_SHM),
+                     PROT_READ | PROT_WRITE,
+                     MAP_SHARED,
+                     fds[0],
+                     0);
+    err = shm == MAP_FAILED ? errno : 0;
+    close(fds[0]);
+    if (err)
+        return err;
+    self->shm = shm;
+    return 0;
+}
+
+/*============================================================================
+  lcd_client_open
+============================================================================*/
+LCD_CLIENT *lcd_client_open(const char *path, int display, char **error) {
+    if (!path)
+        path = LCD_CLIENT_SOCKET;
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        err_msg(path, NULL, ENAMETOOLONG, error);
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    LCD_CLIENT *self = malloc(sizeof(LCD_CLIENT));
+    memset(self, 0, sizeof(LCD_CLIENT));
+    self->event_fd = -1;
+    self->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (self->sock < 0 ||
+        connect(self->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        err_msg("Can't connect to lcdd", NULL, errno, error);
+        lcd_client_close(self);
+        return NULL;
+    }
+    LCD_CLIENT_HELLO hello;
+    int err = lcd_client_hello(self, display, &hello);
+    if (!err && (memcmp(self->shm->magic, LCD_CLIENT_MAGIC,
+                        sizeof(LCD_CLIENT_MAGIC)) != 0 ||
+                 hello.layer < 0 || hello.layer >= LCD_CLIENT_LAYERS))
+        err = EPROTO;
+    if (err) {
+        err_msg("Can't get a layer from lcdd", NULL, err, error);
+        lcd_client_close(self);
+        return NULL;
+    }
+    self->layer = &self->shm->layer[hello.layer];
+    return self;
+}
+
+/*============================================================================
+  lcd_client_close
+============================================================================*/
+void lcd_client_close(LCD_CLIENT *self) {
+    if (self) {
+        if (self->shm)
+            munmap(self->shm, sizeof(LCD_CLIENT_SHM));
+        if (self->event_fd >= 0)
+            close(self->event_fd);
+        if (self->sock >= 0)
+            close(self->sock);
+        free(self);
+    }
+}
+
+/*============================================================================
+  lcd_client_rows
+============================================================================*/
+int lcd_client_rows(const LCD_CLIENT *self) {
+    assert(self != NULL);
+    return self->shm->rows;
+}
+
+/*============================================================================
+  lcd_client_cols
+============================================================================*/
+int lcd_client_cols(const LCD_CLIENT *self) {
+    assert(self != NULL);
+    return self->shm->cols;
+}
+
+/*============================================================================
+
+  lcd_client_begin
+
+  Make the generation odd. The fence keeps the writes that follow from
+  being seen before it.
+
+============================================================================*/
+void lcd_client_begin(LCD_CLIENT *self) {
+    assert(self != NULL);
+    __atomic_store_n(&self->layer->gen,
+                     self->layer->gen | 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/*============================================================================
+  lcd_client_set_region
+============================================================================*/
+void lcd_client_set_region(
+    LCD_CLIENT *self, int row, int col, int rows, int cols, int z) {
+    assert(self != NULL);
+    LCD_CLIENT_LAYER *layer = self->layer;
+    layer->row = row;
+    layer->col = col;
+    layer->rows = rows;
+    layer->cols = cols;
+    layer->z = z;
+}
+
+/*============================================================================
+  lcd_client_set_visible
+============================================================================*/
+void lcd_client_set_visible(LCD_CLIENT *self, _Bool visible) {
+    assert(self != NULL);
+    self->layer->visible = visible;
+}
+
+/*============================================================================
+  lcd_client_write_string_at
+============================================================================*/
+void lcd_client_write_string_at(
+    LCD_CLIENT *self, int row, int col, const char *s) {
+    assert(self != NULL);
+    assert(s != NULL);
+    int cols = self->shm->cols;
+    if (row < 0 || row >= self->shm->rows || col < 0)
+        return;
+    unsigned char *cells = self->layer->cells + row * cols;
+    for (; *s && col < cols; s++, col++)
+        cells[col] = *s;
+}
+
+/*============================================================================
+  lcd_client_cells
+============================================================================*/
+unsigned char *lcd_client_cells(LCD_CLIENT *self) {
+    assert(self != NULL);
+    return self->layer->cells;
+}
+
+/*============================================================================
+
+  lcd_client_commit
+
+  Make the generation even again, after everything written since
+  lcd_client_begin(), and wake the daemon.
+
+============================================================================*/
+void lcd_client_commit(LCD_CLIENT *self) {
+    assert(self != NULL);
+    __atomic_store_n(&self->layer->gen,
+                     (self->layer->gen | 1) + 1,
+                     __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(self->event_fd, &one, sizeof(one)) < 0) {
+        // The counter can only overflow if the daemon has stopped
+        //  reading it, and then there's nobody to tell
+    }
+}
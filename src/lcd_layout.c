@@ -0,0 +1,340 @@
+/*==========================================================================
+
+    lcd_layout.c
+
+    Implementation of the LCD_LAYOUT "class" that is specified in
+    lcd_layout.h.
+
+    Each field keeps the text it last drew. Setting a value formats it
+    into a buffer on the stack -- numbers are converted digit by digit,
+    from the right -- and the span from the first to the last character
+    that differs from the old text is written to the display in one
+    call. The display's own framebuffer then sends only the cells in
+    that span that actually changed.
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/lcd_layout.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The widest field -- the widest row that an HD44780 can drive
+#define LCD_LAYOUT_MAX_WIDTH 40
+
+// Enough characters for the digits of any long, with a sign and a
+//  decimal point
+#define LCD_LAYOUT_NUM_MAX 24
+
+#define LCD_LAYOUT_TYPE_INT 0
+#define LCD_LAYOUT_TYPE_FIXED 1
+#define LCD_LAYOUT_TYPE_TIME 2
+#define LCD_LAYOUT_TYPE_STRING 3
+
+typedef struct LCD_LAYOUT_LABEL {
+    int row;
+    int col;
+    char *text;
+} LCD_LAYOUT_LABEL;
+
+typedef struct LCD_LAYOUT_FIELD {
+    int type;
+    int row;
+    int col;
+    int width;
+    int flags;
+    int decimals; // For fixed-point fields; the format, for time fields
+    _Bool drawn;  // shown is on the screen
+    char shown[LCD_LAYOUT_MAX_WIDTH];
+} LCD_LAYOUT_FIELD;
+
+struct LCD_LAYOUT {
+    LCD *lcd;
+    LCD_LAYOUT_LABEL *labels;
+    int nlabels;
+    int labels_size;
+    LCD_LAYOUT_FIELD *fields;
+    int nfields;
+    int fields_size;
+};
+
+/*============================================================================
+  lcd_layout_create
+============================================================================*/
+LCD_LAYOUT *lcd_layout_create(LCD *lcd) {
+    assert(lcd != NULL);
+    LCD_LAYOUT *self = malloc(sizeof(LCD_LAYOUT));
+    memset(self, 0, sizeof(LCD_LAYOUT));
+    self->lcd = lcd;
+    return self;
+}
+
+/*============================================================================
+  lcd_layout_destroy
+============================================================================*/
+void lcd_layout_destroy(LCD_LAYOUT *self) {
+    if (self) {
+        for (int i = 0; i < self->nlabels; i++)
+            free(self->labels[i].text);
+        free(self->labels);
+        free(self->fields);
+        free(self);
+    }
+}
+
+/*============================================================================
+  lcd_layout_label
+============================================================================*/
+void lcd_layout_label(LCD_LAYOUT *self, int row, int col, const char *text) {
+    assert(self != NULL);
+    assert(text != NULL);
+    if (self->nlabels == self->labels_size) {
+        self->labels_size = self->labels_size ? 2 * self->labels_size : 8;
+        self->labels = realloc(self->labels,
+                               self->labels_size * sizeof(LCD_LAYOUT_LABEL));
+    }
+    LCD_LAYOUT_LABEL *label = &self->labels[self->nlabels++];
+    label->row = row;
+    label->col = col;
+    label->text = strdup(text);
+    lcd_write_string_at(
+        self->lcd, row, col, (const unsigned char *)label->text, 0);
+}
+
+/*============================================================================
+
+  lcd_layout_add
+
+  Add a field of any type, and return its number.
+
+============================================================================*/
+static int lcd_layout_add(LCD_LAYOUT *self,
+                          int type,
+                          int row,
+                          int col,
+                          int width,
+                          int flags,
+                          int decimals) {
+    assert(self != NULL);
+    assert(width > 0 && width <= LCD_LAYOUT_MAX_WIDTH);
+    if (self->nfields == self->fields_size) {
+        self->fields_size = self->fields_size ? 2 * self->fields_size : 8;
+        self->fields = realloc(self->fields,
+                               self->fields_size * sizeof(LCD_LAYOUT_FIELD));
+    }
+    LCD_LAYOUT_FIELD *f = &self->fields[self->nfields];
+    memset(f, 0, sizeof(LCD_LAYOUT_FIELD));
+    f->type = type;
+    f->row = row;
+    f->col = col;
+    f->width = width;
+    f->flags = flags;
+    f->decimals = decimals;
+    memset(f->shown, ' ', width);
+    return self->nfields++;
+}
+
+/*============================================================================
+  lcd_layout_int
+============================================================================*/
+int lcd_layout_int(LCD_LAYOUT *self, int row, int col, int width, int flags) {
+    return lcd_layout_add(
+        self, LCD_LAYOUT_TYPE_INT, row, col, width, flags, 0);
+}
+
+/*============================================================================
+  lcd_layout_fixed
+============================================================================*/
+int lcd_layout_fixed(
+    LCD_LAYOUT *self, int row, int col, int width, int decimals, int flags) {
+    assert(decimals >= 0 && decimals < LCD_LAYOUT_NUM_MAX / 2);
+    return lcd_layout_add(
+        self, LCD_LAYOUT_TYPE_FIXED, row, col, width, flags, decimals);
+}
+
+/*============================================================================
+  lcd_layout_time
+============================================================================*/
+int lcd_layout_time(LCD_LAYOUT *self, int row, int col, int format) {
+    int width = format == LCD_LAYOUT_HMS ? 8 : 5;
+    return lcd_layout_add(
+        self, LCD_LAYOUT_TYPE_TIME, row, col, width, LCD_LAYOUT_LEFT, format);
+}
+
+/*============================================================================
+  lcd_layout_string
+============================================================================*/
+int lcd_layout_string(
+    LCD_LAYOUT *self, int row, int col, int width, int flags) {
+    return lcd_layout_add(
+        self, LCD_LAYOUT_TYPE_STRING, row, col, width, flags, 0);
+}
+
+/*============================================================================
+
+  lcd_layout_number
+
+  Write a number into the buffer that ends at end, working backwards,
+  with a decimal point before the last decimals digits, and zeros on
+  the left to make it at least min characters long. Returns the start.
+
+============================================================================*/
+static char *
+lcd_layout_number(char *end, long value, int decimals, int min) {
+    // Negate as unsigned, which works for LONG_MIN too
+    unsigned long v = value < 0 ? -(unsigned long)value : (unsigned long)value;
+    char *p = end;
+    int digits = 0;
+    do {
+        if (decimals && digits == decimals)
+            *--p = '.';
+        *--p = '0' + v % 10;
+        v /= 10;
+        digits++;
+    } while (v || digits <= decimals);
+    if (value < 0)
+        min--;
+    while (end - p < min)
+        *--p = '0';
+    if (value < 0)
+        *--p = '-';
+    return p;
+}
+
+/*============================================================================
+
+  lcd_layout_place
+
+  Put len characters into a field's text, aligned according to its
+  flags, or fill it with '#' if they don't fit -- or if s is NULL, for
+  a value that can't be shown.
+
+============================================================================*/
+static void lcd_layout_place(const LCD_LAYOUT_FIELD *f,
+                             const char *s,
+                             int len,
+                             char *text) {
+    if (!s || len > f->width) {
+        memset(text, '#', f->width);
+        return;
+    }
+    int left = f->width - len;
+    if (f->flags & LCD_LAYOUT_LEFT)
+        left = 0;
+    else if (f->flags & LCD_LAYOUT_CENTRE)
+        left /= 2;
+    memset(text, ' ', f->width);
+    memcpy(text + left, s, len);
+}
+
+/*============================================================================
+
+  lcd_layout_show
+
+  Bring the screen up to date with a field's new text.
+
+============================================================================*/
+static void lcd_layout_show(LCD_LAYOUT *self,
+                            LCD_LAYOUT_FIELD *f,
+                            const char *text) {
+    int first = 0;
+    int last = f->width - 1;
+    if (f->drawn) {
+        while (first <= last && text[first] == f->shown[first])
+            first++;
+        while (last >= first && text[last] == f->shown[last])
+            last--;
+        if (first > last)
+            return;
+    }
+    char span[LCD_LAYOUT_MAX_WIDTH + 1];
+    memcpy(span, text + first, last - first + 1);
+    span[last - first + 1] = 0;
+    memcpy(f->shown, text, f->width);
+    f->drawn = 1;
+    lcd_write_string_at(self->lcd,
+                        f->row,
+                        f->col + first,
+                        (const unsigned char *)span,
+                        0);
+}
+
+/*============================================================================
+
+  lcd_layout_set_int
+
+  Times are built from the right, as a chain of two-digit numbers
+  separated by colons; the leftmost holds whatever is left over, and
+  must fit in two digits too.
+
+============================================================================*/
+void lcd_layout_set_int(LCD_LAYOUT *self, int field, long value) {
+    assert(self != NULL);
+    assert(field >= 0 && field < self->nfields);
+    LCD_LAYOUT_FIELD *f = &self->fields[field];
+    char buf[LCD_LAYOUT_MAX_WIDTH + LCD_LAYOUT_NUM_MAX];
+    char *end = buf + sizeof(buf);
+    char *p;
+    if (f->type == LCD_LAYOUT_TYPE_TIME) {
+        int parts = f->decimals == LCD_LAYOUT_HMS ? 3 : 2;
+        long v = f->decimals == LCD_LAYOUT_HM ? value / 60 : value;
+        p = end;
+        for (int i = 0; i < parts; i++) {
+            long part = i < parts - 1 ? v % 60 : v;
+            if (part < 0 || part > 99) {
+                p = NULL;
+                break;
+            }
+            p = lcd_layout_number(p, part, 0, 2);
+            if (i < parts - 1)
+                *--p = ':';
+            v /= 60;
+        }
+    } else {
+        int min = 0;
+        if (f->flags & LCD_LAYOUT_ZERO)
+            min = f->width;
+        int decimals = f->type == LCD_LAYOUT_TYPE_FIXED ? f->decimals : 0;
+        p = lcd_layout_number(end, value, decimals, min);
+    }
+    char text[LCD_LAYOUT_MAX_WIDTH];
+    lcd_layout_place(f, p, p ? end - p : 0, text);
+    lcd_layout_show(self, f, text);
+}
+
+/*============================================================================
+  lcd_layout_set_string
+============================================================================*/
+void lcd_layout_set_string(LCD_LAYOUT *self, int field, const char *s) {
+    assert(self != NULL);
+    assert(field >= 0 && field < self->nfields);
+    assert(s != NULL);
+    LCD_LAYOUT_FIELD *f = &self->fields[field];
+    int len = 0;
+    while (len < f->width && s[len])
+        len++;
+    char text[LCD_LAYOUT_MAX_WIDTH];
+    lcd_layout_place(f, s, len, text);
+    lcd_layout_show(self, f, text);
+}
+
+/*============================================================================
+  lcd_layout_draw
+============================================================================*/
+void lcd_layout_draw(LCD_LAYOUT *self) {
+    assert(self != NULL);
+    for (int i = 0; i < self->nlabels; i++)
+        lcd_write_string_at(self->lcd,
+                            self->labels[i].row,
+                            self->labels[i].col,
+                            (const unsigned char *)self->labels[i].text,
+                            0);
+    for (int i = 0; i < self->nfields; i++) {
+        LCD_LAYOUT_FIELD *f = &self->fields[i];
+        char text[LCD_LAYOUT_MAX_WIDTH];
+        memcpy(text, f->shown, f->width);
+        f->drawn = 0;
+        lcd_layout_show(self, f, text);
+    }
+}
@@ -0,0 +1,345 @@
+/*==========================================================================
+
+    lcd_manager.c
+
+    Implementation of the LCD_MANAGER "class" that is specified in
+    lcd_manager.h.
+
+    Each bus has a worker that owns the bus's transport while a flush is
+    in progress. The worker repeatedly finds the displays on its bus that
+    have output waiting and whose controllers are ready for it, and sends
+    each one's output up to its next long wait, all in one transaction
+    (see lcd_send_next_all()). When no display is ready, it sleeps until
+    the earliest one will be.
+
+    When there is only one bus, the caller's thread does the work.
+    Otherwise, there is a thread per bus, started the first time it is
+    needed. The threads wait on a condition variable for the flush
+    "generation" to change, and the caller waits for the number of busy
+    workers to drop to zero.
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/lcd_manager.h"
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct LCD_MANAGER_BUS {
+    LCD_MANAGER *manager;
+    LCD_TRANSPORT *transport;
+    char *dev;  // The device path, if the manager opened the transport
+    LCD **lcds;  // The displays on this bus
+    LCD **ready; // Scratch space for the ones that are ready for more
+    int count;
+    int size;
+    pthread_t thread;
+    _Bool started;
+    unsigned long gen; // The last flush this worker has handled
+} LCD_MANAGER_BUS;
+
+struct LCD_MANAGER {
+    LCD_MANAGER_BUS **buses;
+    int nbuses;
+    LCD **lcds; // Every display, in the order added
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    unsigned long gen;
+    int busy; // Workers that have not finished the current flush
+    _Bool stop;
+    LCD_TIMING timing; // For displays added from now on
+};
+
+/*============================================================================
+
+  lcd_manager_bus_run
+
+  Send all the pending output for the displays on one bus, interleaving
+  them so that the bus is kept busy while controllers are executing
+  instructions. Returns as soon as the last byte is on the bus: each
+  display's ready_at says when it will have finished its last
+  instruction, and the next write to it waits for that.
+
+============================================================================*/
+static void lcd_manager_bus_run(LCD_MANAGER_BUS *bus) {
+    for (;;) {
+        long long now = lcd_transport_now(bus->transport);
+        long long next = LLONG_MAX;
+        int ready = 0;
+        for (int i = 0; i < bus->count; i++) {
+            LCD *lcd = bus->lcds[i];
+            if (!lcd_pending(lcd))
+                continue;
+            long long ready_at = lcd_ready_at(lcd);
+            if (ready_at <= now)
+                bus->ready[ready++] = lcd;
+            else if (ready_at < next)
+                next = ready_at;
+        }
+        if (ready)
+            lcd_send_next_all(bus->ready, ready);
+        else if (next != LLONG_MAX)
+            lcd_transport_delay(bus->transport, next - now);
+        else
+            break;
+    }
+}
+
+/*============================================================================
+  lcd_manager_worker
+============================================================================*/
+static void *lcd_manager_worker(void *arg) {
+    LCD_MANAGER_BUS *bus = arg;
+    LCD_MANAGER *self = bus->manager;
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        while (!self->stop && bus->gen == self->gen)
+            pthread_cond_wait(&self->work, &self->lock);
+        if (self->stop)
+            break;
+        bus->gen = self->gen;
+        pthread_mutex_unlock(&self->lock);
+
+        lcd_manager_bus_run(bus);
+
+        pthread_mutex_lock(&self->lock);
+        if (--self->busy == 0)
+            pthread_cond_signal(&self->done);
+    }
+    pthread_mutex_unlock(&self->lock);
+    return NULL;
+}
+
+/*============================================================================
+  lcd_manager_create
+============================================================================*/
+LCD_MANAGER *lcd_manager_create(void) {
+    LCD_MANAGER *self = malloc(sizeof(LCD_MANAGER));
+    memset(self, 0, sizeof(LCD_MANAGER));
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->work, NULL);
+    pthread_cond_init(&self->done, NULL);
+    lcd_get_timing_preset(LCD_TIMING_DATASHEET, &self->timing);
+    return self;
+}
+
+/*============================================================================
+  lcd_manager_destroy
+============================================================================*/
+void lcd_manager_destroy(LCD_MANAGER *self) {
+    if (!self)
+        return;
+    pthread_mutex_lock(&self->lock);
+    self->stop = 1;
+    pthread_cond_broadcast(&self->work);
+    pthread_mutex_unlock(&self->lock);
+    for (int i = 0; i < self->nbuses; i++) {
+        LCD_MANAGER_BUS *bus = self->buses[i];
+        if (bus->started)
+            pthread_join(bus->thread, NULL);
+        for (int j = 0; j < bus->count; j++)
+            lcd_destroy(bus->lcds[j]);
+        if (bus->dev) {
+            lcd_transport_destroy(bus->transport);
+            free(bus->dev);
+        }
+        free(bus->lcds);
+        free(bus->ready);
+        free(bus);
+    }
+    free(self->buses);
+    free(self->lcds);
+    pthread_mutex_destroy(&self->lock);
+    pthread_cond_destroy(&self->work);
+    pthread_cond_destroy(&self->done);
+    free(self);
+}
+
+/*============================================================================
+  lcd_manager_set_timing
+============================================================================*/
+void lcd_manager_set_timing(LCD_MANAGER *self, const LCD_TIMING *timing) {
+    assert(self != NULL);
+    assert(timing != NULL);
+    self->timing = *timing;
+}
+
+/*============================================================================
+
+  lcd_manager_bus
+
+  Find the bus that uses the given transport or, if transport is NULL,
+  the bus that the manager opened on the given device. Returns NULL if
+  there is no such bus yet.
+
+============================================================================*/
+static LCD_MANAGER_BUS *lcd_manager_bus(LCD_MANAGER *self,
+                                        LCD_TRANSPORT *transport,
+                                        const char *dev) {
+    for (int i = 0; i < self->nbuses; i++) {
+        LCD_MANAGER_BUS *bus = self->buses[i];
+        if (transport && bus->transport == transport)
+            return bus;
+        if (dev && bus->dev && strcmp(bus->dev, dev) == 0)
+            return bus;
+    }
+    return NULL;
+}
+
+/*============================================================================
+  lcd_manager_new_bus
+============================================================================*/
+static LCD_MANAGER_BUS *lcd_manager_new_bus(LCD_MANAGER *self,
+                                            LCD_TRANSPORT *transport,
+                                            const char *dev) {
+    LCD_MANAGER_BUS *bus = malloc(sizeof(LCD_MANAGER_BUS));
+    memset(bus, 0, sizeof(LCD_MANAGER_BUS));
+    bus->manager = self;
+    bus->transport = transport;
+    bus->dev = dev ? strdup(dev) : NULL;
+    bus->gen = self->gen;
+    self->buses = realloc(
+        self->buses, (self->nbuses + 1) * sizeof(LCD_MANAGER_BUS *));
+    self->buses[self->nbuses++] = bus;
+    return bus;
+}
+
+/*============================================================================
+
+  lcd_manager_add_to_bus
+
+  Initialize a display on the given bus. Initialization is done here and
+  now, one display at a time -- it only happens once, and it makes the
+  error handling simple.
+
+============================================================================*/
+static LCD *lcd_manager_add_to_bus(LCD_MANAGER *self,
+                                   LCD_MANAGER_BUS *bus,
+                                   int addr,
+                                   int rows,
+                                   int cols,
+                                   char **error) {
+    LCD *lcd = lcd_create(addr, rows, cols);
+    lcd_set_timing(lcd, &self->timing);
+    if (!lcd_init_transport(lcd, bus->transport, error)) {
+        lcd_destroy(lcd);
+        return NULL;
+    }
+    lcd_set_deferred(lcd, 1);
+    if (bus->count == bus->size) {
+        bus->size = bus->size ? 2 * bus->size : 4;
+        bus->lcds = realloc(bus->lcds, bus->size * sizeof(LCD *));
+        bus->ready = realloc(bus->ready, bus->size * sizeof(LCD *));
+    }
+    bus->lcds[bus->count++] = lcd;
+    self->lcds = realloc(self->lcds, (self->count + 1) * sizeof(LCD *));
+    self->lcds[self->count++] = lcd;
+    return lcd;
+}
+
+/*============================================================================
+  lcd_manager_add
+============================================================================*/
+LCD *lcd_manager_add(LCD_MANAGER *self,
+                     LCD_TRANSPORT *transport,
+                     int addr,
+                     int rows,
+                     int cols,
+                     char **error) {
+    assert(self != NULL);
+    assert(transport != NULL);
+    LCD_MANAGER_BUS *bus = lcd_manager_bus(self, transport, NULL);
+    if (!bus)
+        bus = lcd_manager_new_bus(self, transport, NULL);
+    return lcd_manager_add_to_bus(self, bus, addr, rows, cols, error);
+}
+
+/*============================================================================
+  lcd_manager_add_dev
+============================================================================*/
+LCD *lcd_manager_add_dev(LCD_MANAGER *self,
+                         const char *dev,
+                         int addr,
+                         int rows,
+                         int cols,
+                         char **error) {
+    assert(self != NULL);
+    assert(dev != NULL);
+    LCD_MANAGER_BUS *bus = lcd_manager_bus(self, NULL, dev);
+    if (!bus) {
+        LCD_TRANSPORT *transport = lcd_transport_i2c_auto_create(dev, error);
+        if (!transport)
+            return NULL;
+        bus = lcd_manager_new_bus(self, transport, dev);
+    }
+    return lcd_manager_add_to_bus(self, bus, addr, rows, cols, error);
+}
+
+/*============================================================================
+  lcd_manager_count
+============================================================================*/
+int lcd_manager_count(const LCD_MANAGER *self) {
+    assert(self != NULL);
+    return self->count;
+}
+
+/*============================================================================
+  lcd_manager_get
+============================================================================*/
+LCD *lcd_manager_get(const LCD_MANAGER *self, int i) {
+    assert(self != NULL);
+    assert(i >= 0 && i < self->count);
+    return self->lcds[i];
+}
+
+/*============================================================================
+
+  lcd_manager_flush
+
+  Work out what every display needs, in the caller's thread, and then
+  hand the buses to their workers. If a worker thread can't be started,
+  its bus is driven from this thread after the others have been set
+  going.
+
+============================================================================*/
+void lcd_manager_flush(LCD_MANAGER *self) {
+    assert(self != NULL);
+    for (int i = 0; i < self->count; i++)
+        lcd_encode(self->lcds[i]);
+
+    if (self->nbuses == 1) {
+        lcd_manager_bus_run(self->buses[0]);
+        return;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    for (int i = 0; i < self->nbuses; i++) {
+        LCD_MANAGER_BUS *bus = self->buses[i];
+        if (!bus->started)
+            bus->started = pthread_create(&bus->thread,
+                                          NULL,
+                                          lcd_manager_worker,
+                                          bus) == 0;
+        if (bus->started)
+            self->busy++;
+    }
+    self->gen++;
+    pthread_cond_broadcast(&self->work);
+    pthread_mutex_unlock(&self->lock);
+
+    for (int i = 0; i < self->nbuses; i++) {
+        LCD_MANAGER_BUS *bus = self->buses[i];
+        if (!bus->started)
+            lcd_manager_bus_run(bus);
+    }
+
+    pthread_mutex_lock(&self->lock);
+    while (self->busy > 0)
+        pthread_cond_wait(&self->done, &self->lock);
+    pthread_mutex_unlock(&self->lock);
+}
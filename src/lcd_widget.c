@@ -0,0 +1,332 @@
+/*==========================================================================
+
+    lcd_widget.c
+
+    Implementation of the bar graph and big-digit widgets that are
+    specified in lcd_widget.h.
+
+    Cells are described by one character each: '#' is the full block,
+    ' ' a space, and anything else is one of the shared glyphs in the
+    table below. A horizontal bar's partly-filled cell is one of the
+    glyphs '1'-'4', so that moving the bar changes which glyph the cell
+    shows, and nothing has to be uploaded. A vertical bar would need
+    seven such glyphs, which is most of CGRAM, so each vertical bar has
+    a glyph of its own for its partly-filled cell, and redefines it as
+    the bar moves -- the glyph cache then sends only the row of the
+    bitmap that changed.
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/lcd_widget.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The pixels in a cell, across and down
+#define LCD_WIDGET_CELL_W 5
+#define LCD_WIDGET_CELL_H 8
+
+// The glyph id of the first entry in lcd_widget_glyphs; the others
+//  count down from it
+#define LCD_WIDGET_GLYPH_ID -1
+// The glyph ids of vertical bars count down from here
+#define LCD_WIDGET_TIP_ID -100
+
+// The full block, in the A00 character set
+#define LCD_WIDGET_FULL 0xFF
+
+typedef struct LCD_WIDGET_GLYPH {
+    char code;
+    unsigned char bitmap[8];
+} LCD_WIDGET_GLYPH;
+
+static const LCD_WIDGET_GLYPH lcd_widget_glyphs[] = {
+    // Partly-filled cells of a horizontal bar
+    {'1', {0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10}},
+    {'2', {0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18}},
+    {'3', {0x1C, 0x1C, 0x1C, 0x1C, 0x1C, 0x1C, 0x1C, 0x1C}},
+    {'4', {0x1E, 0x1E, 0x1E, 0x1E, 0x1E, 0x1E, 0x1E, 0x1E}},
+    // The pieces of the big digits: bars at the top, bottom and middle
+    //  of a cell, and the middle bar joined to the top or bottom half
+    {'T', {0x1F, 0x1F, 0, 0, 0, 0, 0, 0}},
+    {'B', {0, 0, 0, 0, 0, 0, 0x1F, 0x1F}},
+    {'X', {0x1F, 0x1F, 0, 0, 0, 0, 0x1F, 0x1F}},
+    {'M', {0, 0, 0, 0x1F, 0x1F, 0, 0, 0}},
+    {'U', {0x1F, 0x1F, 0x1F, 0x1F, 0x1F, 0, 0, 0}},
+    {'L', {0, 0, 0, 0x1F, 0x1F, 0x1F, 0x1F, 0x1F}},
+};
+
+#define LCD_WIDGET_NGLYPHS \
+    (int)(sizeof(lcd_widget_glyphs) / sizeof(lcd_widget_glyphs[0]))
+
+// The digits 0-9 and '-', two rows high. The middle bar is at the
+//  bottom of the first row
+static const char *const lcd_widget_big2[11][2] = {
+    {"#T#", "#B#"}, {"  #", "  #"}, {"XX#", "#BB"}, {"XX#", "BB#"},
+    {"#B#", "  #"}, {"#XX", "BB#"}, {"#XX", "#B#"}, {"TT#", "  #"},
+    {"#X#", "#B#"}, {"#X#", "BB#"}, {"BBB", "   "},
+};
+
+// ...and three rows high, with the middle bar in the middle row
+static const char *const lcd_widget_big3[11][3] = {
+    {"#T#", "# #", "#B#"}, {"  #", "  #", "  #"}, {"TT#", "LMU", "#BB"},
+    {"TT#", "MM#", "BB#"}, {"# #", "UM#", "  #"}, {"#TT", "UML", "BB#"},
+    {"#TT", "#ML", "#B#"}, {"TT#", "  #", "  #"}, {"#T#", "#M#", "#B#"},
+    {"#T#", "UM#", "BB#"}, {"   ", "MMM", "   "},
+};
+
+struct LCD_BAR {
+    LCD *lcd;
+    int row;
+    int col;
+    int len;
+    _Bool vertical;
+    int max;
+    int pixels; // What's shown, -1 before the first lcd_bar_set()
+    int tip_id; // A vertical bar's glyph
+    LCD_CELL *cells; // The cells an update sends, len of them
+};
+
+struct LCD_BIGNUM {
+    LCD *lcd;
+    int row;
+    int col;
+    int height;
+    int width;
+    char *text; // What's shown, NUL for characters never drawn
+    LCD_CELL *cells; // The cells an update sends, 3 x height x width
+};
+
+static int lcd_widget_next_tip = LCD_WIDGET_TIP_ID;
+
+/*============================================================================
+
+  lcd_widget_define
+
+  Define the shared glyphs with the given codes. Defining a glyph again
+  with the same bitmap costs nothing, so every widget just defines the
+  ones it uses.
+
+============================================================================*/
+static void lcd_widget_define(LCD *lcd, const char *codes) {
+    for (int i = 0; i < LCD_WIDGET_NGLYPHS; i++)
+        if (strchr(codes, lcd_widget_glyphs[i].code))
+            lcd_define_glyph(lcd,
+                             LCD_WIDGET_GLYPH_ID - i,
+                             lcd_widget_glyphs[i].bitmap,
+                             '#');
+}
+
+/*============================================================================
+
+  lcd_widget_cell
+
+  Fill in one cell for lcd_write_cells(), described by its code.
+
+============================================================================*/
+static void lcd_widget_cell(LCD_CELL *cell, int row, int col, char code) {
+    memset(cell, 0, sizeof(LCD_CELL));
+    cell->row = row;
+    cell->col = col;
+    cell->c = code == '#' ? LCD_WIDGET_FULL : ' ';
+    for (int i = 0; i < LCD_WIDGET_NGLYPHS; i++) {
+        if (lcd_widget_glyphs[i].code == code) {
+            cell->glyph = 1;
+            cell->id = LCD_WIDGET_GLYPH_ID - i;
+        }
+    }
+}
+
+/*============================================================================
+  lcd_bar_create
+============================================================================*/
+LCD_BAR *lcd_bar_create(
+    LCD *lcd, int row, int col, int len, _Bool vertical, int max) {
+    assert(lcd != NULL);
+    assert(len > 0 && max > 0);
+    LCD_BAR *self = malloc(sizeof(LCD_BAR));
+    memset(self, 0, sizeof(LCD_BAR));
+    self->lcd = lcd;
+    self->row = row;
+    self->col = col;
+    self->len = len;
+    self->vertical = vertical;
+    self->max = max;
+    self->pixels = -1;
+    self->cells = malloc(len * sizeof(LCD_CELL));
+    if (vertical)
+        self->tip_id =
+            __atomic_fetch_sub(&lcd_widget_next_tip, 1, __ATOMIC_RELAXED);
+    else
+        lcd_widget_define(lcd, "1234");
+    return self;
+}
+
+/*============================================================================
+  lcd_bar_destroy
+============================================================================*/
+void lcd_bar_destroy(LCD_BAR *self) {
+    if (self) {
+        free(self->cells);
+        free(self);
+    }
+}
+
+/*============================================================================
+
+  lcd_bar_fill
+
+  How many pixels of cell i a bar of the given length fills.
+
+============================================================================*/
+static int lcd_bar_fill(int pixels, int i, int per_cell) {
+    int fill = pixels - i * per_cell;
+    return fill < 0 ? 0 : fill > per_cell ? per_cell : fill;
+}
+
+/*============================================================================
+
+  lcd_bar_draw
+
+  Fill in the cell for cell i of the bar, filled to fill pixels.
+
+============================================================================*/
+static void
+lcd_bar_draw(LCD_BAR *self, LCD_CELL *cell, int i, int fill, int per_cell) {
+    int row = self->vertical ? self->row - i : self->row;
+    int col = self->vertical ? self->col : self->col + i;
+    if (fill == 0) {
+        lcd_widget_cell(cell, row, col, ' ');
+    } else if (fill == per_cell) {
+        lcd_widget_cell(cell, row, col, '#');
+    } else if (self->vertical) {
+        lcd_widget_cell(cell, row, col, '#');
+        cell->glyph = 1;
+        cell->id = self->tip_id;
+    } else {
+        lcd_widget_cell(cell, row, col, '0' + fill);
+    }
+}
+
+/*============================================================================
+
+  lcd_bar_set
+
+  The cells that change are drawn first, apart from a vertical bar's
+  partly-filled cell. Then its glyph is redefined, and only then is it
+  drawn -- so that neither the cell it has moved from nor the one it
+  has moved to shows the wrong bitmap, even for a moment. The cells go
+  as one lcd_write_cells() update, and the glyph and its cell as a
+  second one.
+
+============================================================================*/
+void lcd_bar_set(LCD_BAR *self, int value) {
+    assert(self != NULL);
+    int per_cell = self->vertical ? LCD_WIDGET_CELL_H : LCD_WIDGET_CELL_W;
+    int range = self->len * per_cell;
+    if (value < 0)
+        value = 0;
+    if (value > self->max)
+        value = self->max;
+    int pixels = (int)(((long)value * range + self->max / 2) / self->max);
+    int old = self->pixels;
+    if (pixels == old)
+        return;
+    self->pixels = pixels;
+
+    int n = 0;
+    int tip = -1;
+    for (int i = 0; i < self->len; i++) {
+        int fill = lcd_bar_fill(pixels, i, per_cell);
+        int was = old < 0 ? -1 : lcd_bar_fill(old, i, per_cell);
+        if (self->vertical && fill > 0 && fill < per_cell) {
+            tip = i;
+            continue;
+        }
+        if (fill != was)
+            lcd_bar_draw(self, &self->cells[n++], i, fill, per_cell);
+    }
+    lcd_write_cells(self->lcd, self->cells, n);
+    if (tip < 0)
+        return;
+
+    int fill = lcd_bar_fill(pixels, tip, per_cell);
+    unsigned char bitmap[LCD_WIDGET_CELL_H];
+    for (int r = 0; r < LCD_WIDGET_CELL_H; r++)
+        bitmap[r] = r >= LCD_WIDGET_CELL_H - fill ? 0x1F : 0;
+    // If the cell already shows the glyph, writing it again changes
+    //  nothing, so the update is just the new bitmap
+    LCD_CELL cell;
+    lcd_bar_draw(self, &cell, tip, fill, per_cell);
+    cell.bitmap = bitmap;
+    lcd_write_cells(self->lcd, &cell, 1);
+}
+
+/*============================================================================
+  lcd_bignum_create
+============================================================================*/
+LCD_BIGNUM *lcd_bignum_create(
+    LCD *lcd, int row, int col, int height, int width) {
+    assert(lcd != NULL);
+    assert(height == 2 || height == 3);
+    assert(width > 0);
+    LCD_BIGNUM *self = malloc(sizeof(LCD_BIGNUM));
+    memset(self, 0, sizeof(LCD_BIGNUM));
+    self->lcd = lcd;
+    self->row = row;
+    self->col = col;
+    self->height = height;
+    self->width = width;
+    self->text = malloc(width);
+    memset(self->text, 0, width);
+    self->cells = malloc(3 * height * width * sizeof(LCD_CELL));
+    lcd_widget_define(lcd, height == 2 ? "TBX" : "TBMUL");
+    return self;
+}
+
+/*============================================================================
+  lcd_bignum_destroy
+============================================================================*/
+void lcd_bignum_destroy(LCD_BIGNUM *self) {
+    if (self) {
+        free(self->text);
+        free(self->cells);
+        free(self);
+    }
+}
+
+/*============================================================================
+
+  lcd_bignum_set
+
+  The cells of the characters that change go as one lcd_write_cells()
+  update.
+
+============================================================================*/
+void lcd_bignum_set(LCD_BIGNUM *self, const char *text) {
+    assert(self != NULL);
+    assert(text != NULL);
+    int n = 0;
+    for (int i = 0; i < self->width; i++) {
+        char c = *text ? *text++ : ' ';
+        int glyph = c >= '0' && c <= '9' ? c - '0' : c == '-' ? 10 : -1;
+        if (glyph < 0)
+            c = ' ';
+        if (c == self->text[i])
+            continue;
+        self->text[i] = c;
+        for (int r = 0; r < self->height; r++) {
+            const char *cells =
+                glyph < 0            ? "   "
+                : self->height == 2 ? lcd_widget_big2[glyph][r]
+                                    : lcd_widget_big3[glyph][r];
+            for (int k = 0; k < 3; k++)
+                lcd_widget_cell(&self->cells[n++],
+                                self->row + r,
+                                self->col + 4 * i + k,
+                                cells[k]);
+        }
+    }
+    lcd_write_cells(self->lcd, self->cells, n);
+}
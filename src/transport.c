@@ -0,0 +1,939 @@
+/*==========================================================================
+
+    transport.c
+
+    Implementations of the transports specified in transport.h -- two
+    ways of driving a real /dev/i2c-x device, an in-memory mock, a
+    file sink, and a recorder that sits in front of any of them.
+
+    Distributed under the terms of the GNU Public Licence, v3.0
+
+============================================================================*/
+#include "../lib/transport.h"
+#include "../lib/err_msg.h"
+#include "../lib/hd44780_emu.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+// The PCF8574 has 7-bit addresses, so this is the number of distinct
+//  devices a transport might be asked to talk to
+#define TRANSPORT_MAX_ADDR 128
+
+// The I2C clock rate that the virtual transports assume by default
+#define TRANSPORT_DEFAULT_BUS_HZ 100000
+
+// The length of the test sleeps used to measure how late the scheduler
+//  wakes us up
+#define TRANSPORT_CALIBRATE_NS 50000
+
+/*============================================================================
+
+  transport_now_ns
+
+============================================================================*/
+static long long transport_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*============================================================================
+
+  transport_calibrate
+
+  Find out how late clock_nanosleep() wakes up, by sleeping for a short
+  interval a few times and keeping the worst overshoot. Waits shorter than
+  this are better done by spinning on the clock, because the sleep would
+  overrun them anyway.
+
+============================================================================*/
+static long transport_slack_ns;
+
+static void transport_calibrate(void) {
+    long worst = 0;
+    for (int i = 0; i < 5; i++) {
+        long long start = transport_now_ns();
+        struct timespec ts = {0, TRANSPORT_CALIBRATE_NS};
+        clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+        long over = transport_now_ns() - start - TRANSPORT_CALIBRATE_NS;
+        if (over > worst)
+            worst = over;
+    }
+    transport_slack_ns = worst;
+}
+
+/*============================================================================
+
+  transport_sleep_ns
+
+  Wait for a real interval. Most of the interval is spent asleep in
+  clock_nanosleep(), with an absolute deadline so that interruptions by
+  signals don't stretch it. The last part, which is about as long as the
+  scheduler's wake-up latency, is spent spinning on the clock. So
+  a 40usec wait takes 40usec, not the 100usec or so that a plain sleep
+  would.
+
+============================================================================*/
+static void transport_sleep_ns(long ns) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, transport_calibrate);
+
+    long long deadline = transport_now_ns() + ns;
+    if (ns > transport_slack_ns) {
+        long long wake = deadline - transport_slack_ns;
+        struct timespec ts;
+        ts.tv_sec = wake / 1000000000LL;
+        ts.tv_nsec = wake % 1000000000LL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR)
+            ;
+    }
+    while (transport_now_ns() < deadline)
+        ;
+}
+
+/*============================================================================
+
+  transport_bus_time
+
+  Work out how long a write of len bytes occupies an I2C bus running at
+  bus_hz. Each byte is nine clocks (eight data bits and the acknowledge),
+  and there's an address byte and start/stop conditions on top.
+
+============================================================================*/
+static long long transport_bus_time(long bus_hz, int len) {
+    long long clocks = 9LL * (len + 1) + 2;
+    return clocks * 1000000000LL / bus_hz;
+}
+
+/*============================================================================
+
+  transport_latch_time
+
+  Work out when, relative to the start of a write, the PCF8574 latches
+  byte i onto its outputs. That happens at the acknowledge of the byte,
+  which follows the start condition, the address byte and any earlier
+  data bytes.
+
+============================================================================*/
+static long long transport_latch_time(long bus_hz, int i) {
+    long long clocks = 1 + 9LL * (i + 2);
+    return clocks * 1000000000LL / bus_hz;
+}
+
+/*============================================================================
+
+  The i2c-dev transport, using write() and ioctl(I2C_SLAVE)
+
+============================================================================*/
+typedef struct I2C_TRANSPORT {
+    LCD_TRANSPORT base;
+    int fd;
+    int addr; // The slave address last selected, or -1
+} I2C_TRANSPORT;
+
+/*============================================================================
+  i2c_select
+============================================================================*/
+static _Bool i2c_select(I2C_TRANSPORT *self, int addr) {
+    if (self->addr != addr) {
+        if (ioctl(self->fd, I2C_SLAVE, addr) < 0)
+            return 0;
+        self->addr = addr;
+    }
+    return 1;
+}
+
+/*============================================================================
+  i2c_write
+============================================================================*/
+static _Bool i2c_write(LCD_TRANSPORT *base,
+                       int addr,
+                       const unsigned char *buf,
+                       int len) {
+    I2C_TRANSPORT *self = (I2C_TRANSPORT *)base;
+    if (!i2c_select(self, addr))
+        return 0;
+    return write(self->fd, buf, len) == len;
+}
+
+/*============================================================================
+  i2c_read
+============================================================================*/
+static _Bool
+i2c_read(LCD_TRANSPORT *base, int addr, unsigned char *buf, int len) {
+    I2C_TRANSPORT *self = (I2C_TRANSPORT *)base;
+    if (!i2c_select(self, addr))
+        return 0;
+    return read(self->fd, buf, len) == len;
+}
+
+/*============================================================================
+  i2c_delay
+============================================================================*/
+static void i2c_delay(LCD_TRANSPORT *base, long ns) {
+    (void)base;
+    transport_sleep_ns(ns);
+}
+
+/*============================================================================
+  i2c_close
+============================================================================*/
+static void i2c_close(LCD_TRANSPORT *base) {
+    I2C_TRANSPORT *self = (I2C_TRANSPORT *)base;
+    if (self->fd >= 0)
+        close(self->fd);
+    self->fd = -1;
+}
+
+static const LCD_TRANSPORT_OPS i2c_ops = {
+    "i2c-dev", i2c_write, i2c_read, i2c_delay, i2c_close, NULL, NULL};
+
+/*============================================================================
+  i2c_open
+
+  Common constructor for both kinds of i2c-dev transport
+============================================================================*/
+static LCD_TRANSPORT *
+i2c_open(const char *dev, const LCD_TRANSPORT_OPS *ops, char **error) {
+    int fd = open(dev, O_RDWR);
+    if (fd < 0) {
+        err_msg("Can't open I2C device", dev, errno, error);
+        return NULL;
+    }
+    I2C_TRANSPORT *self = malloc(sizeof(I2C_TRANSPORT));
+    memset(self, 0, sizeof(I2C_TRANSPORT));
+    self->base.ops = ops;
+    self->fd = fd;
+    self->addr = -1;
+    return &self->base;
+}
+
+/*============================================================================
+  lcd_transport_i2c_create
+============================================================================*/
+LCD_TRANSPORT *lcd_transport_i2c_create(const char *dev, char **error) {
+    return i2c_open(dev, &i2c_ops, error);
+}
+
+/*============================================================================
+
+  The i2c-dev transport, using ioctl(I2C_RDWR)
+
+  Each operation is a single kernel transaction with the slave address
+  in the message, so there's never a separate ioctl to change address.
+  Several messages can go in one transaction, which saves system calls,
+  and stops other traffic on a shared bus from getting between them.
+
+============================================================================*/
+
+/*============================================================================
+
+  rdwr_transfer
+
+  The kernel limits the number of messages in one transaction, so a
+  long list is split into as few transactions as possible.
+
+============================================================================*/
+static _Bool
+rdwr_transfer(LCD_TRANSPORT *base, LCD_TRANSPORT_MSG *msgs, int n) {
+    I2C_TRANSPORT *self = (I2C_TRANSPORT *)base;
+    struct i2c_msg m[I2C_RDWR_IOCTL_MAX_MSGS];
+    struct i2c_rdwr_ioctl_data data;
+    while (n > 0) {
+        int count = n < I2C_RDWR_IOCTL_MAX_MSGS ? n : I2C_RDWR_IOCTL_MAX_MSGS;
+        for (int i = 0; i < count; i++) {
+            m[i].addr = msgs[i].addr;
+            m[i].flags = msgs[i].read ? I2C_M_RD : 0;
+            m[i].len = msgs[i].len;
+            m[i].buf = msgs[i].buf;
+        }
+        data.msgs = m;
+        data.nmsgs = count;
+        if (ioctl(self->fd, I2C_RDWR, &data) < 0)
+            return 0;
+        msgs += count;
+        n -= count;
+    }
+    return 1;
+}
+
+/*============================================================================
+  rdwr_write
+============================================================================*/
+static _Bool rdwr_write(LCD_TRANSPORT *base,
+                        int addr,
+                        const unsigned char *buf,
+                        int len) {
+    LCD_TRANSPORT_MSG msg = {addr, 0, (unsigned char *)buf, len};
+    return rdwr_transfer(base, &msg, 1);
+}
+
+/*============================================================================
+  rdwr_read
+============================================================================*/
+static _Bool
+rdwr_read(LCD_TRANSPORT *base, int addr, unsigned char *buf, int len) {
+    LCD_TRANSPORT_MSG msg = {addr, 1, buf, len};
+    return rdwr_transfer(base, &msg, 1);
+}
+
+static const LCD_TRANSPORT_OPS rdwr_ops = {"i2c-rdwr",
+                                           rdwr_write,
+                                           rdwr_read,
+                                           i2c_delay,
+                                           i2c_close,
+                                           NULL,
+                                           rdwr_transfer};
+
+/*============================================================================
+  lcd_transport_i2c_rdwr_create
+============================================================================*/
+LCD_TRANSPORT *lcd_transport_i2c_rdwr_create(const char *dev, char **error) {
+    return i2c_open(dev, &rdwr_ops, error);
+}
+
+/*============================================================================
+  lcd_transport_i2c_auto_create
+============================================================================*/
+LCD_TRANSPORT *lcd_transport_i2c_auto_create(const char *dev, char **error) {
+    LCD_TRANSPORT *self = i2c_open(dev, &i2c_ops, error);
+    if (self) {
+        unsigned long funcs = 0;
+        if (ioctl(((I2C_TRANSPORT *)self)->fd, I2C_FUNCS, &funcs) >= 0 &&
+            (funcs & I2C_FUNC_I2C))
+            self->ops = &rdwr_ops;
+    }
+    return self;
+}
+
+/*============================================================================
+
+  The mock transport
+
+  Every byte is appended to an array of records, with the time at which
+  it would have been latched by the PCF8574. Reads return the last
+  value written to the device, which is what a real PCF8574 returns for
+  any pin that it is driving -- unless an HD44780 model is attached to
+  the address, in which case the bytes are fed to the model, and reads
+  return whatever the model drives onto the pins -- or, for the two
+  models of a 40x4 display, whatever either of them pulls low.
+
+============================================================================*/
+typedef struct MOCK_TRANSPORT {
+    LCD_TRANSPORT base;
+    long bus_hz;
+    long long now_ns;
+    LCD_MOCK_RECORD *records;
+    int count;
+    int size;
+    long writes;
+    long calls; // Writes, reads and sleeps -- what would be system calls
+    unsigned char latch[TRANSPORT_MAX_ADDR];
+    HD44780_EMU *emu[TRANSPORT_MAX_ADDR];
+    HD44780_EMU *emu2[TRANSPORT_MAX_ADDR]; // The second controller, if any
+} MOCK_TRANSPORT;
+
+/*============================================================================
+  mock_put
+============================================================================*/
+static void
+mock_put(MOCK_TRANSPORT *self, int addr, const unsigned char *buf, int len) {
+    if (self->count + len > self->size) {
+        while (self->count + len > self->size)
+            self->size = self->size ? self->size * 2 : 1024;
+        self->records =
+            realloc(self->records, self->size * sizeof(LCD_MOCK_RECORD));
+    }
+    HD44780_EMU *emu = self->emu[addr & (TRANSPORT_MAX_ADDR - 1)];
+    HD44780_EMU *emu2 = self->emu2[addr & (TRANSPORT_MAX_ADDR - 1)];
+    long long start = self->now_ns;
+    for (int i = 0; i < len; i++) {
+        LCD_MOCK_RECORD *r = &self->records[self->count++];
+        r->t_ns = start + transport_latch_time(self->bus_hz, i);
+        r->addr = addr;
+        r->byte = buf[i];
+        if (emu)
+            hd44780_emu_latch(emu, r->t_ns, buf[i]);
+        if (emu2)
+            hd44780_emu_latch(emu2, r->t_ns, buf[i]);
+    }
+    if (len > 0)
+        self->latch[addr & (TRANSPORT_MAX_ADDR - 1)] = buf[len - 1];
+    self->now_ns += transport_bus_time(self->bus_hz, len);
+    self->writes++;
+}
+
+/*============================================================================
+  mock_get
+============================================================================*/
+static void
+mock_get(MOCK_TRANSPORT *self, int addr, unsigned char *buf, int len) {
+    HD44780_EMU *emu = self->emu[addr & (TRANSPORT_MAX_ADDR - 1)];
+    HD44780_EMU *emu2 = self->emu2[addr & (TRANSPORT_MAX_ADDR - 1)];
+    for (int i = 0; i < len; i++) {
+        long long t = self->now_ns + transport_latch_time(self->bus_hz, i);
+        buf[i] = self->latch[addr & (TRANSPORT_MAX_ADDR - 1)];
+        // The controllers share the data lines, and either one can pull
+        //  a line low -- only the one whose E is high is driving them
+        if (emu)
+            buf[i] &= hd44780_emu_pins(emu, t);
+        if (emu2)
+            buf[i] &= hd44780_emu_pins(emu2, t);
+    }
+    self->now_ns += transport_bus_time(self->bus_hz, len);
+}
+
+/*============================================================================
+  mock_write
+============================================================================*/
+static _Bool mock_write(LCD_TRANSPORT *base,
+                        int addr,
+                        const unsigned char *buf,
+                        int len) {
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    mock_put(self, addr, buf, len);
+    self->calls++;
+    return 1;
+}
+
+/*============================================================================
+  mock_read
+============================================================================*/
+static _Bool
+mock_read(LCD_TRANSPORT *base, int addr, unsigned char *buf, int len) {
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    mock_get(self, addr, buf, len);
+    self->calls++;
+    return 1;
+}
+
+/*============================================================================
+  mock_transfer
+============================================================================*/
+static _Bool
+mock_transfer(LCD_TRANSPORT *base, LCD_TRANSPORT_MSG *msgs, int n) {
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    for (int i = 0; i < n; i++) {
+        if (msgs[i].read)
+            mock_get(self, msgs[i].addr, msgs[i].buf, msgs[i].len);
+        else
+            mock_put(self, msgs[i].addr, msgs[i].buf, msgs[i].len);
+    }
+    self->calls++;
+    return 1;
+}
+/*============================================================================
+  mock_delay
+============================================================================*/
+static void mock_delay(LCD_TRANSPORT *base, long ns) {
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    if (ns > 0) {
+        self->now_ns += ns;
+        self->calls++;
+    }
+}
+
+/*============================================================================
+  mock_close
+============================================================================*/
+static void mock_close(LCD_TRANSPORT *base) {
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    free(self->records);
+    self->records = NULL;
+    self->count = self->size = 0;
+}
+
+/*============================================================================
+  mock_now
+============================================================================*/
+static long long mock_now(LCD_TRANSPORT *base) {
+    return ((MOCK_TRANSPORT *)base)->now_ns;
+}
+
+static const LCD_TRANSPORT_OPS mock_ops = {"mock",
+                                           mock_write,
+                                           mock_read,
+                                           mock_delay,
+                                           mock_close,
+                                           mock_now,
+                                           mock_transfer};
+
+/*============================================================================
+  lcd_transport_mock_create
+============================================================================*/
+LCD_TRANSPORT *lcd_transport_mock_create(void) {
+    MOCK_TRANSPORT *self = malloc(sizeof(MOCK_TRANSPORT));
+    memset(self, 0, sizeof(MOCK_TRANSPORT));
+    self->base.ops = &mock_ops;
+    self->bus_hz = TRANSPORT_DEFAULT_BUS_HZ;
+    return &self->base;
+}
+
+/*============================================================================
+  lcd_transport_mock_records
+============================================================================*/
+const LCD_MOCK_RECORD *lcd_transport_mock_records(LCD_TRANSPORT *base,
+                                                  int *count) {
+    assert(base->ops == &mock_ops);
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    *count = self->count;
+    return self->records;
+}
+
+/*============================================================================
+  lcd_transport_mock_attach
+============================================================================*/
+void lcd_transport_mock_attach(LCD_TRANSPORT *base,
+                               int addr,
+                               struct HD44780_EMU *emu) {
+    assert(base->ops == &mock_ops);
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    self->emu[addr & (TRANSPORT_MAX_ADDR - 1)] = emu;
+}
+
+/*============================================================================
+  lcd_transport_mock_attach_second
+============================================================================*/
+void lcd_transport_mock_attach_second(LCD_TRANSPORT *base,
+                                      int addr,
+                                      struct HD44780_EMU *emu) {
+    assert(base->ops == &mock_ops);
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    self->emu2[addr & (TRANSPORT_MAX_ADDR - 1)] = emu;
+}
+
+/*============================================================================
+  lcd_transport_mock_writes
+============================================================================*/
+long lcd_transport_mock_writes(LCD_TRANSPORT *base) {
+    assert(base->ops == &mock_ops);
+    return ((MOCK_TRANSPORT *)base)->writes;
+}
+
+/*============================================================================
+  lcd_transport_mock_calls
+============================================================================*/
+long lcd_transport_mock_calls(LCD_TRANSPORT *base) {
+    assert(base->ops == &mock_ops);
+    return ((MOCK_TRANSPORT *)base)->calls;
+}
+
+/*============================================================================
+  lcd_transport_mock_reset
+============================================================================*/
+void lcd_transport_mock_reset(LCD_TRANSPORT *base) {
+    assert(base->ops == &mock_ops);
+    MOCK_TRANSPORT *self = (MOCK_TRANSPORT *)base;
+    self->count = 0;
+    self->writes = 0;
+    self->calls = 0;
+}
+
+/*============================================================================
+
+  The file transport
+
+  Like the mock, this runs on a virtual clock, but it writes each byte
+  to a file as soon as it arrives rather than keeping it in memory.
+
+============================================================================*/
+typedef struct FILE_TRANSPORT {
+    LCD_TRANSPORT base;
+    long bus_hz;
+    long long now_ns;
+    FILE *f;
+} FILE_TRANSPORT;
+
+/*============================================================================
+  file_write
+============================================================================*/
+static _Bool file_write(LCD_TRANSPORT *base,
+                        int addr,
+                        const unsigned char *buf,
+                        int len) {
+    FILE_TRANSPORT *self = (FILE_TRANSPORT *)base;
+    long long start = self->now_ns;
+    for (int i = 0; i < len; i++) {
+        long long t = start + transport_latch_time(self->bus_hz, i);
+        if (fprintf(self->f, "%lld 0x%02x 0x%02x\n", t, addr, buf[i]) < 0)
+            return 0;
+    }
+    self->now_ns += transport_bus_time(self->bus_hz, len);
+    return 1;
+}
+
+/*============================================================================
+  file_delay
+============================================================================*/
+static void file_delay(LCD_TRANSPORT *base, long ns) {
+    FILE_TRANSPORT *self = (FILE_TRANSPORT *)base;
+    self->now_ns += ns;
+}
+
+/*============================================================================
+  file_close
+============================================================================*/
+static void file_close(LCD_TRANSPORT *base) {
+    FILE_TRANSPORT *self = (FILE_TRANSPORT *)base;
+    if (self->f)
+        fclose(self->f);
+    self->f = NULL;
+}
+
+/*============================================================================
+  file_now
+============================================================================*/
+static long long file_now(LCD_TRANSPORT *base) {
+    return ((FILE_TRANSPORT *)base)->now_ns;
+}
+
+static const LCD_TRANSPORT_OPS file_ops = {
+    "file", file_write, NULL, file_delay, file_close, file_now, NULL};
+
+/*============================================================================
+  lcd_transport_file_create
+============================================================================*/
+LCD_TRANSPORT *lcd_transport_file_create(const char *path, char **error) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        err_msg("Can't open trace file", path, errno, error);
+        return NULL;
+    }
+    FILE_TRANSPORT *self = malloc(sizeof(FILE_TRANSPORT));
+    memset(self, 0, sizeof(FILE_TRANSPORT));
+    self->base.ops = &file_ops;
+    self->bus_hz = TRANSPORT_DEFAULT_BUS_HZ;
+    self->f = f;
+    return &self->base;
+}
+
+/*============================================================================
+
+  The trace transport
+
+  This passes every operation on to another transport, and appends a
+  record of each write and read to a file, in the binary format given
+  in transport.h. Numbers are unsigned LEB128: seven bits to a byte,
+  low bits first, with the top bit set on every byte but the last.
+  Output goes through stdio, so recording costs a few stores per byte,
+  not a system call.
+
+============================================================================*/
+typedef struct TRACE_TRANSPORT {
+    LCD_TRANSPORT base;
+    LCD_TRANSPORT_OPS ops;
+    LCD_TRANSPORT *inner;
+    long long last_ns; // The start of the previous record
+    FILE *f;
+} TRACE_TRANSPORT;
+
+/*============================================================================
+  trace_number
+============================================================================*/
+static void trace_number(FILE *f, unsigned long long v) {
+    while (v >= 0x80) {
+        putc((int)(v & 0x7F) | 0x80, f);
+        v >>= 7;
+    }
+    putc((int)v, f);
+}
+
+/*============================================================================
+
+  trace_record
+
+  Append a record of the given type, for an operation that started at
+  start_ns and took dur_ns. Times on a real clock don't go backwards,
+  but a record is never allowed to start before the previous one.
+
+============================================================================*/
+static void trace_record(TRACE_TRANSPORT *self,
+                         int type,
+                         long long start_ns,
+                         long long dur_ns,
+                         int addr,
+                         const unsigned char *buf,
+                         int len) {
+    if (start_ns < self->last_ns)
+        start_ns = self->last_ns;
+    putc(type, self->f);
+    trace_number(self->f, start_ns - self->last_ns);
+    self->last_ns = start_ns;
+    if (type == LCD_TRACE_MARK)
+        return;
+    trace_number(self->f, dur_ns > 0 ? dur_ns : 0);
+    putc(addr, self->f);
+    trace_number(self->f, len);
+    fwrite(buf, 1, len, self->f);
+}
+
+/*============================================================================
+  trace_write
+============================================================================*/
+static _Bool trace_write(LCD_TRANSPORT *base,
+                         int addr,
+                         const unsigned char *buf,
+                         int len) {
+    TRACE_TRANSPORT *self = (TRACE_TRANSPORT *)base;
+    long long start = lcd_transport_now(self->inner);
+    _Bool ok = lcd_transport_write(self->inner, addr, buf, len);
+    if (ok)
+        trace_record(self,
+                     LCD_TRACE_WRITE,
+                     start,
+                     lcd_transport_now(self->inner) - start,
+                     addr,
+                     buf,
+                     len);
+    return ok;
+}
+
+/*============================================================================
+  trace_read
+============================================================================*/
+static _Bool
+trace_read(LCD_TRANSPORT *base, int addr, unsigned char *buf, int len) {
+    TRACE_TRANSPORT *self = (TRACE_TRANSPORT *)base;
+    long long start = lcd_transport_now(self->inner);
+    _Bool ok = lcd_transport_read(self->inner, addr, buf, len);
+    if (ok)
+        trace_record(self,
+                     LCD_TRACE_READ,
+                     start,
+                     lcd_transport_now(self->inner) - start,
+                     addr,
+                     buf,
+                     len);
+    return ok;
+}
+
+/*============================================================================
+
+  trace_transfer
+
+  The time the whole transaction took is shared out among its messages
+  in proportion to the clocks that each one needs on the bus, and they
+  are recorded back to back.
+
+============================================================================*/
+static _Bool
+trace_transfer(LCD_TRANSPORT *base, LCD_TRANSPORT_MSG *msgs, int n) {
+    TRACE_TRANSPORT *self = (TRACE_TRANSPORT *)base;
+    long long start = lcd_transport_now(self->inner);
+    _Bool ok = lcd_transport_transfer(self->inner, msgs, n);
+    if (!ok)
+        return 0;
+    long long dur = lcd_transport_now(self->inner) - start;
+    long long clocks = 0;
+    for (int i = 0; i < n; i++)
+        clocks += 9LL * (msgs[i].len + 1) + 2;
+    for (int i = 0; i < n; i++) {
+        long long share =
+            clocks ? dur * (9LL * (msgs[i].len + 1) + 2) / clocks : 0;
+        trace_record(self,
+                     msgs[i].read ? LCD_TRACE_READ : LCD_TRACE_WRITE,
+                     start,
+                     share,
+                     msgs[i].addr,
+                     msgs[i].buf,
+                     msgs[i].len);
+        start += share;
+    }
+    return 1;
+}
+
+/*============================================================================
+  trace_delay
+============================================================================*/
+static void trace_delay(LCD_TRANSPORT *base, long ns) {
+    lcd_transport_delay(((TRACE_TRANSPORT *)base)->inner, ns);
+}
+
+/*============================================================================
+  trace_close
+============================================================================*/
+static void trace_close(LCD_TRANSPORT *base) {
+    TRACE_TRANSPORT *self = (TRACE_TRANSPORT *)base;
+    if (self->f)
+        fclose(self->f);
+    self->f = NULL;
+}
+
+/*============================================================================
+  trace_now
+============================================================================*/
+static long long trace_now(LCD_TRANSPORT *base) {
+    return lcd_transport_now(((TRACE_TRANSPORT *)base)->inner);
+}
+
+static const LCD_TRANSPORT_OPS trace_ops = {"trace",
+                                            trace_write,
+                                            trace_read,
+                                            trace_delay,
+                                            trace_close,
+                                            trace_now,
+                                            trace_transfer};
+
+/*============================================================================
+
+  lcd_transport_trace_create
+
+  The operations are copied into the object, so that the trace can't
+  read, or carry out transactions, unless the transport underneath can.
+
+============================================================================*/
+LCD_TRANSPORT *lcd_transport_trace_create(LCD_TRANSPORT *inner,
+                                          const char *path,
+                                          char **error) {
+    assert(inner != NULL);
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        err_msg("Can't open trace file", path, errno, error);
+        return NULL;
+    }
+    fwrite(LCD_TRACE_MAGIC, 1, sizeof(LCD_TRACE_MAGIC), f);
+    TRACE_TRANSPORT *self = malloc(sizeof(TRACE_TRANSPORT));
+    memset(self, 0, sizeof(TRACE_TRANSPORT));
+    self->ops = trace_ops;
+    if (!inner->ops->read)
+        self->ops.read = NULL;
+    if (!inner->ops->transfer)
+        self->ops.transfer = NULL;
+    self->base.ops = &self->ops;
+    self->inner = inner;
+    self->last_ns = lcd_transport_now(inner);
+    self->f = f;
+    return &self->base;
+}
+
+/*============================================================================
+  lcd_transport_trace_mark
+============================================================================*/
+void lcd_transport_trace_mark(LCD_TRANSPORT *base) {
+    assert(base != NULL);
+    if (base->ops->write != trace_write)
+        return;
+    TRACE_TRANSPORT *self = (TRACE_TRANSPORT *)base;
+    trace_record(self,
+                 LCD_TRACE_MARK,
+                 lcd_transport_now(self->inner),
+                 0,
+                 0,
+                 NULL,
+                 0);
+}
+
+/*============================================================================
+  lcd_transport_mock_set_bus_hz
+============================================================================*/
+void lcd_transport_mock_set_bus_hz(LCD_TRANSPORT *base, long hz) {
+    assert(hz > 0);
+    if (base->ops == &mock_ops)
+        ((MOCK_TRANSPORT *)base)->bus_hz = hz;
+    else if (base->ops == &file_ops)
+        ((FILE_TRANSPORT *)base)->bus_hz = hz;
+}
+
+/*============================================================================
+  lcd_transport_mock_now
+============================================================================*/
+long long lcd_transport_mock_now(LCD_TRANSPORT *base) {
+    if (base->ops == &mock_ops)
+        return ((MOCK_TRANSPORT *)base)->now_ns;
+    if (base->ops == &file_ops)
+        return ((FILE_TRANSPORT *)base)->now_ns;
+    return 0;
+}
+
+/*============================================================================
+  lcd_transport_destroy
+============================================================================*/
+void lcd_transport_destroy(LCD_TRANSPORT *self) {
+    if (self) {
+        if (self->ops->close)
+            self->ops->close(self);
+        free(self);
+    }
+}
+
+/*============================================================================
+  lcd_transport_write
+============================================================================*/
+_Bool lcd_transport_write(LCD_TRANSPORT *self,
+                          int addr,
+                          const unsigned char *buf,
+                          int len) {
+    assert(self != NULL);
+    return self->ops->write(self, addr, buf, len);
+}
+
+/*============================================================================
+  lcd_transport_read
+============================================================================*/
+_Bool lcd_transport_read(LCD_TRANSPORT *self,
+                         int addr,
+                         unsigned char *buf,
+                         int len) {
+    assert(self != NULL);
+    if (!self->ops->read)
+        return 0;
+    return self->ops->read(self, addr, buf, len);
+}
+
+/*============================================================================
+  lcd_transport_delay
+============================================================================*/
+void lcd_transport_delay(LCD_TRANSPORT *self, long ns) {
+    assert(self != NULL);
+    self->ops->delay(self, ns);
+}
+
+/*============================================================================
+  lcd_transport_transfer
+============================================================================*/
+_Bool lcd_transport_transfer(LCD_TRANSPORT *self,
+                             LCD_TRANSPORT_MSG *msgs,
+                             int n) {
+    assert(self != NULL);
+    if (self->ops->transfer)
+        return self->ops->transfer(self, msgs, n);
+    for (int i = 0; i < n; i++) {
+        _Bool ok = msgs[i].read
+                       ? lcd_transport_read(
+                             self, msgs[i].addr, msgs[i].buf, msgs[i].len)
+                       : lcd_transport_write(
+                             self, msgs[i].addr, msgs[i].buf, msgs[i].len);
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+/*============================================================================
+  lcd_transport_can_read
+============================================================================*/
+_Bool lcd_transport_can_read(LCD_TRANSPORT *self) {
+    assert(self != NULL);
+    return self->ops->read != NULL;
+}
+
+/*============================================================================
+  lcd_transport_now
+============================================================================*/
+long long lcd_transport_now(LCD_TRANSPORT *self) {
+    assert(self != NULL);
+    if (self->ops->now)
+        return self->ops->now(self);
+    return transport_now_ns();
+}